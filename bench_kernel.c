@@ -0,0 +1,1251 @@
+
+#include <assert.h>
+#include <time.h>
+#include <signal.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "tinyos.h"
+#include "unit_testing.h"
+#include "kernel_sched.h"
+#include "kernel_slab.h"
+#include "symposium.h"
+
+
+/*
+ *
+ *   BENCHMARKS
+ *
+ *   Each benchmark is a boot test, which reports its measurements
+ *   with MSG(). Run a benchmark on several virtual machines, e.g.,
+ *
+ *     ./bench_kernel -c 1,2,4,8,16 sched_benchmarks
+ *
+ *   to see how it scales with the number of cores.
+ */
+
+
+/* Return a monotonic wall-clock time in seconds */
+static double wall_time()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec + 1E-9*t.tv_nsec;
+}
+
+/* The resident set size of this program, in KB */
+static long resident_kb()
+{
+	long pages = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f != NULL) {
+		if(fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+		fclose(f);
+	}
+	return pages * (sysconf(_SC_PAGESIZE)/1024);
+}
+
+
+/*********************************************
+ *
+ *  Scheduler benchmarks
+ *
+ *********************************************/
+
+/* Number of independent thread pairs in bench_sched_throughput */
+#define SCHED_BENCH_PAIRS 16
+
+/* Number of handoffs of each pair */
+#define SCHED_BENCH_ROUNDS 20000
+
+/*
+	A pair of threads that pass a token back and forth,
+	via a mutex and a condition variable.
+ */
+typedef struct {
+	Mutex mx;
+	CondVar cv;
+	int turn;
+	unsigned int rounds;
+} pingpong_t;
+
+static int pingpong_player(int side, void* arg)
+{
+	pingpong_t* pp = arg;
+
+	Mutex_Lock(& pp->mx);
+	while(pp->rounds > 0) {
+		while(pp->turn != side && pp->rounds > 0)
+			Cond_Wait(& pp->mx, & pp->cv);
+		if(pp->rounds == 0) break;
+		pp->rounds--;
+		pp->turn = 1-side;
+		Cond_Signal(& pp->cv);
+	}
+	/* Release the other player */
+	Cond_Signal(& pp->cv);
+	Mutex_Unlock(& pp->mx);
+	return 0;
+}
+
+
+/* Report the calls to bios_set_timer() made and avoided by each core */
+static void report_timer_calls()
+{
+	for(uint c=0; c<cpu_cores(); c++)
+		MSG("core %2u: timer calls=%10lu  avoided=%10lu\n", c, cctx[c].timer_arms, cctx[c].timer_skips);
+}
+
+
+BOOT_TEST(bench_sched_throughput,
+	"Measure scheduler throughput, as thread handoffs per second, for a number\n"
+	"of independent thread pairs. This should increase with the number of cores.",
+	.timeout = 120
+	)
+{
+	pingpong_t pp[SCHED_BENCH_PAIRS];
+	Tid_t tids[2*SCHED_BENCH_PAIRS];
+
+	for(int i=0; i<SCHED_BENCH_PAIRS; i++) {
+		pp[i].mx = MUTEX_INIT;
+		pp[i].cv = COND_INIT;
+		pp[i].turn = 0;
+		pp[i].rounds = SCHED_BENCH_ROUNDS;
+	}
+
+	double t0 = wall_time();
+
+	for(int i=0; i<SCHED_BENCH_PAIRS; i++) {
+		tids[2*i] = CreateThread(pingpong_player, 0, &pp[i]);
+		tids[2*i+1] = CreateThread(pingpong_player, 1, &pp[i]);
+	}
+	for(int i=0; i<2*SCHED_BENCH_PAIRS; i++)
+		ThreadJoin(tids[i], NULL);
+
+	double T = wall_time() - t0;
+
+	for(int i=0; i<SCHED_BENCH_PAIRS; i++)
+		ASSERT(pp[i].rounds == 0);
+
+	MSG("policy=%-4s cores=%2u  pairs=%d  handoffs/sec=%12.0f\n", active_policy->name, cpu_cores(), SCHED_BENCH_PAIRS,
+		SCHED_BENCH_PAIRS*(double)SCHED_BENCH_ROUNDS / T);
+	report_timer_calls();
+	return 0;
+}
+
+
+/* Number of threads and yields per thread in bench_yield_cost */
+#define YIELD_BENCH_THREADS 4
+#define YIELD_BENCH_ROUNDS 100000
+
+static int yield_loop(int argl, void* args)
+{
+	/*
+		Move to the lowest priority level, so that every scheduling decision
+		must look past all the levels of the ready queue.
+	 */
+	cur_thread()->priority = QUEUE_NUMBER-1;
+
+	for(int i=0; i<argl; i++)
+		yield(SCHED_USER);
+	return 0;
+}
+
+
+BOOT_TEST(bench_yield_cost,
+	"Measure the cost of a yield(), for a number of threads at the lowest priority\n"
+	"level. Rebuild with 'make QUEUE_NUMBER=<n>' to compare different numbers of levels.",
+	.timeout = 60
+	)
+{
+	Tid_t tids[YIELD_BENCH_THREADS];
+
+	double t0 = wall_time();
+	for(int i=0; i<YIELD_BENCH_THREADS; i++)
+		tids[i] = CreateThread(yield_loop, YIELD_BENCH_ROUNDS, NULL);
+	for(int i=0; i<YIELD_BENCH_THREADS; i++)
+		ThreadJoin(tids[i], NULL);
+	double T = wall_time() - t0;
+
+	MSG("cores=%2u  levels=%2d  nsec/yield=%8.1f\n", cpu_cores(), QUEUE_NUMBER,
+		1E9 * T / (YIELD_BENCH_THREADS*(double)YIELD_BENCH_ROUNDS));
+	report_timer_calls();
+	return 0;
+}
+
+
+/*********************************************
+ *
+ *  Context switch benchmark
+ *
+ *********************************************/
+
+/* Number of round trips between the two contexts */
+#define SWITCH_BENCH_ROUNDS 2000000
+
+static cpu_context_t cs_main_ctx, cs_peer_ctx;
+static ucontext_t uc_main_ctx, uc_peer_ctx;
+static double cs_rate, uc_rate;
+
+static void cs_peer()
+{
+	while(1) cpu_swap_context(& cs_peer_ctx, & cs_main_ctx);
+}
+
+static void uc_peer()
+{
+	while(1) swapcontext(& uc_peer_ctx, & uc_main_ctx);
+}
+
+static void cs_bootfunc()
+{
+	static char cs_stack[64*1024], uc_stack[64*1024];
+
+	/* Switches happen with interrupts disabled, as in the scheduler */
+	cpu_disable_interrupts();
+
+	cpu_initialize_context(& cs_peer_ctx, cs_stack, sizeof(cs_stack), cs_peer);
+	double t0 = wall_time();
+	for(int i=0; i<SWITCH_BENCH_ROUNDS; i++)
+		cpu_swap_context(& cs_main_ctx, & cs_peer_ctx);
+	cs_rate = 2.0*SWITCH_BENCH_ROUNDS / (wall_time()-t0);
+
+	/* The same, with the glibc swapcontext */
+	getcontext(& uc_peer_ctx);
+	uc_peer_ctx.uc_stack.ss_sp = uc_stack;
+	uc_peer_ctx.uc_stack.ss_size = sizeof(uc_stack);
+	uc_peer_ctx.uc_link = NULL;
+	makecontext(& uc_peer_ctx, uc_peer, 0);
+	t0 = wall_time();
+	for(int i=0; i<SWITCH_BENCH_ROUNDS; i++)
+		swapcontext(& uc_main_ctx, & uc_peer_ctx);
+	uc_rate = 2.0*SWITCH_BENCH_ROUNDS / (wall_time()-t0);
+
+	cpu_enable_interrupts();
+}
+
+
+BARE_TEST(bench_context_switch,
+	"Measure the number of context switches per second between two contexts on\n"
+	"a single core, with cpu_swap_context and with the glibc swapcontext.",
+	.timeout = 60
+	)
+{
+	vm_boot(cs_bootfunc, 1, 0);
+	MSG("cpu_swap_context: switches/sec=%12.0f\n", cs_rate);
+	MSG("swapcontext:      switches/sec=%12.0f\n", uc_rate);
+}
+
+
+/* Number of disable/enable pairs in bench_interrupt_mask */
+#define INTR_BENCH_ROUNDS 10000000
+
+static double intr_nsec, sigmask_nsec;
+
+static void intr_bootfunc()
+{
+	double t0 = wall_time();
+	for(int i=0; i<INTR_BENCH_ROUNDS; i++) {
+		int pre = cpu_disable_interrupts();
+		if(pre) cpu_enable_interrupts();
+	}
+	intr_nsec = 1E9 * (wall_time()-t0) / INTR_BENCH_ROUNDS;
+
+	/* The same, by blocking SIGUSR1 */
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	t0 = wall_time();
+	for(int i=0; i<INTR_BENCH_ROUNDS/10; i++) {
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &usr1, NULL));
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &usr1, NULL));
+	}
+	sigmask_nsec = 1E9 * (wall_time()-t0) / (INTR_BENCH_ROUNDS/10);
+}
+
+
+BARE_TEST(bench_interrupt_mask,
+	"Measure the cost of a cpu_disable_interrupts()/cpu_enable_interrupts() pair\n"
+	"(as in preempt_off/preempt_on), and of blocking and unblocking SIGUSR1.",
+	.timeout = 60
+	)
+{
+	vm_boot(intr_bootfunc, 1, 0);
+	MSG("interrupt mask: nsec/pair=%8.1f\n", intr_nsec);
+	MSG("pthread_sigmask: nsec/pair=%8.1f\n", sigmask_nsec);
+}
+
+
+/* Number of CPU-bound threads in bench_cpu_share */
+#define SHARE_BENCH_HOGS 8
+
+static volatile int share_stop;
+static double share_cpu[SHARE_BENCH_HOGS];
+static double share_symposium_time;
+
+static int share_hog(int i, void* args)
+{
+	while(! share_stop)
+		fibo(15);
+
+	TCB* self = cur_thread();
+	share_cpu[i] = self->cpu_time + (bios_clock() - self->last_run);
+	return 0;
+}
+
+static int share_boot(int argl, void* args)
+{
+	Tid_t tids[SHARE_BENCH_HOGS];
+
+	share_stop = 0;
+	for(int i=0; i<SHARE_BENCH_HOGS; i++)
+		tids[i] = CreateThread(share_hog, i, NULL);
+
+	double t0 = wall_time();
+	Exec(SymposiumOfThreads, argl, args);
+	WaitChild(NOPROC, NULL);
+	share_symposium_time = wall_time() - t0;
+
+	share_stop = 1;
+	for(int i=0; i<SHARE_BENCH_HOGS; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_cpu_share,
+	"Measure how evenly each scheduling policy shares the CPU among a number of\n"
+	"CPU-bound threads, which run alongside a SymposiumOfThreads. Reports the\n"
+	"coefficient of variation (stddev/mean) and the max/min ratio of the CPU\n"
+	"shares of the threads, and the duration of the symposium.",
+	.timeout = 300
+	)
+{
+	const char* policies[] = { "mlfq", "rr", "fair", "cfs" };
+
+	symposium_t symp = { .N = 5, .bites = 5 };
+	adjust_symposium(&symp, -4, 0);
+
+	for(int p=0; p<4; p++) {
+		ASSERT(boot_sched_policy(policies[p]) == 0);
+
+		/* The philosophers print their state to stdout, silence them */
+		fflush(stdout);
+		int saved_stdout = dup(1);
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, 1);
+
+		boot(1, 0, share_boot, sizeof(symp), &symp);
+
+		fflush(stdout);
+		dup2(saved_stdout, 1);
+		close(devnull);
+		close(saved_stdout);
+
+		double sum = 0.0, min = INFINITY, max = 0.0;
+		for(int i=0; i<SHARE_BENCH_HOGS; i++) {
+			sum += share_cpu[i];
+			if(share_cpu[i] < min) min = share_cpu[i];
+			if(share_cpu[i] > max) max = share_cpu[i];
+		}
+		double mean = sum / SHARE_BENCH_HOGS, var = 0.0;
+		for(int i=0; i<SHARE_BENCH_HOGS; i++)
+			var += (share_cpu[i]-mean)*(share_cpu[i]-mean);
+		var /= SHARE_BENCH_HOGS;
+
+		MSG("policy=%-4s threads=%d  share cv=%6.3f  max/min=%7.2f  symposium sec=%6.2f\n",
+			policies[p], SHARE_BENCH_HOGS, sqrt(var)/mean, max/min, share_symposium_time);
+	}
+	ASSERT(boot_sched_policy(NULL) == 0);
+}
+
+
+/* Number of wakeups and usec between them in bench_wakeup_latency */
+#define LATENCY_BENCH_WAKEUPS 200
+#define LATENCY_BENCH_PERIOD 2000
+
+static Mutex lat_mx = MUTEX_INIT;
+static CondVar lat_cv = COND_INIT;
+static volatile int lat_flag;
+static double lat_stamp, lat_sum, lat_max;
+static unsigned long lat_preemptions;
+
+/* Wait for the hog to signal, and record how long it took to run */
+static int lat_sleeper(int argl, void* args)
+{
+	Mutex_Lock(&lat_mx);
+	for(int i=0; i<LATENCY_BENCH_WAKEUPS; i++) {
+		while(! lat_flag)
+			Cond_Wait(&lat_mx, &lat_cv);
+		lat_flag = 0;
+		double lat = wall_time() - lat_stamp;
+		lat_sum += lat;
+		if(lat > lat_max) lat_max = lat;
+	}
+	Mutex_Unlock(&lat_mx);
+	return 0;
+}
+
+/* 
+	Burn the CPU, and signal the sleeper about every LATENCY_BENCH_PERIOD usec.
+	This runs in a process of its own, so that "fair" charges it separately.
+ */
+static int lat_hog(int argl, void* args)
+{
+	/* Use up a few quanta first, to lose priority */
+	TimerDuration next = bios_clock() + 3*QUANTUM;
+	for(int i=0; i<LATENCY_BENCH_WAKEUPS; i++) {
+		/* Also wait for the previous wakeup to be seen */
+		while(bios_clock() < next || lat_flag)
+			fibo(10);
+		next = bios_clock() + LATENCY_BENCH_PERIOD;
+
+		Mutex_Lock(&lat_mx);
+		lat_flag = 1;
+		lat_stamp = wall_time();
+		Cond_Signal(&lat_cv);
+		Mutex_Unlock(&lat_mx);
+	}
+	return 0;
+}
+
+static int lat_boot(int argl, void* args)
+{
+	lat_flag = 0;
+	lat_sum = lat_max = 0.0;
+	Tid_t sleeper = CreateThread(lat_sleeper, 0, NULL);
+	Exec(lat_hog, 0, NULL);
+	WaitChild(NOPROC, NULL);
+	ThreadJoin(sleeper, NULL);
+	lat_preemptions = cctx[0].preempt_count;
+	return 0;
+}
+
+BARE_TEST(bench_wakeup_latency,
+	"Measure the latency from waking up a thread to running it, on a single\n"
+	"core kept busy by a CPU-bound process, under each scheduling policy. A woken\n"
+	"thread preempts the busy one only if the policy ranks it as more urgent;\n"
+	"else, it waits for the quantum of the busy thread to expire.",
+	.timeout = 120
+	)
+{
+	const char* policies[] = { "mlfq", "rr", "fair", "cfs" };
+
+	for(int p=0; p<4; p++) {
+		ASSERT(boot_sched_policy(policies[p]) == 0);
+		boot(1, 0, lat_boot, 0, NULL);
+		MSG("policy=%-4s wakeups=%d  latency avg usec=%8.1f  max usec=%8.1f  preemptions=%lu\n",
+			policies[p], LATENCY_BENCH_WAKEUPS, 1E6*lat_sum/LATENCY_BENCH_WAKEUPS, 1E6*lat_max,
+			lat_preemptions);
+	}
+	ASSERT(boot_sched_policy(NULL) == 0);
+}
+
+
+/* Number of threads created and joined, and threads alive at a time, in bench_thread_create */
+#define CREATE_BENCH_THREADS 20000
+#define CREATE_BENCH_BATCH 16
+
+static double create_rate;
+
+static int create_nop(int argl, void* args)
+{
+	return argl;
+}
+
+static int create_boot(int argl, void* args)
+{
+	Tid_t tids[CREATE_BENCH_BATCH];
+
+	double t0 = wall_time();
+	for(int n=0; n<CREATE_BENCH_THREADS; n+=CREATE_BENCH_BATCH) {
+		for(int i=0; i<CREATE_BENCH_BATCH; i++)
+			tids[i] = CreateThread(create_nop, i, NULL);
+		for(int i=0; i<CREATE_BENCH_BATCH; i++)
+			ThreadJoin(tids[i], NULL);
+	}
+	create_rate = CREATE_BENCH_THREADS / (wall_time() - t0);
+	return 0;
+}
+
+BARE_TEST(bench_thread_create,
+	"Measure the rate of thread creation, for threads that are created and joined\n"
+	"in batches, with and without recycling of the thread memory. Reports the\n"
+	"statistics of the thread pool.",
+	.timeout = 120
+	)
+{
+	unsigned int limits[] = { 0, THREAD_POOL_LIMIT };
+
+	for(int l=0; l<2; l++) {
+		boot_thread_pool(limits[l]);
+		for(uint ncores=1; ncores<=2; ncores++) {
+			boot(ncores, 0, create_boot, 0, NULL);
+
+			thread_pool_stats st;
+			get_thread_pool_stats(&st);
+			MSG("limit=%3u cores=%u  threads/sec=%10.0f  reused=%6lu allocated=%6lu released=%6lu depot peak=%3u\n",
+				st.limit, ncores, create_rate, st.reused, st.allocated, st.released, st.depot_peak);
+			ASSERT(st.allocated == st.released);
+		}
+	}
+	boot_thread_pool(THREAD_POOL_LIMIT);
+}
+
+
+/* Threads kept alive, and threads created and joined among them, in bench_thread_join */
+#define JOIN_BENCH_LIVE 10000
+#define JOIN_BENCH_THREADS 2000
+
+static Mutex join_mx = MUTEX_INIT;
+static CondVar join_cv = COND_INIT;
+static int join_go;
+static double join_rate[2];   /* Without and with the live threads */
+
+static int join_sleeper(int argl, void* args)
+{
+	Mutex_Lock(&join_mx);
+	while(! join_go)
+		Cond_Wait(&join_mx, &join_cv);
+	Mutex_Unlock(&join_mx);
+	return 0;
+}
+
+/* 
+  The rate of joins of threads that have exited. The threads are created in
+  batches, and the last one of each batch is joined first, untimed, so that
+  the rest have exited by the time they are joined.
+ */
+static double join_exited()
+{
+	Tid_t tids[CREATE_BENCH_BATCH];
+	double T = 0.0;
+
+	for(int n=0; n<JOIN_BENCH_THREADS; n+=CREATE_BENCH_BATCH) {
+		for(int i=0; i<CREATE_BENCH_BATCH; i++)
+			tids[i] = CreateThreadEx(create_nop, i, NULL, STACK_SMALL);
+		ASSERT(ThreadJoin(tids[CREATE_BENCH_BATCH-1], NULL) == 0);
+
+		double t0 = wall_time();
+		for(int i=0; i<CREATE_BENCH_BATCH-1; i++)
+			ASSERT(ThreadJoin(tids[i], NULL) == 0);
+		T += wall_time() - t0;
+	}
+	return JOIN_BENCH_THREADS*(CREATE_BENCH_BATCH-1.0)/CREATE_BENCH_BATCH / T;
+}
+
+static int join_boot(int argl, void* args)
+{
+	join_rate[0] = join_exited();
+
+	join_go = 0;
+	for(int i=0; i<JOIN_BENCH_LIVE; i++)
+		ASSERT(CreateThreadEx(join_sleeper, 0, NULL, STACK_SMALL) != NOTHREAD);
+	join_rate[1] = join_exited();
+
+	Mutex_Lock(&join_mx);
+	join_go = 1;
+	Cond_Broadcast(&join_cv);
+	Mutex_Unlock(&join_mx);
+	return 0;
+}
+
+BARE_TEST(bench_thread_join,
+	"Measure the rate of ThreadJoin on exited threads, in a process with no other\n"
+	"threads, and in a process with 10000 other live threads.",
+	.timeout = 120
+	)
+{
+	for(uint ncores=1; ncores<=2; ncores++) {
+		boot(ncores, 0, join_boot, 0, NULL);
+		MSG("cores=%u  joins/sec: alone=%10.0f  with %d threads=%10.0f\n", 
+			ncores, join_rate[0], JOIN_BENCH_LIVE, join_rate[1]);
+	}
+}
+
+
+TEST_SUITE(sched_benchmarks,
+	"Benchmarks for the scheduler."
+	)
+{
+	&bench_sched_throughput,
+	&bench_yield_cost,
+	&bench_cpu_share,
+	&bench_wakeup_latency,
+	&bench_thread_create,
+	&bench_thread_join,
+	&bench_context_switch,
+	&bench_interrupt_mask,
+	NULL
+};
+
+
+/*********************************************
+ *
+ *  System call benchmarks
+ *
+ *********************************************/
+
+/* Number of processes and write/read round trips per process in bench_syscall_throughput */
+#define SYSCALL_BENCH_PROCS 8
+#define SYSCALL_BENCH_ROUNDS 20000
+
+static int pipe_loop(int argl, void* args)
+{
+	pipe_t p;
+	char c = 'x';
+
+	ASSERT(Pipe(&p)==0);
+	for(int i=0; i<argl; i++) {
+		ASSERT(Write(p.write, &c, 1)==1);
+		ASSERT(Read(p.read, &c, 1)==1);
+	}
+	Close(p.read);
+	Close(p.write);
+	return 0;
+}
+
+
+BOOT_TEST(bench_syscall_throughput,
+	"Measure system call throughput, for a number of processes that each write and\n"
+	"read one byte on a private pipe. Since the processes share no kernel objects,\n"
+	"this should increase with the number of cores.",
+	.timeout = 120
+	)
+{
+	double t0 = wall_time();
+	for(int i=0; i<SYSCALL_BENCH_PROCS; i++)
+		ASSERT(Exec(pipe_loop, SYSCALL_BENCH_ROUNDS, NULL) != NOPROC);
+	for(int i=0; i<SYSCALL_BENCH_PROCS; i++)
+		ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	double T = wall_time() - t0;
+
+	MSG("cores=%2u  procs=%d  syscalls/sec=%12.0f\n", cpu_cores(), SYSCALL_BENCH_PROCS,
+		2.0*SYSCALL_BENCH_PROCS*SYSCALL_BENCH_ROUNDS / T);
+	return 0;
+}
+
+
+/* Number of open fids of the parent, and processes spawned, in bench_exec_latency */
+#define EXEC_BENCH_FIDS 1000
+#define EXEC_BENCH_ROUNDS 2000
+
+static int exec_nop(int argl, void* args)
+{
+	return 0;
+}
+
+/* Return the mean time, in usec, to Exec a process that returns at once, and reap it */
+static double exec_latency()
+{
+	double t0 = wall_time();
+	for(int i=0; i<EXEC_BENCH_ROUNDS; i++) {
+		Pid_t pid = Exec(exec_nop, 0, NULL);
+		ASSERT(pid != NOPROC);
+		ASSERT(WaitChild(pid, NULL) == pid);
+	}
+	return 1E6 * (wall_time() - t0) / EXEC_BENCH_ROUNDS;
+}
+
+
+BOOT_TEST(bench_exec_latency,
+	"Measure the time to Exec a child and wait for it, for a parent with no open\n"
+	"files, and for one with many. The child inherits all the files of the parent.",
+	.timeout = 120
+	)
+{
+	double lat0 = exec_latency();
+
+	ASSERT(SetFileLimit(EXEC_BENCH_FIDS) == 0);
+	for(int i=0; i<EXEC_BENCH_FIDS; i++)
+		ASSERT(OpenNull() != NOFILE);
+	double lat1 = exec_latency();
+
+	MSG("cores=%2u  usec/exec: fids=0 %8.2f  fids=%d %8.2f\n", cpu_cores(), 
+		lat0, EXEC_BENCH_FIDS, lat1);
+	for(int i=0; i<EXEC_BENCH_FIDS; i++)
+		Close(i);
+	return 0;
+}
+
+
+TEST_SUITE(syscall_benchmarks,
+	"Benchmarks for system calls."
+	)
+{
+	&bench_syscall_throughput,
+	&bench_exec_latency,
+	NULL
+};
+
+
+/*********************************************
+ *
+ *  Pipe benchmarks
+ *
+ *********************************************/
+
+/* Bytes transferred for each write size in bench_pipe_bandwidth */
+#define PIPE_BENCH_BYTES (16u<<20)
+
+/* The largest write size in bench_pipe_bandwidth */
+#define PIPE_BENCH_MAXWRITE (64u<<10)
+
+struct pipe_writer_args {
+	pipe_t pipe;
+	unsigned int chunk;
+	unsigned int total;
+};
+
+static int pipe_writer(int argl, void* args)
+{
+	struct pipe_writer_args* pw = args;
+	static char buf[PIPE_BENCH_MAXWRITE];
+
+	Close(pw->pipe.read);
+	for(unsigned int sent=0; sent < pw->total; ) {
+		unsigned int n = pw->total - sent;
+		if(n > pw->chunk) n = pw->chunk;
+		int rc = Write(pw->pipe.write, buf, n);
+		ASSERT(rc > 0);
+		sent += rc;
+	}
+	Close(pw->pipe.write);
+	return 0;
+}
+
+
+BOOT_TEST(bench_pipe_bandwidth,
+	"Measure pipe bandwidth, in MB/s, between a writer process that makes writes of\n"
+	"1B, 64B, 4KB and 64KB, and a reader process that reads as much as it can.",
+	.timeout = 120
+	)
+{
+	static char buf[PIPE_BENCH_MAXWRITE];
+	const unsigned int chunks[] = { 1, 64, 4<<10, 64<<10 };
+
+	for(unsigned int i=0; i < sizeof(chunks)/sizeof(chunks[0]); i++) {
+		struct pipe_writer_args pw;
+		ASSERT(Pipe(& pw.pipe)==0);
+		pw.chunk = chunks[i];
+		/* One-byte writes are slow; move less data with them */
+		pw.total = (chunks[i] < 64) ? PIPE_BENCH_BYTES/16 : PIPE_BENCH_BYTES;
+
+		double t0 = wall_time();
+		ASSERT(Exec(pipe_writer, sizeof(pw), &pw) != NOPROC);
+		Close(pw.pipe.write);
+
+		unsigned int received = 0;
+		while(received < pw.total) {
+			int rc = Read(pw.pipe.read, buf, sizeof(buf));
+			ASSERT(rc > 0);
+			received += rc;
+		}
+		double T = wall_time() - t0;
+
+		Close(pw.pipe.read);
+		ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+
+		MSG("cores=%2u  write=%6u  MB/sec=%9.1f\n", cpu_cores(), chunks[i],
+			received / T / (1<<20));
+	}
+	return 0;
+}
+
+
+/* Reads pw->total bytes from its pipe */
+static int pipe_reader(int argl, void* args)
+{
+	struct pipe_writer_args* pw = args;
+	static char buf[PIPE_BENCH_MAXWRITE];
+
+	Close(pw->pipe.write);
+	for(unsigned int received=0; received < pw->total; ) {
+		int rc = Read(pw->pipe.read, buf, sizeof(buf));
+		ASSERT(rc > 0);
+		received += rc;
+	}
+	Close(pw->pipe.read);
+	return 0;
+}
+
+
+/* 
+	Forward PIPE_BENCH_BYTES from a writer process to a reader process,
+	through two pipes, with Splice or with Read and Write. Returns MB/s.
+ */
+static double forward_bandwidth(int splice)
+{
+	static char buf[PIPE_BENCH_MAXWRITE];
+	struct pipe_writer_args in, out;
+
+	ASSERT(Pipe(& in.pipe)==0);
+	ASSERT(Pipe(& out.pipe)==0);
+	in.chunk = out.chunk = PIPE_BENCH_MAXWRITE;
+	in.total = out.total = PIPE_BENCH_BYTES;
+
+	double t0 = wall_time();
+	ASSERT(Exec(pipe_writer, sizeof(in), &in) != NOPROC);
+	ASSERT(Exec(pipe_reader, sizeof(out), &out) != NOPROC);
+	Close(in.pipe.write);
+	Close(out.pipe.read);
+
+	unsigned int moved = 0;
+	while(moved < PIPE_BENCH_BYTES) {
+		int rc;
+		if(splice) {
+			rc = Splice(in.pipe.read, out.pipe.write, PIPE_BENCH_MAXWRITE);
+			ASSERT(rc > 0);
+		}
+		else {
+			rc = Read(in.pipe.read, buf, sizeof(buf));
+			ASSERT(rc > 0);
+			for(int sent = 0; sent < rc; ) {
+				int wc = Write(out.pipe.write, buf+sent, rc-sent);
+				ASSERT(wc > 0);
+				sent += wc;
+			}
+		}
+		moved += rc;
+	}
+	Close(in.pipe.read);
+	Close(out.pipe.write);
+	ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	return moved / (wall_time() - t0) / (1<<20);
+}
+
+
+BOOT_TEST(bench_splice,
+	"Measure the bandwidth, in MB/s, of forwarding data from one pipe to another,\n"
+	"with Splice and with a loop of Read and Write.",
+	.timeout = 120
+	)
+{
+	MSG("cores=%2u  Splice:     MB/sec=%9.1f\n", cpu_cores(), forward_bandwidth(1));
+	MSG("cores=%2u  Read/Write: MB/sec=%9.1f\n", cpu_cores(), forward_bandwidth(0));
+	return 0;
+}
+
+
+/* Number of processes, and pipes created by each, in bench_pipe_churn */
+#define CHURN_BENCH_PROCS 8
+#define CHURN_BENCH_PIPES 20000
+
+static int pipe_churn(int argl, void* args)
+{
+	pipe_t p;
+	for(int i=0; i<argl; i++) {
+		ASSERT(Pipe(&p)==0);
+		Close(p.read);
+		Close(p.write);
+	}
+	return 0;
+}
+
+/* Find the statistics of a cache by name */
+static int find_kmem_stats(const char* name, kmem_stats* st)
+{
+	for(uint i=0; get_kmem_stats(i, st); i++)
+		if(strcmp(st->name, name)==0) return 1;
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_churn,
+	"Measure the rate at which a number of processes create and close pipes.\n"
+	"Reports the hit rate of the per-core FCB magazines, and the batches of\n"
+	"FCBs moved to and from the shared depot.",
+	.timeout = 120
+	)
+{
+	double t0 = wall_time();
+	for(int i=0; i<CHURN_BENCH_PROCS; i++)
+		ASSERT(Exec(pipe_churn, CHURN_BENCH_PIPES, NULL) != NOPROC);
+	for(int i=0; i<CHURN_BENCH_PROCS; i++)
+		ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	double T = wall_time() - t0;
+
+	MSG("cores=%2u  procs=%d  pipes/sec=%10.0f\n", cpu_cores(), CHURN_BENCH_PROCS,
+		CHURN_BENCH_PROCS*CHURN_BENCH_PIPES / T);
+
+	kmem_stats st;
+	if(find_kmem_stats("fcb", &st) && st.allocs > 0)
+		MSG("    fcb: allocs=%lu  hit rate=%5.1f%%  depot refills=%lu flushes=%lu\n",
+			st.allocs, 100.0*st.hits/st.allocs, st.refills, st.flushes);
+	return 0;
+}
+
+
+TEST_SUITE(pipe_benchmarks,
+	"Benchmarks for pipes."
+	)
+{
+	&bench_pipe_bandwidth,
+	&bench_splice,
+	&bench_pipe_churn,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Boot benchmarks
+ *
+ *********************************************/
+
+/* Boots timed, and processes alive at a time, in bench_boot */
+#define BOOT_BENCH_BOOTS 20
+#define BOOT_BENCH_PROCS 1000
+
+static long boot_rss;
+
+static int boot_idle(int argl, void* args)
+{
+	boot_rss = resident_kb();
+	return 0;
+}
+
+static int boot_child(int argl, void* args)
+{
+	return 0;
+}
+
+static int boot_procs(int argl, void* args)
+{
+	for(int i=0; i<BOOT_BENCH_PROCS; i++)
+		ASSERT(Exec(boot_child, 0, NULL) != NOPROC);
+	/* The children are not reaped yet */
+	boot_rss = resident_kb();
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	return 0;
+}
+
+BARE_TEST(bench_boot,
+	"Measure the time to boot and shut down a VM that does nothing, and the\n"
+	"resident memory of the program, before booting, while idle, and with a\n"
+	"thousand processes.",
+	.timeout = 120
+	)
+{
+	long rss_before = resident_kb();
+
+	double t0 = wall_time();
+	for(int i=0; i<BOOT_BENCH_BOOTS; i++)
+		boot(1, 0, boot_idle, 0, NULL);
+	double T = (wall_time() - t0) / BOOT_BENCH_BOOTS;
+	long rss_idle = boot_rss;
+
+	boot(1, 0, boot_procs, 0, NULL);
+
+	MSG("boot+shutdown msec=%8.3f  RSS KB: before boot=%7ld idle=%7ld procs=%d:%7ld\n",
+		1E3*T, rss_before, rss_idle, BOOT_BENCH_PROCS, boot_rss);
+}
+
+
+TEST_SUITE(boot_benchmarks,
+	"Benchmarks for booting the kernel."
+	)
+{
+	&bench_boot,
+	NULL
+};
+
+
+/*********************************************
+ *
+ *  Socket benchmarks
+ *
+ *********************************************/
+
+/* Connections made and torn down in bench_socket_churn */
+#define SOCKET_BENCH_CONNS 20000
+#define SOCKET_BENCH_PORT 100
+
+static double churn_rate;
+
+static int churn_server(int argl, void* args)
+{
+	Fid_t lsock = argl;
+	for(int i=0; i<SOCKET_BENCH_CONNS; i++) {
+		Fid_t peer = Accept(lsock);
+		ASSERT(peer != NOFILE);
+		Close(peer);
+	}
+	return 0;
+}
+
+static int churn_boot(int argl, void* args)
+{
+	Fid_t lsock = Socket(SOCKET_BENCH_PORT);
+	ASSERT(lsock != NOFILE);
+	ASSERT(Listen(lsock) == 0);
+	Tid_t server = CreateThread(churn_server, lsock, NULL);
+
+	double t0 = wall_time();
+	for(int i=0; i<SOCKET_BENCH_CONNS; i++) {
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(sock != NOFILE);
+		ASSERT(Connect(sock, SOCKET_BENCH_PORT, 1000) == 0);
+		Close(sock);
+	}
+	ThreadJoin(server, NULL);
+	churn_rate = SOCKET_BENCH_CONNS / (wall_time() - t0);
+
+	Close(lsock);
+	return 0;
+}
+
+BARE_TEST(bench_socket_churn,
+	"Measure the rate of socket connections, for a client that connects and closes\n"
+	"sockets, and a server that accepts and closes them, with and without the\n"
+	"kernel object caches. Reports the statistics of the caches.",
+	.timeout = 120
+	)
+{
+	for(int enabled=0; enabled<=1; enabled++) {
+		boot_kmem_caches(enabled);
+		for(uint ncores=1; ncores<=2; ncores++) {
+			boot(ncores, 0, churn_boot, 0, NULL);
+			MSG("caches=%d cores=%u  connections/sec=%10.0f\n", enabled, ncores, churn_rate);
+
+			kmem_stats st;
+			for(uint i=0; get_kmem_stats(i, &st); i++) {
+				if(enabled)
+					MSG("    %-8s size=%4zu  allocs=%7lu hits=%7lu refills=%5lu flushes=%5lu slabs=%3u in use=%lu\n",
+						st.name, st.size, st.allocs, st.hits, st.refills, st.flushes, st.slabs, st.in_use);
+				/* The PCBs of the idle and init processes are never freed */
+				ASSERT(st.in_use == 0 || strcmp(st.name, "pcb") == 0);
+			}
+		}
+	}
+	boot_kmem_caches(1);
+}
+
+
+/* Number of messages, and the size of their body, in bench_message_framing */
+#define FRAME_BENCH_MSGS 200000
+#define FRAME_BENCH_BODY 100
+
+/* Read or write all the bytes of an I/O vector */
+static void transfer_all(Fid_t fid, iovec_t* iov, unsigned int iovcnt, int write)
+{
+	while(iovcnt > 0) {
+		int rc = write ? WriteV(fid, iov, iovcnt) : ReadV(fid, iov, iovcnt);
+		ASSERT(rc > 0);
+		while(iovcnt > 0 && (uint)rc >= iov->len) {
+			rc -= iov->len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->base = (char*)iov->base + rc;
+			iov->len -= rc;
+		}
+	}
+}
+
+/* Send or receive a message of a header and a body, with one call or with two */
+static void transfer_message(Fid_t fid, int* len, char* body, int vectored, int write)
+{
+	iovec_t msg[2] = { { len, sizeof(int) }, { body, FRAME_BENCH_BODY } };
+	if(vectored)
+		transfer_all(fid, msg, 2, write);
+	else {
+		transfer_all(fid, msg, 1, write);
+		transfer_all(fid, msg+1, 1, write);
+	}
+}
+
+struct frame_sender_args { Fid_t fid; int vectored; };
+
+static int frame_sender(int argl, void* args)
+{
+	struct frame_sender_args* a = args;
+	char body[FRAME_BENCH_BODY] = { 0 };
+	int len = FRAME_BENCH_BODY;
+	ASSERT(Connect(a->fid, SOCKET_BENCH_PORT, 1000) == 0);
+	for(int i=0; i<FRAME_BENCH_MSGS; i++)
+		transfer_message(a->fid, &len, body, a->vectored, 1);
+	return 0;
+}
+
+/* Return the messages/sec sent from a child to its parent over a socket */
+static double framing_rate(int vectored)
+{
+	Fid_t lsock = Socket(SOCKET_BENCH_PORT);
+	ASSERT(lsock != NOFILE && Listen(lsock) == 0);
+	struct frame_sender_args a = { Socket(NOPORT), vectored };
+	ASSERT(a.fid != NOFILE);
+
+	double t0 = wall_time();
+	Pid_t pid = Exec(frame_sender, sizeof(a), &a);
+	ASSERT(pid != NOPROC);
+	Close(a.fid);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv != NOFILE);
+
+	char body[FRAME_BENCH_BODY];
+	int len;
+	for(int i=0; i<FRAME_BENCH_MSGS; i++) {
+		transfer_message(srv, &len, body, vectored, 0);
+		ASSERT(len == FRAME_BENCH_BODY);
+	}
+	double rate = FRAME_BENCH_MSGS / (wall_time() - t0);
+
+	ASSERT(WaitChild(pid, NULL) == pid);
+	Close(srv);
+	Close(lsock);
+	return rate;
+}
+
+BOOT_TEST(bench_message_framing,
+	"Measure the rate of messages, of a length header and a body, sent over a\n"
+	"socket, with a call for the header and one for the body, and with one\n"
+	"vectored call for both.",
+	.timeout = 120
+	)
+{
+	MSG("cores=%2u  two calls: msgs/sec=%9.0f\n", cpu_cores(), framing_rate(0));
+	MSG("cores=%2u  vectored:  msgs/sec=%9.0f\n", cpu_cores(), framing_rate(1));
+	return 0;
+}
+
+
+/* Requests, over all connections, in bench_poll_server */
+#define POLL_BENCH_REQS 100000
+#define POLL_BENCH_MSG 8
+
+/* Send requests and wait for their echo, then hang up */
+static int echo_client(int argl, void* args)
+{
+	Fid_t sock = argl;
+	int reqs = *(int*)args;
+	char msg[POLL_BENCH_MSG] = { 0 };
+	ASSERT(Connect(sock, SOCKET_BENCH_PORT, 1000) == 0);
+	for(int i=0; i<reqs; i++) {
+		ASSERT(Write(sock, msg, POLL_BENCH_MSG) == POLL_BENCH_MSG);
+		for(int got=0; got < POLL_BENCH_MSG; ) {
+			int rc = Read(sock, msg+got, POLL_BENCH_MSG-got);
+			ASSERT(rc > 0);
+			got += rc;
+		}
+	}
+	Close(sock);
+	return 0;
+}
+
+/* Echo a connection until it hangs up, then close it */
+static int echo_server(int argl, void* args)
+{
+	char buf[256];
+	int rc;
+	while((rc = Read(argl, buf, sizeof(buf))) > 0)
+		ASSERT(Write(argl, buf, rc) == rc);
+	Close(argl);
+	return 0;
+}
+
+/* Echo all connections from one thread, closing each one when it hangs up */
+static void echo_poll_server(Fid_t* srv, int nconn)
+{
+	int* ev = malloc(nconn*sizeof(int));
+	char buf[256];
+	while(nconn > 0) {
+		for(int c=0; c<nconn; c++) ev[c] = POLL_READABLE;
+		ASSERT(Poll(srv, ev, nconn, -1) > 0);
+		for(int c=nconn-1; c>=0; c--) {
+			if(! (ev[c] & POLL_READABLE)) continue;
+			int rc = Read(srv[c], buf, sizeof(buf));
+			if(rc > 0)
+				ASSERT(Write(srv[c], buf, rc) == rc);
+			else {
+				Close(srv[c]);
+				srv[c] = srv[--nconn];
+			}
+		}
+	}
+	free(ev);
+}
+
+/* Return the requests/sec served to nconn clients, with Poll or a thread per connection */
+static double echo_rate(int nconn, int polled)
+{
+	Fid_t lsock = Socket(SOCKET_BENCH_PORT);
+	ASSERT(lsock != NOFILE && Listen(lsock) == 0);
+	ASSERT(SetFileLimit(2*nconn + 16) == 0);
+
+	int reqs = POLL_BENCH_REQS / nconn;
+	Tid_t* clients = malloc(nconn*sizeof(Tid_t));
+	Tid_t* servers = malloc(nconn*sizeof(Tid_t));
+	Fid_t* srv = malloc(nconn*sizeof(Fid_t));
+
+	double t0 = wall_time();
+	for(int c=0; c<nconn; c++) {
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(sock != NOFILE);
+		clients[c] = CreateThread(echo_client, sock, &reqs);
+		srv[c] = Accept(lsock);
+		ASSERT(srv[c] != NOFILE);
+		if(! polled)
+			servers[c] = CreateThread(echo_server, srv[c], NULL);
+	}
+	if(polled)
+		echo_poll_server(srv, nconn);
+	for(int c=0; c<nconn; c++) {
+		ThreadJoin(clients[c], NULL);
+		if(! polled) ThreadJoin(servers[c], NULL);
+	}
+	double rate = (double)nconn*reqs / (wall_time() - t0);
+
+	Close(lsock);
+	free(clients); free(servers); free(srv);
+	return rate;
+}
+
+BOOT_TEST(bench_poll_server,
+	"Measure the rate of small echoed requests from a number of clients, served\n"
+	"by a thread per connection, and by a single thread that uses Poll.",
+	.timeout = 300
+	)
+{
+	for(int nconn=1; nconn<=256; nconn*=16) {
+		MSG("cores=%2u  conns=%3d  thread per conn: reqs/sec=%9.0f\n", cpu_cores(), nconn, echo_rate(nconn, 0));
+		MSG("cores=%2u  conns=%3d  one Poll thread:  reqs/sec=%9.0f\n", cpu_cores(), nconn, echo_rate(nconn, 1));
+	}
+	return 0;
+}
+
+
+TEST_SUITE(socket_benchmarks,
+	"Benchmarks for sockets."
+	)
+{
+	&bench_socket_churn,
+	&bench_message_framing,
+	&bench_poll_server,
+	NULL
+};
+
+
+
+TEST_SUITE(all_benchmarks,
+	"A suite containing all benchmarks."
+	)
+{
+	&sched_benchmarks,
+	&syscall_benchmarks,
+	&pipe_benchmarks,
+	&boot_benchmarks,
+	&socket_benchmarks,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
+
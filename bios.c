@@ -123,7 +123,8 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* SIGUSR1 is not blocked during the handler; the soft interrupt mask is used */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -157,6 +158,20 @@ static inline Core* curr_core() {
 }
 
 
+/*
+	The interrupt mask of a core is kept in software, by thread-local flags
+	of the core thread, so that disabling and enabling interrupts does not
+	need a system call. SIGUSR1 stays unblocked in core threads; if it arrives
+	while intr_disabled is set, the signal handler only sets intr_deferred,
+	and the interrupts are dispatched when interrupts are enabled again.
+ */
+static _Thread_local volatile sig_atomic_t intr_disabled;
+static _Thread_local volatile sig_atomic_t intr_deferred;
+
+/* Keep the compiler from moving memory accesses across changes to the mask */
+#define intr_barrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
 	the PIC daemon to refresh the list of fds it is polling.
@@ -181,6 +196,10 @@ static void* core_thread(void* _core)
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
 
+	/* Interrupts start enabled */
+	intr_disabled = 0;
+	intr_deferred = 0;
+
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
 		core->intvec[i] = NULL;
@@ -342,18 +361,42 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Dispatch pending interrupts with interrupts disabled, as long as
+	interrupts are deferred. This must be called with interrupts enabled.
+
+	Note that the dispatch may move the caller to a different core.
+ */
+static void dispatch_deferred_interrupts()
+{
+	do {
+		intr_disabled = 1;
+		intr_barrier();
+		intr_deferred = 0;
+		dispatch_interrupts(curr_core());
+		intr_barrier();
+		intr_disabled = 0;
+		intr_barrier();
+	} while(intr_deferred);
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
-	Core* core = & CORE[si->si_value.sival_int];
-
 #if defined(CORE_STATISTICS)
-	core->irq_count++;
+	curr_core()->irq_count++;
 #endif
 
-	dispatch_interrupts(core);
+	if(intr_disabled) {
+		/* Leave it for cpu_enable_interrupts() */
+		intr_deferred = 1;
+		return;
+	}
+
+	dispatch_deferred_interrupts();
 }
 
 
@@ -996,10 +1039,10 @@ void cpu_core_halt()
 {
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
-	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
 
 #if defined(CORE_STATISTICS)
+	Core* core = curr_core();
 	TimerDuration stime0 = get_coarse_time();
 #endif
 
@@ -1013,16 +1056,11 @@ void cpu_core_halt()
 	siginfo_t info;
 	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
 
-	/* Sleep for 10 msec */
-	int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-		
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	/* Sleep for 10 msec, unless an interrupt arrived while interrupts were disabled */
+	int rc = 0;
+	if(! intr_deferred) {
+		rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1033,6 +1071,20 @@ void cpu_core_halt()
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+	if(rc>0) {
+		/* Got signal, dispatch */
+		if(intr_disabled)
+			intr_deferred = 1;
+		else
+			dispatch_deferred_interrupts();
+	}
+}
+
+void cpu_core_relax()
+{
+	if(ncores > physical_cores)
+		sched_yield();
 }
 
 static int __core_restart(uint c)
@@ -1090,54 +1142,160 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	int was_disabled = intr_disabled;
+	intr_disabled = 1;
+	intr_barrier();
+	return ! was_disabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	intr_barrier();
+	intr_disabled = 0;
+	intr_barrier();
+
+	/* Replay the interrupts that arrived while disabled */
+	if(intr_deferred)
+		dispatch_deferred_interrupts();
+}
+
+
+#if defined(__x86_64__) && !defined(BIOS_PORTABLE_CONTEXT)
+
+/*
+	Context switch for x86-64.
+
+	cpu_context_switch(&oldsp, newsp) pushes the callee-saved registers of the 
+	System V ABI (rbx, rbp, r12-r15, and the control words of the x87 and SSE units)
+	on the current stack, saves the stack pointer in oldsp, loads newsp and pops 
+	the same registers from the new stack. Then, it returns into the new context.
+
+	A new context is prepared (see cpu_initialize_context) so that the switch 
+	returns into cpu_context_start, with the function to call in rbx.
+ */
+void cpu_context_switch(void** oldsp, void* newsp);
+void cpu_context_start();
+
+__asm__(
+	"	.pushsection .text\n"
+	"	.p2align 4\n"
+	"	.type cpu_context_switch, @function\n"
+	"cpu_context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $16, %rsp\n"
+	"	stmxcsr 8(%rsp)\n"
+	"	fnstcw (%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	fldcw (%rsp)\n"
+	"	ldmxcsr 8(%rsp)\n"
+	"	addq $16, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size cpu_context_switch, .-cpu_context_switch\n"
+	"\n"
+	"	.p2align 4\n"
+	"	.type cpu_context_start, @function\n"
+	"cpu_context_start:\n"
+	"	callq *%rbx\n"
+	"	ud2\n"
+	"	.size cpu_context_start, .-cpu_context_start\n"
+	"	.popsection\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The stack pointer must be 16-byte aligned at the call to ctx_func */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* sp = (uint64_t*) (top - 16);
+
+	*(--sp) = (uint64_t) cpu_context_start;	/* return address */
+	*(--sp) = 0;							/* rbp */
+	*(--sp) = (uint64_t) ctx_func;			/* rbx */
+	*(--sp) = 0;							/* r12 */
+	*(--sp) = 0;							/* r13 */
+	*(--sp) = 0;							/* r14 */
+	*(--sp) = 0;							/* r15 */
+	*(--sp) = 0x1F80;						/* mxcsr (default) */
+	*(--sp) = 0x037F;						/* x87 control word (default) */
+
+	ctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_context_switch(& oldctx->sp, newctx->sp);
 }
 
+#else
+
+/*
+	Portable context switch.
+
+	The registers are saved with _setjmp, which (unlike swapcontext) does not
+	save the signal mask. A context that has not been started yet is entered
+	with setcontext, which sets the signal mask of the core thread. Therefore,
+	a new context gets the mask of the thread that creates it, with SIGUSR1
+	unblocked, as core interrupts are masked in software (see 
+	cpu_disable_interrupts).
+ */
 
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
-  getcontext(ctx);
-  ctx->uc_link = NULL;
+  getcontext(& ctx->uc);
+  ctx->uc.uc_link = NULL;
 
   /* initialize the context stack */
-  ctx->uc_stack.ss_sp = ss_sp;
-  ctx->uc_stack.ss_size = ss_size;
-  ctx->uc_stack.ss_flags = 0;
-
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
-  makecontext(ctx, (void*) ctx_func, 0);
+  ctx->uc.uc_stack.ss_sp = ss_sp;
+  ctx->uc.uc_stack.ss_size = ss_size;
+  ctx->uc.uc_stack.ss_flags = 0;
+
+  CHECKRC(pthread_sigmask(SIG_SETMASK, NULL, & ctx->uc.uc_sigmask));
+  CHECK(sigdelset(& ctx->uc.uc_sigmask, SIGUSR1));
+  makecontext(& ctx->uc, (void*) ctx_func, 0);
+  ctx->started = 0;
 }
 
 
 void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 {
-	swapcontext(oldctx, newctx);
+	oldctx->started = 1;
+	if(_setjmp(oldctx->jb) == 0) {
+		if(newctx->started)
+			_longjmp(newctx->jb, 1);
+		else {
+			newctx->started = 1;
+			setcontext(& newctx->uc);
+		}
+	}
 }
 
+#endif
 
 
 /*
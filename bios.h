@@ -2,6 +2,7 @@
 #define BIOS_H
 
 #include <stdint.h>
+#include <setjmp.h>
 #include <ucontext.h>
 
 /**
@@ -378,10 +379,25 @@ void cpu_enable_interrupts();
 
 	This function is useful when a core becomes idle. An idle core does not
 	consume simulation resources (in particular CPU time).
+
+	If it is called with interrupts disabled, and an interrupt has already 
+	arrived (and is pending), the core does not halt. This allows a core to 
+	check for work and halt, without missing an interrupt in between.
 */
 void cpu_core_halt();
 
 
+/**
+	@brief Give the physical processor to other cores, while busy-waiting.
+
+	A core that spins, waiting for another core (e.g., to release a lock), 
+	should call this regularly. When there are more simulated cores than 
+	physical processors, this allows the core it waits for to run. Else, 
+	it does nothing.
+*/
+void cpu_core_relax();
+
+
 /**
 	@brief Restart the given core.
 
@@ -407,8 +423,28 @@ void cpu_core_restart_all();
 
 /**
 	@brief A type for saving CPU context into.
+
+	Since a context switch happens inside a function call, only the registers 
+	that a function must preserve are saved. The signal mask (and therefore, 
+	the interrupt mask) is not part of the context, so that switching does not 
+	need any system calls.
+
+	On x86-64, the registers are pushed on the stack of the thread, and the context
+	is just the saved stack pointer. On other platforms (or if @c BIOS_PORTABLE_CONTEXT 
+	is defined), a @c jmp_buf is used, and a @c ucontext_t is only needed to enter 
+	the context for the first time.
 */
-typedef ucontext_t cpu_context_t;
+#if defined(__x86_64__) && !defined(BIOS_PORTABLE_CONTEXT)
+typedef struct {
+	void* sp;		/**< The saved stack pointer */
+} cpu_context_t;
+#else
+typedef struct {
+	jmp_buf jb;		/**< The saved registers */
+	ucontext_t uc;	/**< Used to start the context */
+	int started;	/**< Set when the context has been entered once */
+} cpu_context_t;
+#endif
 
 
 /**
@@ -428,7 +464,7 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	@brief Switch the CPU context.
 
 	Save the current context into @c oldctx and load the contents of @c newctx
-	into the CPU.
+	into the CPU. The interrupt mask of the core is not changed.
 
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
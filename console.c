@@ -65,4 +65,6 @@ void tinyos_pseudo_console()
 	fcb[0]->streamfunc = &__stdio_ops;
 	fcb[1]->streamfunc = &__stdio_ops;
 
+	FCB_install(2, fid, fcb);
+
 }
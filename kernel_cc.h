@@ -32,32 +32,46 @@
 
 
 
+/**
+	@brief Try to lock a mutex without waiting.
+
+	This is used by the scheduler when it must acquire locks out of 
+	the usual lock order.
+
+	@returns 1 if the mutex was locked, 0 if it was already held.
+  */
+int Mutex_TryLock(Mutex* lock);
+
+
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel synchronization.
+ *
+ * There is no global kernel lock. Each kernel object (process table, 
+ * process, file table, pipe, socket, device) is protected by its own
+ * Mutex, and system calls wait on kernel conditions while releasing
+ * the mutex of the object they wait for.
  */
 
 /**
-	@brief Lock the kernel.
- */
-void kernel_lock();
+	@brief Wait on a condition variable, releasing a kernel mutex.
 
-/**
-	@brief Unlock the kernel.
- */
-void kernel_unlock();
+	The mutex @c mx must be held by the caller. It is released atomically
+	with going to sleep, and it is re-acquired before returning.
 
-/**
-	@brief Wait on a condition variable using the kernel lock.
+	@param mx the mutex protecting the condition
+	@param cv the condition variable to wait on
+	@param cause the cause of the sleep, given to the scheduler
+	@param wchan a name for the wait channel (used for debugging)
+	@param timeout the maximum time to sleep, or @c NO_TIMEOUT
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -72,16 +86,6 @@ void kernel_signal(CondVar* cv);
 void kernel_broadcast(CondVar* cv);
 
 
-/**
-	@brief Put thread to sleep, unlocking the kernel.
-
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
-  */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
-
-
-
 /** @brief Set the preemption status for the current core.
 
  	Preemption is disabled by disabling interrupts. 
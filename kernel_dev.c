@@ -68,8 +68,12 @@ void serial_tx_handler();
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  Mutex spinlock;       /* Protects rx_ready and the peek. Held only with preemption off. */
   CondVar rx_ready;
+  Mutex tx_lock;        /* Serializes writers */
+  int has_peek;         /* A byte that Poll read from the device, before any reader */
+  char peek;
+  int polled;           /* Once set, input calls poll_notify() */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -88,42 +92,101 @@ void serial_rx_handler()
     We do not know which terminal is
     ready, so we must signal them all !
    */
+  int polled = 0;
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    polled |= dcb->polled;
+    Mutex_Unlock(&dcb->spinlock);
   }
+  if(polled)
+    poll_notify();
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Get the next input byte, the peeked one first. 
+  This is called with the spinlock held.
  */
-int serial_read(void* dev, char *buf, unsigned int size)
+static int serial_getc(serial_dcb_t* dcb, char* c)
+{
+  if(dcb->has_peek) {
+    *c = dcb->peek;
+    dcb->has_peek = 0;
+    return 1;
+  }
+  return bios_read_serial(dcb->devno, c);
+}
+
+/*
+  Read from the device into an I/O vector, sleeping if needed, 
+  unless IO_NONBLOCK is in flags.
+ */
+int serial_readv(void* dev, const iovec_t* iov, unsigned int iovcnt, unsigned int size, int flags)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
+  uint off = 0;           /* The offset of the next byte in *iov */
 
   while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
+    while(off == iov->len) { iov++; off = 0; }
+    int valid = serial_getc(dcb, (char*)iov->base + off);
     
     if (valid) {
       count++;
+      off++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      if(flags & IO_NONBLOCK) {
+        count = WOULD_BLOCK;
+        break;
+      }
+      kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
 }
 
+/*
+  Read from the device, sleeping if needed.
+ */
+int serial_read(void* dev, char *buf, unsigned int size)
+{
+  iovec_t iov = { buf, size };
+  return serial_readv(dev, &iov, 1, size, 0);
+}
+
+/*
+  The device is readable when a byte can be peeked. Writes only wait 
+  for the device briefly, so it is always writable.
+ */
+int serial_poll(void* dev)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  dcb->polled = 1;
+  if(! dcb->has_peek)
+    dcb->has_peek = bios_read_serial(dcb->devno, &dcb->peek);
+  int ev = POLL_WRITABLE | (dcb->has_peek ? POLL_READABLE : 0);
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
+  return ev;
+}
+
 
 /*
   A polling driver for serial writes
@@ -143,6 +206,8 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  Mutex_Lock(&dcb->tx_lock);
+
   unsigned int count = 0;
   while(count < size) {
     int success = bios_write_serial(dcb->devno, buf[count] );
@@ -158,6 +223,8 @@ int serial_write(void* dev, const char* buf, unsigned int size)
       break;
   }
 
+  Mutex_Unlock(&dcb->tx_lock);
+
   return count;  
 }
 
@@ -180,6 +247,8 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
+  .ReadV = serial_readv,
+  .Poll = serial_poll,
   .Close = serial_close
 };
 
@@ -211,6 +280,9 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_lock = MUTEX_INIT;
+    serial_dcb[i].has_peek = 0;
+    serial_dcb[i].polled = 0;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -81,6 +81,42 @@ typedef struct file_operations {
   */
     int (*Write)(void* this, const char* buf, unsigned int size);
 
+  /** @brief Vectored read operation (optional).
+
+    Like Read, but scatter the data to the @c iovcnt buffers of @c iov,
+    whose total size is @c size. If it is NULL, @c ReadV() calls Read 
+    on the first non-empty buffer.
+
+    If @c flags has @c IO_NONBLOCK and no data is available, return 
+    @c WOULD_BLOCK instead of blocking. Streams that may block on reads 
+    must provide this method, to support non-blocking file ids.
+  */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt, unsigned int size, int flags);
+
+  /** @brief Vectored write operation (optional).
+
+    Like Write, but gather the data from the @c iovcnt buffers of @c iov,
+    whose total size is @c size. If it is NULL, @c WriteV() calls Write 
+    on each buffer in turn.
+
+    If @c flags has @c IO_NONBLOCK and no data can be written, return 
+    @c WOULD_BLOCK instead of blocking. Streams that may block on writes
+    must provide this method, to support non-blocking file ids.
+  */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt, unsigned int size, int flags);
+
+  /** @brief Readiness operation (optional).
+
+    Return the events of the stream that are ready: @c POLL_READABLE if Read
+    would not block, @c POLL_WRITABLE if Write would not block, and 
+    @c POLL_HANGUP if the other end of the stream is closed. 
+    If it is NULL, the stream is always ready for reading and writing.
+
+    Once it has been polled, a stream must call @c poll_notify() after 
+    every change that may make it ready.
+  */
+    int (*Poll)(void* this);
+
     /** @brief Close operation.
 
       Close the stream object, deallocating any resources held by it.
@@ -95,6 +131,10 @@ typedef struct file_operations {
 } file_ops;
 
 
+/** @brief A flag of the vectored stream methods: return @c WOULD_BLOCK instead of blocking. */
+#define IO_NONBLOCK 1
+
+
 
 /**
   @brief The device type.
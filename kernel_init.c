@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_slab.h"
 
 
 
@@ -26,8 +27,18 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  const sched_policy* policy;
 } boot_rec;
 
+/* The policy selected by boot_sched_policy(), if any */
+static const sched_policy* boot_policy = NULL;
+
+/* The thread pool limit set by boot_thread_pool() */
+static unsigned int boot_pool_limit = THREAD_POOL_LIMIT;
+
+/* Whether the object caches are enabled, set by boot_kmem_caches() */
+static int boot_kmem_enabled = 1;
+
 
 /* Per-core boot function for tinyos */
 void boot_tinyos_kernel()
@@ -35,9 +46,10 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
+    initialize_kmem();
     initialize_processes();
     initialize_devices();
-    initialize_files();
+    active_policy = boot_rec.policy;
     initialize_scheduler();
 
     /* The boot task is executed normally! */
@@ -65,7 +77,47 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+  /* Select the scheduling policy */
+  boot_rec.policy = boot_policy;
+  if(boot_rec.policy == NULL) {
+    const char* name = getenv("TINYOS_SCHED");
+    boot_rec.policy = (name==NULL) ? &mlfq_policy : find_sched_policy(name);
+    if(boot_rec.policy == NULL) 
+      FATAL("Unknown scheduling policy in TINYOS_SCHED");
+  }
+  thread_pool_limit = boot_pool_limit;
+  kmem_caches_enabled = boot_kmem_enabled;
+
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  finalize_scheduler();
+  finalize_processes();
+  finalize_kmem();
+}
+
+
+int boot_sched_policy(const char* name)
+{
+  if(name == NULL) {
+    boot_policy = NULL;
+    return 0;
+  }
+  const sched_policy* policy = find_sched_policy(name);
+  if(policy == NULL) return -1;
+  boot_policy = policy;
+  return 0;
+}
+
+
+void boot_thread_pool(unsigned int limit)
+{
+  boot_pool_limit = limit;
+}
+
+
+void boot_kmem_caches(int enabled)
+{
+  boot_kmem_enabled = enabled;
 }
 
 
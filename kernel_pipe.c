@@ -1,39 +1,186 @@
 
+#include <string.h>
 #include "tinyos.h"
 #include "kernel_dev.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "util.h"
 #include "kernel_pipe.h"
+#include "kernel_socket.h"
+#include "kernel_slab.h"
 
 
 static file_ops reader_pipe_ops = {
 	//.Open = rpipe_Open,
 	.Read = reader_pipe_Read,
 	.Write = reader_pipe_Write,
+	.ReadV = reader_pipe_ReadV,
+	.Poll = reader_pipe_Poll,
 	.Close = reader_pipe_Close
 };
 static file_ops writer_pipe_ops = {
 	//.Open = rpipe_Open,
 	.Read = writer_pipe_Read,
 	.Write = writer_pipe_Write,
+	.WriteV = writer_pipe_WriteV,
+	.Poll = writer_pipe_Poll,
 	.Close = writer_pipe_Close
 };
 
-Pipe_cb* create_pipe_cb(FCB* reader, FCB* writer){
+_Static_assert((PIPE_BUFFER_MIN & (PIPE_BUFFER_MIN-1)) == 0, 
+	"PIPE_BUFFER_MIN must be a power of two");
+_Static_assert(PIPE_BUFFER_MIN <= PIPE_BUFFER_SIZE && PIPE_BUFFER_SIZE <= PIPE_BUFFER_MAX, 
+	"PIPE_BUFFER_SIZE must be between PIPE_BUFFER_MIN and PIPE_BUFFER_MAX");
 
-	Pipe_cb* pipe_cb = (Pipe_cb*)xmalloc(sizeof(Pipe_cb));
+/* Number of writes that must find the buffer full, before it grows */
+#define PIPE_GROW_PRESSURE 4
 
-	pipe_cb->BUFFER = (char *)malloc(PIPE_BUFFER_SIZE*sizeof(char));
-	pipe_cb->buf_size = PIPE_BUFFER_SIZE;
+/* Free space needed in the buffer, before a waiting writer is woken up */
+#define PIPE_SPACE_WATERMARK(pipe_cb) ((pipe_cb)->buf_size/4)
+
+
+/* Number of bytes in the ring */
+static inline uint pipe_used(Pipe_cb* pipe_cb)
+{
+	return pipe_cb->w_position - pipe_cb->r_position;
+}
+
+/*
+	Copy n bytes into the ring, at most as two contiguous chunks (the tail 
+	of the buffer, then its head). There must be room for them.
+ */
+static void pipe_ring_put(Pipe_cb* pipe_cb, const char* buf, uint n)
+{
+	uint off = pipe_cb->w_position & (pipe_cb->buf_size-1);
+	uint first = pipe_cb->buf_size - off;
+	if(first > n) first = n;
+
+	memcpy(pipe_cb->BUFFER + off, buf, first);
+	memcpy(pipe_cb->BUFFER, buf + first, n - first);
+	pipe_cb->w_position += n;
+}
+
+/*
+	Copy n bytes out of the ring, at most as two contiguous chunks. 
+	There must be at least n bytes in the ring.
+ */
+static void pipe_ring_get(Pipe_cb* pipe_cb, char* buf, uint n)
+{
+	uint off = pipe_cb->r_position & (pipe_cb->buf_size-1);
+	uint first = pipe_cb->buf_size - off;
+	if(first > n) first = n;
+
+	memcpy(buf, pipe_cb->BUFFER + off, first);
+	memcpy(buf + first, pipe_cb->BUFFER, n - first);
+	pipe_cb->r_position += n;
+}
+
+
+/*
+	Copy n bytes out of the ring, scattering them to the buffers of an
+	I/O vector in order. The buffers must hold at least n bytes.
+ */
+static void pipe_ring_getv(Pipe_cb* pipe_cb, const iovec_t* iov, uint n)
+{
+	for(; n > 0; iov++) {
+		uint chunk = (iov->len < n) ? iov->len : n;
+		pipe_ring_get(pipe_cb, iov->base, chunk);
+		n -= chunk;
+	}
+}
+
+/*
+	Copy n bytes into the ring, gathering them from the buffers of an
+	I/O vector in order. There must be room for them.
+ */
+static void pipe_ring_putv(Pipe_cb* pipe_cb, const iovec_t* iov, uint n)
+{
+	for(; n > 0; iov++) {
+		uint chunk = (iov->len < n) ? iov->len : n;
+		pipe_ring_put(pipe_cb, iov->base, chunk);
+		n -= chunk;
+	}
+}
+
+
+/* 
+	The buffer size for a requested capacity: a power of two, at least 
+	PIPE_BUFFER_MIN. The capacity must not exceed PIPE_BUFFER_MAX.
+ */
+static uint pipe_buffer_size(uint size)
+{
+	uint cap = PIPE_BUFFER_MIN;
+	while(cap < size) cap <<= 1;
+	return cap;
+}
+
+/*
+	Replace the buffer with one of the given size, keeping the data.
+	The new size must be a power of two, and hold the data.
+ */
+static void pipe_resize(Pipe_cb* pipe_cb, uint size)
+{
+	if(size == pipe_cb->buf_size) return;
+
+	uint used = pipe_used(pipe_cb);
+	char* buffer = (char*)xmalloc(size);
+	pipe_ring_get(pipe_cb, buffer, used);
+	free(pipe_cb->BUFFER);
+
+	pipe_cb->BUFFER = buffer;
+	pipe_cb->buf_size = size;
+	pipe_cb->r_position = 0;
+	pipe_cb->w_position = used;
+	pipe_cb->peak = used;
+	pipe_cb->pressure = 0;
+}
+
+/*
+	Called when a read empties the buffer. If the buffer has been
+	mostly unused since it last emptied, shrink it to twice its peak use.
+ */
+static void pipe_drained(Pipe_cb* pipe_cb)
+{
+	if(pipe_cb->buf_size > pipe_cb->min_size && 4*pipe_cb->peak <= pipe_cb->buf_size) {
+		uint size = pipe_buffer_size(2*pipe_cb->peak);
+		pipe_resize(pipe_cb, (size < pipe_cb->min_size) ? pipe_cb->min_size : size);
+	}
+	pipe_cb->peak = 0;
+	pipe_cb->pressure = 0;
+}
+
+
+/* Pipes are constructed unlocked, with no waiters */
+static void pipe_ctor(void* obj)
+{
+	Pipe_cb* pipe_cb = obj;
+	pipe_cb->lock = MUTEX_INIT;
+	pipe_cb->has_space = COND_INIT;
+	pipe_cb->has_data = COND_INIT;
+}
+
+static kmem_cache pipe_cache = KMEM_CACHE_INIT("pipe", Pipe_cb, pipe_ctor);
+
+
+Pipe_cb* create_pipe_cb(FCB* reader, FCB* writer, uint size){
+
+	Pipe_cb* pipe_cb = (Pipe_cb*)kmem_cache_alloc(&pipe_cache);
+
+	pipe_cb->buf_size = pipe_buffer_size(size);
+	pipe_cb->BUFFER = (char *)xmalloc(pipe_cb->buf_size);
+	pipe_cb->min_size = PIPE_BUFFER_MIN;
+	pipe_cb->max_size = PIPE_BUFFER_MAX;
+	pipe_cb->peak = 0;
+	pipe_cb->pressure = 0;
+	pipe_cb->readers_waiting = 0;
+	pipe_cb->writers_waiting = 0;
+	pipe_cb->polled = 0;
 	pipe_cb->reader= reader;
 	pipe_cb->writer= writer;
+	pipe_cb->refs = 2;
 	pipe_cb->w_position = 0; //pipe_cb->BUFFER[0]
 	pipe_cb->r_position = 0; //pipe_cb->BUFFER[0]
 
-	pipe_cb->has_space = COND_INIT;
-    pipe_cb->has_data = COND_INIT;
-
 	pipe_cb->reader->streamobj = pipe_cb;		//set pipe reader object
 	pipe_cb->reader->streamfunc = &reader_pipe_ops;  
 	pipe_cb->writer->streamobj = pipe_cb;       //set pipe writer object
@@ -47,6 +194,14 @@ Pipe_cb* create_pipe_cb(FCB* reader, FCB* writer){
 
 int sys_Pipe(pipe_t* pipe)
 {
+	return sys_PipeEx(pipe, 0);
+}
+
+int sys_PipeEx(pipe_t* pipe, unsigned int size)
+{
+	if(size > PIPE_BUFFER_MAX){
+		return -1;
+	}
 	
 	//FCB_reserve 
 	Fid_t fidt_buffer[2];
@@ -62,50 +217,189 @@ int sys_Pipe(pipe_t* pipe)
 	pipe->write =fidt_buffer[0];
 
 	// Creating Pipe_cb with the FCBs
-	create_pipe_cb(fcb_buffer[1], fcb_buffer[0]);
+	Pipe_cb* pipe_cb = create_pipe_cb(fcb_buffer[1], fcb_buffer[0], 
+		(size == 0) ? PIPE_BUFFER_SIZE : size);
+	if(size != 0)
+		pipe_cb->min_size = pipe_cb->max_size = pipe_cb->buf_size;
 
+	FCB_install(2, fidt_buffer, fcb_buffer);
 	return 0;
 	
 }
 
-int Pipe_close(Fid_t close_f){
-
-	int writer_flag = 0;
-	int reader_flag = 0;
-
-	FCB* close_fcb = get_fcb(close_f);
-
-	Pipe_cb* pipe_cb = close_fcb->streamobj;
-
-	// Wake up pipe_writer and pipe_reader
-	kernel_broadcast(&pipe_cb->has_space);
-	kernel_broadcast(&pipe_cb->has_data);
-	
+int sys_SetPipeSize(Fid_t fd, unsigned int size)
+{
+	if(size > PIPE_BUFFER_MAX){
+		return -1;
+	}
 
-	if(close_fcb->refcount == 0) {
-		free(close_fcb);
+	FCB* fcb = get_fcb_ref(fd);
+	if(fcb == NULL){
+		return -1;
 	}
-	if(pipe_cb->reader == NULL && pipe_cb->writer == NULL) {
-		free(pipe_cb);
+	if(fcb->streamfunc != &reader_pipe_ops && fcb->streamfunc != &writer_pipe_ops){
+		FCB_decref(fcb);
+		return -1;
 	}
-	// If pipe reader  has no more dependencies close it
-	if(pipe_cb->reader->refcount == 0) {
-		reader_pipe_Close(pipe_cb);
-		reader_flag = 1;
+	Pipe_cb* pipe_cb = fcb->streamobj;
+	int ret;
+
+	Mutex_Lock(&pipe_cb->lock);
+	if(size == 0) {
+		// Back to adaptive sizing
+		pipe_cb->min_size = PIPE_BUFFER_MIN;
+		pipe_cb->max_size = PIPE_BUFFER_MAX;
+		ret = pipe_cb->buf_size;
 	}
-	// If pipe writer  has no more dependencies close it
-	if(pipe_cb->writer->refcount == 0) {
-		writer_pipe_Close(pipe_cb);
-		writer_flag = 1;
+	else {
+		uint cap = pipe_buffer_size(size);
+		if(cap < pipe_used(pipe_cb)) {
+			ret = -1;
+		}
+		else {
+			if(cap > pipe_cb->buf_size && pipe_cb->writers_waiting)
+				kernel_broadcast(&pipe_cb->has_space);
+			if(cap > pipe_cb->buf_size && pipe_cb->polled)
+				poll_notify();
+			pipe_resize(pipe_cb, cap);
+			pipe_cb->min_size = pipe_cb->max_size = cap;
+			ret = cap;
+		}
 	}
-	//Eventually,if pipe's reader & writer are no more, free pipe
-	if(writer_flag == 1 && reader_flag == 1) {
-		free(pipe_cb);
-		return 0;
+	Mutex_Unlock(&pipe_cb->lock);
+
+	FCB_decref(fcb);
+	return ret;
+}
+
+/*
+	Drop a reference to a pipe, and free it when it has none left.
+ */
+void pipe_put(Pipe_cb* pipe_cb)
+{
+	if(__atomic_sub_fetch(&pipe_cb->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(pipe_cb->BUFFER);
+		kmem_cache_free(&pipe_cache, pipe_cb);
 	}
+}
+
+
+/* Must be called with the pipe lock held */
+void pipe_wakeup_all(Pipe_cb* pipe_cb)
+{
+	if(pipe_cb->readers_waiting)
+		kernel_broadcast(&pipe_cb->has_data);
+	if(pipe_cb->writers_waiting)
+		kernel_broadcast(&pipe_cb->has_space);
+	if(pipe_cb->polled)
+		poll_notify();
+}
 
+
+/*
+	The following helpers must be called with the pipe lock held.
+ */
+
+/* Wait until there is data to read. Returns 0 at end of data, else 1.
+   With IO_NONBLOCK in flags, returns WOULD_BLOCK instead of waiting. */
+static int pipe_wait_data(Pipe_cb* pipe_cb, int flags)
+{
+	//While Buffer is Empty 
+	while(pipe_used(pipe_cb) == 0){
+		if(pipe_cb->writer == NULL)
+			return 0;
+		if(flags & IO_NONBLOCK)
+			return WOULD_BLOCK;
+		pipe_cb->readers_waiting++;
+		kernel_wait(&pipe_cb->lock, &pipe_cb->has_data, SCHED_PIPE);
+		pipe_cb->readers_waiting--;
+	}
+	return 1;
+}
+
+/* Wait until there is space to write. Returns -1 if the pipe is closed, else 1.
+   With IO_NONBLOCK in flags, returns WOULD_BLOCK instead of waiting. */
+static int pipe_wait_space(Pipe_cb* pipe_cb, int flags)
+{
+	while(pipe_cb->reader != NULL && pipe_cb->writer != NULL){  
+		if(pipe_used(pipe_cb) < pipe_cb->buf_size)
+			return 1;
+		// grow the buffer under sustained pressure
+		if(pipe_cb->buf_size < pipe_cb->max_size 
+			&& ++pipe_cb->pressure >= PIPE_GROW_PRESSURE) {
+			pipe_resize(pipe_cb, 2*pipe_cb->buf_size);
+			return 1;
+		}
+		if(flags & IO_NONBLOCK)
+			return WOULD_BLOCK;
+		//wait until has data flowing on Stream.
+		pipe_cb->writers_waiting++;
+		kernel_wait(&pipe_cb->lock, &pipe_cb->has_space, SCHED_PIPE);
+		pipe_cb->writers_waiting--;
+	}
 	return -1;
+}
 
+/* Bookkeeping and wakeups after data was taken out of the ring */
+static void pipe_after_get(Pipe_cb* pipe_cb)
+{
+	if(pipe_used(pipe_cb) == 0)
+		pipe_drained(pipe_cb);
+
+	//wake up a writer, if enough space is free, and pass on 
+	//any remaining data to the next reader
+	if(pipe_cb->writers_waiting 
+		&& pipe_cb->buf_size - pipe_used(pipe_cb) >= PIPE_SPACE_WATERMARK(pipe_cb))
+		kernel_signal(&pipe_cb->has_space);
+	if(pipe_cb->readers_waiting && pipe_used(pipe_cb) > 0)
+		kernel_signal(&pipe_cb->has_data);
+	if(pipe_cb->polled)
+		poll_notify();
+}
+
+/* Bookkeeping and wakeups after data was put into the ring */
+static void pipe_after_put(Pipe_cb* pipe_cb)
+{
+	if(pipe_used(pipe_cb) > pipe_cb->peak)
+		pipe_cb->peak = pipe_used(pipe_cb);
+
+	//wake up a reader, and pass on any remaining space to the next writer
+	if(pipe_cb->readers_waiting)
+		kernel_signal(&pipe_cb->has_data);
+	if(pipe_cb->writers_waiting 
+		&& pipe_cb->buf_size - pipe_used(pipe_cb) >= PIPE_SPACE_WATERMARK(pipe_cb))
+		kernel_signal(&pipe_cb->has_space);
+	if(pipe_cb->polled)
+		poll_notify();
+}
+
+
+/* The events of the read end of a pipe (see Poll). This locks the pipe. */
+int pipe_read_events(Pipe_cb* pipe_cb)
+{
+	Mutex_Lock(&pipe_cb->lock);
+	pipe_cb->polled = 1;
+	int ev = 0;
+	if(pipe_used(pipe_cb) > 0 || pipe_cb->writer == NULL)
+		ev |= POLL_READABLE;
+	if(pipe_cb->writer == NULL)
+		ev |= POLL_HANGUP;
+	Mutex_Unlock(&pipe_cb->lock);
+	return ev;
+}
+
+/* The events of the write end of a pipe (see Poll). This locks the pipe. */
+int pipe_write_events(Pipe_cb* pipe_cb)
+{
+	Mutex_Lock(&pipe_cb->lock);
+	pipe_cb->polled = 1;
+	int ev = 0;
+	if(pipe_cb->reader == NULL)
+		ev |= POLL_WRITABLE | POLL_HANGUP;
+	else if(pipe_used(pipe_cb) < pipe_cb->buf_size)
+		ev |= POLL_WRITABLE;
+	Mutex_Unlock(&pipe_cb->lock);
+	return ev;
 }
 
 
@@ -127,44 +421,66 @@ int reader_pipe_Read(void* pipecb_t, char *buf, unsigned int n){
 	Pipe_cb* pipe_cb = (Pipe_cb*)pipecb_t;
 
 	int writer_exists; 	   //data able to read.
- 	int has_read = 0;      //index pos in Reader's Buffer.
+ 	uint has_read;         //bytes copied to Reader's Buffer.
 
 	if (pipe_cb == NULL){
 		return -1;
 	}
 
-	if(pipe_cb->writer == NULL){
-		writer_exists = 0;
-	}else{
-		writer_exists = 1;
-	}
-	//While Buffer is Empty 
-	while(pipe_cb->w_position == pipe_cb->r_position){
-		if(!writer_exists){
-			return 0;
-		}else
-		{
-			kernel_wait(&pipe_cb->has_data,SCHED_PIPE);
-		}
+	Mutex_Lock(&pipe_cb->lock);
+
+	writer_exists = pipe_wait_data(pipe_cb, 0);
+	if(!writer_exists){
+		Mutex_Unlock(&pipe_cb->lock);
+		return 0;
 	}
 
 	//Read Data From Buffer.
-	do {
-		buf[has_read++] = pipe_cb->BUFFER[pipe_cb->r_position];
-		pipe_cb->r_position = (pipe_cb->r_position + 1) % PIPE_BUFFER_SIZE;
-	} while((pipe_cb->r_position != pipe_cb->w_position) && (has_read < n));
+	has_read = pipe_used(pipe_cb);
+	if(has_read > n) has_read = n;
+	pipe_ring_get(pipe_cb, buf, has_read);
+	pipe_after_get(pipe_cb);
 
-	////wake up all the writers waiting
-	kernel_broadcast(&pipe_cb->has_space);
+	Mutex_Unlock(&pipe_cb->lock);
 	return has_read;
 
 
 }
 
+int reader_pipe_ReadV(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt, unsigned int n, int flags){
+
+	if(pipecb_t == NULL){
+		return -1;
+	}
+	Pipe_cb* pipe_cb = (Pipe_cb*)pipecb_t;
+	uint has_read;
+
+	Mutex_Lock(&pipe_cb->lock);
+
+	int has_data = pipe_wait_data(pipe_cb, flags);
+	if(has_data != 1){
+		Mutex_Unlock(&pipe_cb->lock);
+		return has_data;
+	}
+
+	//Drain the ring into the whole vector at once
+	has_read = pipe_used(pipe_cb);
+	if(has_read > n) has_read = n;
+	pipe_ring_getv(pipe_cb, iov, has_read);
+	pipe_after_get(pipe_cb);
+
+	Mutex_Unlock(&pipe_cb->lock);
+	return has_read;
+}
+
 int reader_pipe_Write(void* pipecb_t, const char* buf, unsigned int n){
 	return -1; //reader can not write
 }
 
+int reader_pipe_Poll(void* pipecb_t){
+	return pipe_read_events((Pipe_cb*)pipecb_t);
+}
+
 int reader_pipe_Close(void* pipecb_t){
 
 	if(pipecb_t == NULL){
@@ -174,8 +490,11 @@ int reader_pipe_Close(void* pipecb_t){
 
 	if(pipe_cb!=NULL){
 		//wake upp all the writer/readers before closing this pipe
-		kernel_broadcast(&pipe_cb->has_data); 
+		Mutex_Lock(&pipe_cb->lock);
 		pipe_cb->reader = NULL; 
+		pipe_wakeup_all(pipe_cb);
+		Mutex_Unlock(&pipe_cb->lock);
+		pipe_put(pipe_cb);
 		return 0; 
 	}
 	return -1; 
@@ -189,20 +508,21 @@ int writer_pipe_Read(void* pipecb_t, char *buf, unsigned int n){
 	return -1;//writer can not read
 }
 
+int writer_pipe_Poll(void* pipecb_t){
+	return pipe_write_events((Pipe_cb*)pipecb_t);
+}
+
 int writer_pipe_Write(void* pipecb_t, const char* buf, unsigned int n){
 
 	if(pipecb_t == NULL) {
 		return -1;
 	}
 	Pipe_cb* pipe_cb = (Pipe_cb*)pipecb_t;
-	int has_write = 0;  //Position of index in Reader's Buffer.
+	uint has_write;     //bytes copied from Writer's Buffer.
 
 	if(pipe_cb == NULL ){
 		return -1;
 	}
-	if(pipe_cb->reader == NULL || pipe_cb->writer == NULL){
-		return -1;
-	}
 	if(buf == NULL){
 		return -1;
 	}
@@ -210,23 +530,157 @@ int writer_pipe_Write(void* pipecb_t, const char* buf, unsigned int n){
 		return -1;
 	}
 
-	while(pipe_cb->r_position == (pipe_cb->w_position+1)%PIPE_BUFFER_SIZE){  
-		//wait until has data flowing on Stream.
-		kernel_wait(&pipe_cb->has_space,SCHED_PIPE);
+	Mutex_Lock(&pipe_cb->lock);
+	if(pipe_wait_space(pipe_cb, 0) < 0){
+		Mutex_Unlock(&pipe_cb->lock);
+		return -1;
 	}
 
 	//Write data 
-	do {
-		pipe_cb->BUFFER[pipe_cb->w_position] = buf[has_write++];
-		pipe_cb->w_position = (pipe_cb->w_position + 1) % PIPE_BUFFER_SIZE;
-	} while(pipe_cb->r_position != (pipe_cb->w_position + 1) % PIPE_BUFFER_SIZE && (has_write < n));
+	has_write = pipe_cb->buf_size - pipe_used(pipe_cb);
+	if(has_write > n) has_write = n;
+	pipe_ring_put(pipe_cb, buf, has_write);
+	pipe_after_put(pipe_cb);
 
-	//wake up all the readers waiting 
-	kernel_broadcast(&pipe_cb->has_data);
+	Mutex_Unlock(&pipe_cb->lock);
 	return has_write;
 
 }
 
+int writer_pipe_WriteV(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt, unsigned int n, int flags){
+
+	if(pipecb_t == NULL) {
+		return -1;
+	}
+	Pipe_cb* pipe_cb = (Pipe_cb*)pipecb_t;
+	uint has_write;
+
+	Mutex_Lock(&pipe_cb->lock);
+	int has_space = pipe_wait_space(pipe_cb, flags);
+	if(has_space < 0){
+		Mutex_Unlock(&pipe_cb->lock);
+		return has_space;
+	}
+
+	//Fill the ring from the whole vector at once
+	has_write = pipe_cb->buf_size - pipe_used(pipe_cb);
+	if(has_write > n) has_write = n;
+	pipe_ring_putv(pipe_cb, iov, has_write);
+	pipe_after_put(pipe_cb);
+
+	Mutex_Unlock(&pipe_cb->lock);
+	return has_write;
+}
+
+//=====================================================
+//______________ SPLICE  _____________________________//
+//=====================================================
+
+/*
+	Move n bytes from one ring to another, without an intermediate copy.
+	This takes at most three memcpy calls, as each ring may wrap around 
+	once. Both locks must be held, and the data and space must be there.
+ */
+static void pipe_ring_move(Pipe_cb* in, Pipe_cb* out, uint n)
+{
+	while(n > 0) {
+		uint ioff = in->r_position & (in->buf_size-1);
+		uint ooff = out->w_position & (out->buf_size-1);
+		uint chunk = n;
+		if(chunk > in->buf_size - ioff) chunk = in->buf_size - ioff;
+		if(chunk > out->buf_size - ooff) chunk = out->buf_size - ooff;
+
+		memcpy(out->BUFFER + ooff, in->BUFFER + ioff, chunk);
+		in->r_position += chunk;
+		out->w_position += chunk;
+		n -= chunk;
+	}
+}
+
+int pipe_splice(Pipe_cb* in, Pipe_cb* out, uint size)
+{
+	if(in == out){
+		return -1;
+	}
+	if(size == 0){
+		return 0;
+	}
+
+	/* The two pipe locks are taken in address order */
+	Pipe_cb* first = (in < out) ? in : out;
+	Pipe_cb* second = (in < out) ? out : in;
+
+	while(1) {
+		/* Wait for data and then for space, holding one lock at a time */
+		Mutex_Lock(&in->lock);
+		int has_data = pipe_wait_data(in, 0);
+		Mutex_Unlock(&in->lock);
+		if(!has_data){
+			return 0;
+		}
+
+		Mutex_Lock(&out->lock);
+		int has_space = pipe_wait_space(out, 0);
+		Mutex_Unlock(&out->lock);
+		if(has_space < 0){
+			return -1;
+		}
+
+		/* Move what we can. Others may have raced us, then we retry. */
+		Mutex_Lock(&first->lock);
+		Mutex_Lock(&second->lock);
+		int moved;
+		if(out->reader == NULL || out->writer == NULL) {
+			moved = -1;
+		}
+		else {
+			uint n = pipe_used(in);
+			if(n > size) n = size;
+			if(n > out->buf_size - pipe_used(out)) n = out->buf_size - pipe_used(out);
+			pipe_ring_move(in, out, n);
+			if(n > 0) {
+				pipe_after_get(in);
+				pipe_after_put(out);
+			}
+			moved = n;
+		}
+		Mutex_Unlock(&second->lock);
+		Mutex_Unlock(&first->lock);
+
+		if(moved != 0){
+			return moved;
+		}
+	}
+}
+
+/* The pipe of an FCB, for reading or writing, or NULL if it has none. */
+static Pipe_cb* splice_pipe(FCB* fcb, int writing)
+{
+	if(fcb->streamfunc == (writing ? &writer_pipe_ops : &reader_pipe_ops))
+		return fcb->streamobj;
+	return socket_pipe(fcb, writing);
+}
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int size)
+{
+	int ret = -1;
+
+	FCB* in_fcb = get_fcb_ref(in);
+	FCB* out_fcb = get_fcb_ref(out);
+
+	if(in_fcb != NULL && out_fcb != NULL) {
+		Pipe_cb* in_pipe = splice_pipe(in_fcb, 0);
+		Pipe_cb* out_pipe = splice_pipe(out_fcb, 1);
+		if(in_pipe != NULL && out_pipe != NULL)
+			ret = pipe_splice(in_pipe, out_pipe, size);
+	}
+
+	if(in_fcb) FCB_decref(in_fcb);
+	if(out_fcb) FCB_decref(out_fcb);
+	return ret;
+}
+
+
 int writer_pipe_Close(void* pipecb_t){
 
 	if(pipecb_t == NULL){
@@ -236,8 +690,11 @@ int writer_pipe_Close(void* pipecb_t){
 
 	if(pipe_cb!=NULL){
 		//wake upp all the writer/readers before closing this pipe
-		kernel_broadcast(&pipe_cb->has_space); 
+		Mutex_Lock(&pipe_cb->lock);
 		pipe_cb->writer = NULL; 
+		pipe_wakeup_all(pipe_cb);
+		Mutex_Unlock(&pipe_cb->lock);
+		pipe_put(pipe_cb);
 		return 0; 
 	}
 	return -1; 
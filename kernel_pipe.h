@@ -12,35 +12,72 @@
 
 typedef struct pipe_control_block{
 
+    Mutex lock;           /* Protects all the fields of the pipe */
     FCB *reader;
     FCB *writer;
 	CondVar has_space;    /* For blocking writer if no space is available */
     CondVar has_data;     /* For blocking reader until data are available */
 	
-    int w_position, r_position;  
+    /* Free-running byte counters. The ring holds w_position-r_position bytes, 
+       at offsets masked by buf_size-1, so the full buffer is usable. */
+    uint w_position, r_position;  
     char *BUFFER;   /* bounded (cyclic) byte buffer */
-    int buf_size;   /* the size of buffer */
+    uint buf_size;  /* the size of buffer, a power of two */
+
+    /* Adaptive sizing: the buffer grows up to max_size after a number of 
+       writes find it full, and shrinks towards min_size when it empties
+       after using little of its space. If min_size==max_size it is fixed. */
+    uint min_size, max_size;
+    uint peak;      /* the most bytes held since the buffer last emptied */
+    uint pressure;  /* writes that found the buffer full since it last emptied */
+
+    /* Threads sleeping on has_data and has_space. The conditions are 
+       signalled only when someone waits, and has_space only after 
+       PIPE_SPACE_WATERMARK bytes are free. */
+    uint readers_waiting, writers_waiting;
+
+    /* The references to the pipe: its ends, or the peer sockets that use it.
+       The pipe is freed when the last one is dropped (see pipe_put). */
+    uint refs;
+
+    /* Set once the pipe has been polled. From then on, every change 
+       that may make it ready calls poll_notify(). */
+    int polled;
 
 }Pipe_cb;
 
 
 //General Funcs for Pipes
 int sys_Pipe(pipe_t* pipe);
-Pipe_cb* create_pipe_cb(FCB* reader, FCB* writer);//Initialize pipe control block
-int Pipe_Close(Fid_t end_fd); 
+Pipe_cb* create_pipe_cb(FCB* reader, FCB* writer, uint size);//Initialize pipe control block
+void pipe_put(Pipe_cb* pipe_cb);  //Drop a reference to the pipe
 
 
 // Reader's Functions declaration
 int reader_pipe_Read(void* pipe, char *buf, unsigned int size);
 int reader_pipe_Write(void* pipe, const char* buf, unsigned int size);
+int reader_pipe_ReadV(void* pipe, const iovec_t* iov, unsigned int iovcnt, unsigned int size, int flags);
+int reader_pipe_Poll(void* pipe);
 int reader_pipe_Close(void* pipe);
 
 
 // Writer's Functions declaration
 int writer_pipe_Read(void* pipe, char *buf, unsigned int size);
 int writer_pipe_Write(void* pipe, const char* buf, unsigned int size);
+int writer_pipe_WriteV(void* pipe, const iovec_t* iov, unsigned int iovcnt, unsigned int size, int flags);
+int writer_pipe_Poll(void* pipe);
 int writer_pipe_Close(void* pipe);
 
+// Wake up all the readers and writers of a pipe, after a change of its ends.
+void pipe_wakeup_all(Pipe_cb* pipe_cb);
+
+// The Poll events of the read and write ends of a pipe. These lock the pipe.
+int pipe_read_events(Pipe_cb* pipe_cb);
+int pipe_write_events(Pipe_cb* pipe_cb);
+
+// Move up to size bytes from one pipe to another, blocking like Read and Write.
+int pipe_splice(Pipe_cb* in, Pipe_cb* out, uint size);
+
 
 
 #endif
\ No newline at end of file
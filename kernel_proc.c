@@ -3,6 +3,7 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_slab.h"
 
 
 /* 
@@ -15,56 +16,85 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table. 
+
+  It is a directory of chunks of PROC_CHUNK PCBs, which are allocated as
+  more pids are needed. Only the first proc_table_size pids have a PCB.
+  The free PCBs are kept in a list, linked through their parent field,
+  so that the lowest pids of a new chunk are given out first.
+ */
+static PCB* PT[MAX_PROC/PROC_CHUNK];
+static int proc_table_size;
 unsigned int process_count;
+Mutex proc_lock = MUTEX_INIT;
 
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  if(pid < 0 || pid >= __atomic_load_n(& proc_table_size, __ATOMIC_ACQUIRE))
+    return NULL;
+  PCB* pcb = & PT[pid/PROC_CHUNK][pid%PROC_CHUNK];
+  return pcb->pstate==FREE ? NULL : pcb;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
-/* Initialize a PCB */
-static inline void initialize_PCB(PCB* pcb)
+/* Cold blocks are constructed with empty lists, no open files and no waiters */
+static void pcb_cold_ctor(void* obj)
 {
-  pcb->pstate = FREE;
-  pcb->argl = 0;
-  pcb->args = NULL;
-
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
-
-  rlnode_init(& pcb->children_list, NULL);
-  rlnode_init(& pcb->exited_list, NULL);
-  rlnode_init(& pcb->children_node, pcb);
-  rlnode_init(& pcb->exited_node, pcb);
-  pcb->child_exit = COND_INIT;
+  PCB_cold* cold = obj;
+
+  cold->fidt = NULL;
+  cold->fidt_lock = MUTEX_INIT;
+  cold->thread_lock = MUTEX_INIT;
+
+  rlnode_init(& cold->children_list, NULL);
+  rlnode_init(& cold->exited_list, NULL);
+  rlnode_init(& cold->children_node, NULL);
+  rlnode_init(& cold->exited_node, NULL);
+  rlnode_init(& cold->ptcb_list, NULL);
+  cold->child_exit = COND_INIT;
+
+  cold->tid_table = NULL;
+  cold->tid_table_size = 0;
+  cold->tid_free_slot = 0;
 }
 
+static kmem_cache pcb_cold_cache = KMEM_CACHE_INIT("pcb", PCB_cold, pcb_cold_ctor);
+
 
 static PCB* pcb_freelist;
 
-void initialize_processes()
+/*
+  Add a chunk of free PCBs to the process table, if it is not full.
+  Must be called with proc_lock held, and no free PCBs.
+*/
+static void grow_process_table()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
+  if(proc_table_size == MAX_PROC) return;
+
+  PCB* chunk = (PCB*)xmalloc(PROC_CHUNK*sizeof(PCB));
+  for(int i=PROC_CHUNK-1; i>=0; i--) {
+    PCB* pcb = & chunk[i];
+    pcb->pstate = FREE;
+    pcb->pid = proc_table_size + i;
+    pcb->cold = NULL;
+    pcb->parent = pcb_freelist;
+    pcb_freelist = pcb;
   }
 
-  /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
-  }
+  PT[proc_table_size/PROC_CHUNK] = chunk;
+  __atomic_store_n(& proc_table_size, proc_table_size+PROC_CHUNK, __ATOMIC_RELEASE);
+}
 
+void initialize_processes()
+{
+  /* The process table starts empty, and grows with the first Exec */
+  pcb_freelist = NULL;
+  proc_table_size = 0;
   process_count = 0;
 
   /* Execute a null "idle" process */
@@ -72,30 +102,131 @@ void initialize_processes()
     FATAL("The scheduler process does not have pid==0");
 }
 
+void finalize_processes()
+{
+  for(int c=0; c < proc_table_size/PROC_CHUNK; c++) {
+    free(PT[c]);
+    PT[c] = NULL;
+  }
+  proc_table_size = 0;
+  pcb_freelist = NULL;
+}
+
+
+/*
+  The thread handle table.
+
+  A Tid_t holds the generation of its slot in the high bits and the slot
+  index in the low TID_SLOT_BITS. Generations start at 1, so that no
+  handle is NOTHREAD. The free slots are linked through next_free, and 
+  the table doubles in size when they run out.
+ */
+#define TID_SLOT_BITS 32
+#define TID_SLOT_MASK ((((Tid_t)1) << TID_SLOT_BITS) - 1)
+#define TID_TABLE_MIN 8
+
+static void tid_table_grow(PCB_cold* cold)
+{
+  uint old_size = cold->tid_table_size;
+  uint size = (old_size == 0) ? TID_TABLE_MIN : 2*old_size;
+
+  cold->tid_table = (tid_slot*)realloc(cold->tid_table, size*sizeof(tid_slot));
+  if(cold->tid_table == NULL)
+    FATAL("Out of memory for thread handles");
+
+  for(uint i=old_size; i<size; i++) {
+    cold->tid_table[i].ptcb = NULL;
+    cold->tid_table[i].gen = 1;
+    cold->tid_table[i].next_free = i+1;
+  }
+  cold->tid_table_size = size;
+}
+
+Tid_t tid_alloc(PCB* pcb, PTCB* ptcb)
+{
+  PCB_cold* cold = pcb->cold;
+  if(cold->tid_free_slot == cold->tid_table_size)
+    tid_table_grow(cold);
+
+  uint slot = cold->tid_free_slot;
+  tid_slot* ts = & cold->tid_table[slot];
+  cold->tid_free_slot = ts->next_free;
+  ts->ptcb = ptcb;
+
+  ptcb->tid = ((Tid_t)ts->gen << TID_SLOT_BITS) | slot;
+  return ptcb->tid;
+}
+
+PTCB* tid_lookup(PCB* pcb, Tid_t tid)
+{
+  PCB_cold* cold = pcb->cold;
+  Tid_t slot = tid & TID_SLOT_MASK;
+  if(slot >= cold->tid_table_size) return NULL;
+
+  tid_slot* ts = & cold->tid_table[slot];
+  if(ts->ptcb == NULL || ts->gen != (tid >> TID_SLOT_BITS)) return NULL;
+  return ts->ptcb;
+}
+
+void tid_release(PCB* pcb, Tid_t tid)
+{
+  PCB_cold* cold = pcb->cold;
+  uint slot = tid & TID_SLOT_MASK;
+  tid_slot* ts = & cold->tid_table[slot];
+
+  assert(ts->ptcb != NULL && ts->ptcb->tid == tid);
+  ts->ptcb = NULL;
+  if(++ts->gen == 0) ts->gen = 1;
+  ts->next_free = cold->tid_free_slot;
+  cold->tid_free_slot = slot;
+}
+
+void tid_table_clear(PCB* pcb)
+{
+  PCB_cold* cold = pcb->cold;
+  free(cold->tid_table);
+  cold->tid_table = NULL;
+  cold->tid_table_size = 0;
+  cold->tid_free_slot = 0;
+}
+
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  if(pcb_freelist == NULL)
+    grow_process_table();
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
-    rlnode_init(&pcb->ptcb_list, NULL);
+    pcb->main_thread = NULL;
+    pcb->sched_usage = 0;
+    pcb->sched_usage_stamp = bios_clock();
+
+    PCB_cold* cold = (PCB_cold*)kmem_cache_alloc(& pcb_cold_cache);
+    cold->children_node.pcb = pcb;
+    cold->exited_node.pcb = pcb;
+    cold->thread_count = 0;
+    pcb->cold = cold;
   }
 
   return pcb;
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
+  kmem_cache_free(& pcb_cold_cache, pcb->cold);
+  pcb->cold = NULL;
   pcb->pstate = FREE;
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
@@ -117,9 +248,9 @@ void start_main_thread()
 {
   int exitval;
 
-  Task call =  CURPROC->main_task;
-  int argl = CURPROC->argl;
-  void* args = CURPROC->args;
+  Task call =  CURPROC->cold->main_task;
+  int argl = CURPROC->cold->argl;
+  void* args = CURPROC->cold->args;
 
   exitval = call(argl,args);
   Exit(exitval);
@@ -145,14 +276,19 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   PCB *curproc, *newproc;
   
   /* The new process PCB */
+  Mutex_Lock(& proc_lock);
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {
+    Mutex_Unlock(& proc_lock);
+    goto finish;  /* We have run out of PIDs! */
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    Mutex_Unlock(& proc_lock);
   }
   else
   {
@@ -161,28 +297,25 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
     /* Add new process to the parent's child list */
     newproc->parent = curproc;
-    rlist_push_front(& curproc->children_list, & newproc->children_node);
+    rlist_push_front(& curproc->cold->children_list, & newproc->cold->children_node);
+    Mutex_Unlock(& proc_lock);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    FIDT_share(newproc, curproc);
   }
 
 
   /* Set the main thread's function */
-  newproc->main_task = call;
+  newproc->cold->main_task = call;
 
   /* Copy the arguments to new storage, owned by the new process */
-  newproc->argl = argl;
+  newproc->cold->argl = argl;
   if(args!=NULL) {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
+    newproc->cold->args = malloc(argl);
+    memcpy(newproc->cold->args, args, argl);
   }
   else
-    newproc->args=NULL;
+    newproc->cold->args=NULL;
 
   /* 
     Create and wake up the thread for the main function. This must be the last thing
@@ -191,8 +324,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
    */
   if(call != NULL) {
      /* vsam's copde newproc->main_thread = spawn_thread(newproc, start_main_thread); */
-    PTCB* call_ptcb = initialize_ptcb(newproc, newproc->main_task, 
-                                newproc->argl, newproc->args, start_main_thread);
+    PTCB* call_ptcb = initialize_ptcb(newproc, newproc->cold->main_task, 
+                                newproc->cold->argl, newproc->cold->args, start_main_thread, STACK_DEFAULT);
     newproc->main_thread = call_ptcb->tcb;
     wakeup(newproc->main_thread);
   }
@@ -212,7 +345,10 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  Mutex_Lock(& proc_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(& proc_lock);
+  return ppid;
 }
 
 
@@ -221,13 +357,16 @@ static void cleanup_zombie(PCB* pcb, int* status)
   if(status != NULL)
     *status = pcb->exitval;
 
-  rlist_remove(& pcb->children_node);
-  rlist_remove(& pcb->exited_node);
+  rlist_remove(& pcb->cold->children_node);
+  rlist_remove(& pcb->cold->exited_node);
 
   release_PCB(pcb);
 }
 
 
+/*
+  Must be called with proc_lock held
+*/
 static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 {
 
@@ -247,7 +386,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(& proc_lock, & parent->cold->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -256,6 +395,9 @@ finish:
 }
 
 
+/*
+  Must be called with proc_lock held
+*/
 static Pid_t wait_for_any_child(int* status)
 {
   Pid_t cpid;
@@ -265,19 +407,19 @@ static Pid_t wait_for_any_child(int* status)
   /* Make sure I have children! */
   int no_children, has_exited;
   while(1) {
-    no_children = is_rlist_empty(& parent->children_list);
+    no_children = is_rlist_empty(& parent->cold->children_list);
     if( no_children ) break;
 
-    has_exited = ! is_rlist_empty(& parent->exited_list);
+    has_exited = ! is_rlist_empty(& parent->cold->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(& proc_lock, & parent->cold->child_exit, SCHED_USER);    
   }
 
   if(no_children)
     return NOPROC;
 
-  PCB* child = parent->exited_list.next->pcb;
+  PCB* child = parent->cold->exited_list.next->pcb;
   assert(child->pstate == ZOMBIE);
   cpid = get_pid(child);
   cleanup_zombie(child, status);
@@ -288,15 +430,20 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Pid_t ret;
+
+  Mutex_Lock(& proc_lock);
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    ret = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    ret = wait_for_any_child(status);
   }
+  Mutex_Unlock(& proc_lock);
 
+  return ret;
 }
 
 
@@ -306,7 +453,9 @@ void sys_Exit(int exitval)
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
   /* First, store the exit status */
+  Mutex_Lock(& proc_lock);
   curproc->exitval = exitval;
+  Mutex_Unlock(& proc_lock);
 
   /* 
     Here, we must check that we are not the init task. 
@@ -323,6 +472,8 @@ void sys_Exit(int exitval)
 }
 
 /* System Info Operations & Control Block */
+static kmem_cache info_cache = KMEM_CACHE_INIT("info", Info_cb, NULL);
+
 /* Info CB stream functions */
 
 /* Reader function to print system information */
@@ -331,26 +482,39 @@ int info_Read(void* info_cb, char *proc_info, unsigned int n) {
   Info_cb* info = (Info_cb*)info_cb;    // The info CB 
   int i = info->index_counter;            // Proccess table info counter
 
+  Mutex_Lock(& proc_lock);
+
   // Copy system/proccess information in order to print them
-  if(PT[i].pstate != FREE) {
-    info->proc_info->pid = get_pid(&PT[i]);
-    info->proc_info->ppid = get_pid(PT[i].parent);
-    if(PT[i].pstate == ZOMBIE) {
-        info->proc_info->alive = 0;
+  PCB* pcb = get_pcb(i);
+  if(pcb != NULL) {
+    PCB_cold* cold = pcb->cold;
+    info->proc_info.pid = get_pid(pcb);
+    info->proc_info.ppid = get_pid(pcb->parent);
+    if(pcb->pstate == ZOMBIE) {
+        info->proc_info.alive = 0;
     } else {
-        info->proc_info->alive = PT[i].pstate;
+        info->proc_info.alive = pcb->pstate;
       }
-    info->proc_info->thread_count = rlist_len(&PT[i].ptcb_list);
-    info->proc_info->main_task = PT[i].main_task;
-    info->proc_info->argl = PT[i].argl;
-    memcpy(info->proc_info->args, PT[i].args, PT[i].argl);
+    Mutex_Lock(& cold->thread_lock);
+    info->proc_info.thread_count = rlist_len(&cold->ptcb_list);
+    /* The TCBs of exited threads may be gone */
+    info->proc_info.stack_rss = 0;
+    for(rlnode* n = cold->ptcb_list.next; n != &cold->ptcb_list; n = n->next)
+      if(! n->ptcb->exited)
+        info->proc_info.stack_rss += thread_stack_rss(n->ptcb->tcb);
+    Mutex_Unlock(& cold->thread_lock);
+    info->proc_info.main_task = cold->main_task;
+    info->proc_info.argl = cold->argl;
+    memcpy(info->proc_info.args, cold->args, cold->argl);
     
-    memcpy(proc_info, info->proc_info, n);
+    memcpy(proc_info, &info->proc_info, n);
     info->index_counter++;
   } else {
     // If proccess is FREE do not display its info
+    Mutex_Unlock(& proc_lock);
     return -1;
   }
+  Mutex_Unlock(& proc_lock);
   
   // If all non-free proccess info is printed return
   if(info->index_counter==MAX_PROC) {
@@ -365,7 +529,7 @@ int info_Write(void* info_cb, const char* buf, unsigned int n) {
 /* Function to free the Info CB */
 int info_Close(void* info_cb) {
   Info_cb* info = (Info_cb*)info_cb;
-  free(info);
+  kmem_cache_free(&info_cache, info);
   info = NULL;
   return 1;
 }
@@ -388,13 +552,13 @@ Fid_t sys_OpenInfo()
   if(ret == 0) {
     return NOFILE;
   }
-  info = (Info_cb*)malloc(sizeof(Info_cb));
+  info = (Info_cb*)kmem_cache_alloc(&info_cache);
   info->info_fcb = fcb;
   info->info_fcb->streamobj = info;
   info->info_fcb->streamfunc = &sys_info_ops;
-  info->proc_info = (procinfo*)malloc(sizeof(procinfo));
   info->index_counter = 1;
 
+  FCB_install(1, &fd, &fcb);
 	return fd;
 }
 
@@ -17,6 +17,7 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_streams.h"
 
 /**
   @brief PID state
@@ -31,17 +32,13 @@ typedef enum pid_state_e {
 } pid_state;
 
 /**
-  @brief Process Control Block.
+  @brief The cold part of a Process Control Block.
 
-  This structure holds all information pertaining to a process.
+  This holds the resources of a process, which are not needed by the 
+  scheduler, or to look up a process by its pid. It is allocated when 
+  a pid is given to a process, and freed when the pid becomes free again.
  */
-typedef struct process_control_block {
-  pid_state  pstate;      /**< @brief The pid state for this PCB */
-
-  PCB* parent;            /**< @brief Parent's pcb. */
-  int exitval;            /**< @brief The exit value of the process */
-
-  TCB* main_thread;       /**< @brief The main thread */
+typedef struct process_cold_block {
   Task main_task;         /**< @brief The main thread's function */
   int argl;               /**< @brief The main thread's argument length */
   void* args;             /**< @brief The main thread's argument string */
@@ -58,21 +55,104 @@ typedef struct process_control_block {
                              process terminates. It is used in the implementation of
                              @c WaitChild() */
 
-  FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  FIDT* fidt;             /**< @brief The fileid table of the process, or NULL */
+  Mutex fidt_lock;        /**< @brief Protects @c fidt */
   rlnode ptcb_list;
   uint thread_count;
-  
+  Mutex thread_lock;      /**< @brief Protects @c ptcb_list, @c thread_count, the thread handles and the PTCBs */
+
+  struct tid_slot* tid_table;  /**< @brief The thread handles, see @c tid_alloc */
+  uint tid_table_size;         /**< @brief The number of slots in @c tid_table */
+  uint tid_free_slot;          /**< @brief The first free slot, or @c tid_table_size */
+} PCB_cold;
+
+
+/**
+  @brief Process Control Block.
+
+  This structure holds the information about a process that is used on 
+  the scheduling and system call paths. PCBs are kept, densely, in the 
+  process table; the rest of the information on a process is in its
+  @c cold block.
+ */
+typedef struct process_control_block {
+  pid_state  pstate;      /**< @brief The pid state for this PCB */
+  Pid_t pid;              /**< @brief The pid of this PCB */
+  int exitval;            /**< @brief The exit value of the process */
+
+  PCB* parent;            /**< @brief Parent's pcb. */
+  TCB* main_thread;       /**< @brief The main thread */
+  PCB_cold* cold;         /**< @brief The rest of the process, or NULL for a free PCB */
+
+  TimerDuration sched_usage;        /**< @brief Decayed CPU usage, for the fair-share policy */
+  TimerDuration sched_usage_stamp;  /**< @brief The time @c sched_usage was last decayed */
 } PCB;
 
+/**
+  @brief A slot of the thread handle table of a process.
+
+  A @c Tid_t holds the index of a slot and its generation, which changes 
+  every time the slot is freed. A stale handle therefore never matches 
+  its slot again, even if the slot has been reused.
+ */
+typedef struct tid_slot {
+  PTCB* ptcb;             /**< @brief The thread, or NULL for a free slot */
+  uint gen;               /**< @brief The generation of the slot */
+  uint next_free;         /**< @brief The next free slot, for a free slot */
+} tid_slot;
+
+/**
+  @brief Give a handle to a new thread of a process.
+
+  The handle is stored in @c ptcb->tid. This must be called with the
+  @c thread_lock of the process held.
+ */
+Tid_t tid_alloc(PCB* pcb, PTCB* ptcb);
+
+/**
+  @brief Return the thread of a process with a given handle.
+
+  This takes O(1) time. This must be called with the @c thread_lock 
+  of the process held.
+
+  @returns the PTCB of the thread, or NULL if @c tid is not the handle
+    of a thread of this process.
+ */
+PTCB* tid_lookup(PCB* pcb, Tid_t tid);
+
+/**
+  @brief Free the handle of a thread, which becomes stale.
+
+  This must be called with the @c thread_lock of the process held.
+ */
+void tid_release(PCB* pcb, Tid_t tid);
+
+/**
+  @brief Free all the handles of a process, whose threads have exited.
+ */
+void tid_table_clear(PCB* pcb);
+
+/** @brief The process table grows by this many PCBs at a time */
+#define PROC_CHUNK 256
+
 /* System Info Control Block*/
 typedef struct system_info_control_block {
   FCB* info_fcb;
-	procinfo* proc_info;
+	procinfo proc_info;
 	int index_counter;
 } Info_cb;
 
 
 
+/**
+  @brief Lock for the process table.
+
+  This protects the free PCBs, the @c pstate, @c parent and @c exitval fields 
+  and the children lists of all PCBs. Processes wait for their children to 
+  exit while releasing this lock.
+*/
+extern Mutex proc_lock;
+
 /**
   @brief Initialize the process table.
 
@@ -81,6 +161,14 @@ typedef struct system_info_control_block {
 */
 void initialize_processes();
 
+/**
+  @brief Finalize the process table.
+
+  This is called after the VM has stopped, to return the process table 
+  to the system.
+*/
+void finalize_processes();
+
 /**
   @brief Get the PCB for a PID.
 
@@ -1,11 +1,14 @@
 
 #include <assert.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <link.h>
 
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_slab.h"
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -55,27 +58,31 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  The TCB and the stack of a thread are allocated in one memory block.
+  On the x86 architecture, the stack grows downward, towards the TCB,
+  so a guard page is placed between them.
 
   +-------------+
-  |   TCB       |
+  | first frame |
   +-------------+
+  |      |      |
+  |      v      |
   |             |
-  |    stack    |
+  |    stack    |    thread_stack_size[stack class]
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
+  |   TCB       |
+  +-------------+   <-- the address of the block (and the TCB)
 
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
   crash own thread, before it affects other threads (which may make debugging
   easier).
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  we do not support stack growth anyway! Instead, a thread may be created
+  with a smaller or larger stack (see CreateThreadEx).
  */
 
 
@@ -92,38 +99,84 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
 #define THREAD_TCB_SIZE   (((sizeof(TCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
+/* The stack sizes of the stack classes */
+const size_t thread_stack_size[STACK_CLASSES] = {
+  [STACK_SMALL] = 32*1024,
+  [STACK_DEFAULT] = THREAD_STACK_SIZE,
+  [STACK_LARGE] = 1024*1024
+};
 
-#define YIELD_MAX_AGE 1000
+#define THREAD_STACK(tcb)  (((void*)(tcb)) + THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE)
+#define THREAD_SIZE(cls)  (THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE + thread_stack_size[cls])
 
-//#define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The block only reserves address space: 
+  the system commits a page of the stack when the thread first touches it,
+  so a thread that uses a few KB of a large stack costs a few KB of memory.
+  The guard page is made inaccessible, so that a stack overflow is detected 
+  as a seg.fault.
  */
 void free_thread(void* ptr, size_t size)
 {
   CHECK(munmap(ptr, size));
 }
 
+/*
+  Thread stacks are not executable, unless the program asks for an
+  executable stack in its PT_GNU_STACK header (as gcc does for the 
+  trampolines of nested functions). This is the rule the C library 
+  follows for its own thread stacks.
+ */
+static int find_stack_prot(struct dl_phdr_info* info, size_t size, void* data)
+{
+  int* prot = data;
+  for(int i=0; i<info->dlpi_phnum; i++)
+    if(info->dlpi_phdr[i].p_type == PT_GNU_STACK && (info->dlpi_phdr[i].p_flags & PF_X))
+      *prot |= PROT_EXEC;
+  return 1;   /* The executable comes first, the shared objects do not matter */
+}
+
+static int thread_stack_prot()
+{
+  static int prot = 0;
+  if(prot == 0) {
+    int p = PROT_READ|PROT_WRITE;
+    dl_iterate_phdr(find_stack_prot, &p);
+    prot = p;
+  }
+  return prot;
+}
+
 void* allocate_thread(size_t size)
 {
   void* ptr = mmap(NULL, size,
-      PROT_READ|PROT_WRITE|PROT_EXEC,
-      MAP_ANONYMOUS  | MAP_PRIVATE
+      thread_stack_prot(),
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE
       , -1,0);
 
   CHECK((ptr==MAP_FAILED)?-1:0);
+  CHECK(mprotect(ptr + THREAD_TCB_SIZE, SYSTEM_PAGE_SIZE, PROT_NONE));
 
   return ptr;
 }
+
+/*
+  Return the stack pages of a free block to the system, except for the top
+  page, which the next thread will surely touch. The address space is kept,
+  and the pages are committed again on demand. Else, a block that once ran
+  a deep recursion would stay committed for every thread that reuses it.
+ */
+void release_thread_stack(void* ptr, stack_class cls)
+{
+  CHECK(madvise(THREAD_STACK(ptr), thread_stack_size[cls] - SYSTEM_PAGE_SIZE, MADV_DONTNEED));
+}
 #else
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
-  be made easily to 'detect' stack overflow.
+  be made easily to 'detect' stack overflow: the guard page is just padding.
  */
 void free_thread(void* ptr, size_t size)
 {
@@ -136,9 +189,32 @@ void* allocate_thread(size_t size)
   CHECK((ptr==NULL)?-1:0);
   return ptr;
 }
+
+void release_thread_stack(void* ptr, stack_class cls)
+{
+  /* The heap keeps its pages */
+}
 #endif
 
 
+/*
+  Return the bytes of the stack of a thread that are resident in memory.
+ */
+size_t thread_stack_rss(TCB* tcb)
+{
+  size_t size = thread_stack_size[tcb->stack_class];
+  size_t pages = size / SYSTEM_PAGE_SIZE;
+  unsigned char resident[pages];
+
+  if(mincore(THREAD_STACK(tcb), size, resident) != 0) return 0;
+
+  size_t count = 0;
+  for(size_t p=0; p<pages; p++)
+    count += resident[p] & 1;
+  return count * SYSTEM_PAGE_SIZE;
+}
+
+
 
 /*
   This is the function that is used to start normal threads.
@@ -156,36 +232,162 @@ static void thread_start()
 }
 
 
+/* PTCBs are constructed with an empty exit_cv and a detached ptcb_node */
+static void ptcb_ctor(void* obj)
+{
+  PTCB* ptcb = obj;
+  ptcb->exit_cv = COND_INIT;
+  rlnode_init(& ptcb->ptcb_node, ptcb);
+}
+
+static kmem_cache ptcb_cache = KMEM_CACHE_INIT("ptcb", PTCB, ptcb_ctor);
+
 /*
   Initialize and return a new TCB
 */
 
-PTCB* initialize_ptcb(PCB* proc, Task task, int argl, void* args, void (*func)()){
+PTCB* initialize_ptcb(PCB* proc, Task task, int argl, void* args, void (*func)(), stack_class cls){
 
-  PTCB* ptcb = (PTCB*)xmalloc(sizeof(PTCB));
+  PTCB* ptcb = (PTCB*)kmem_cache_alloc(& ptcb_cache);
   ptcb->task = task;
   ptcb->args = args;
   ptcb->argl = argl;
   ptcb->exited = 0;
   ptcb->detached = 0;
-  ptcb->exit_cv = COND_INIT;
   ptcb->exitval = 0;
   ptcb->ref_count = 0;
-  rlnode_init(& ptcb->ptcb_node, ptcb);
 
-  TCB* tcb = spawn_thread(proc, ptcb, func);
+  TCB* tcb = spawn_thread(proc, ptcb, func, cls);
   ptcb->tcb = tcb;
   
-  proc->thread_count = proc->thread_count+1;
-  rlist_push_back(& proc->ptcb_list, & ptcb->ptcb_node);
+  Mutex_Lock(& proc->cold->thread_lock);
+  proc->cold->thread_count = proc->cold->thread_count+1;
+  rlist_push_back(& proc->cold->ptcb_list, & ptcb->ptcb_node);
+  tid_alloc(proc, ptcb);
+  Mutex_Unlock(& proc->cold->thread_lock);
   return ptcb;
 }
 
-TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)())
+void release_ptcb(PTCB* ptcb)
+{
+  kmem_cache_free(& ptcb_cache, ptcb);
+}
+
+/*
+  The thread pool.
+
+  The memory blocks of exited threads (TCB and stack) are recycled, 
+  separately for each stack class. Each core keeps up to THREAD_CACHE_SIZE
+  blocks per class in its CCB, which it accesses with interrupts off and
+  no locking. When its cache is empty, or full, a core moves half a cache
+  of blocks from, or to, the global depot of the class. Each depot keeps
+  at most thread_pool_limit blocks (its high-water mark); blocks beyond 
+  this are returned to the system. A limit of 0 disables recycling 
+  altogether. The stack memory of a recycled block is released when it
+  enters the pool (see release_thread_stack).
+
+  Free blocks in the depot are linked through their first word.
+ */
+#define THREAD_CACHE_BATCH (THREAD_CACHE_SIZE/2)
+
+typedef struct thread_block { struct thread_block* next; } thread_block;
+
+static Mutex thread_depot_lock = MUTEX_INIT;
+static thread_block* thread_depot[STACK_CLASSES];       /* The free blocks of the depots */
+static unsigned int thread_depot_count[STACK_CLASSES];  /* Number of blocks in each depot */
+static thread_pool_stats pool_stats;    /* The global statistics, see get_thread_pool_stats */
+
+unsigned int thread_pool_limit = THREAD_POOL_LIMIT;
+
+
+/* Move a batch of blocks from the depot to the cache of a core, which must be empty */
+static void thread_cache_refill(CCB* core, stack_class cls)
+{
+  Mutex_Lock(& thread_depot_lock);
+  while(thread_depot[cls] != NULL && core->thread_cache_count[cls] < THREAD_CACHE_BATCH) {
+    core->thread_cache[cls][core->thread_cache_count[cls]++] = thread_depot[cls];
+    thread_depot[cls] = thread_depot[cls]->next;
+    thread_depot_count[cls]--;
+  }
+  Mutex_Unlock(& thread_depot_lock);
+}
+
+/* Move a batch of blocks from the full cache of a core to the depot, or to the system */
+static void thread_cache_flush(CCB* core, stack_class cls)
+{
+  thread_block* excess = NULL;
+
+  Mutex_Lock(& thread_depot_lock);
+  for(int i=0; i<THREAD_CACHE_BATCH; i++) {
+    thread_block* blk = core->thread_cache[cls][--core->thread_cache_count[cls]];
+    if(thread_depot_count[cls] < thread_pool_limit) {
+      blk->next = thread_depot[cls];
+      thread_depot[cls] = blk;
+      thread_depot_count[cls]++;
+    } else {
+      blk->next = excess;
+      excess = blk;
+      __atomic_fetch_add(& pool_stats.released, 1, __ATOMIC_RELAXED);
+    }
+  }
+  if(thread_depot_count[cls] > pool_stats.depot_peak)
+    pool_stats.depot_peak = thread_depot_count[cls];
+  Mutex_Unlock(& thread_depot_lock);
+
+  while(excess != NULL) {
+    thread_block* next = excess->next;
+    free_thread(excess, THREAD_SIZE(cls));
+    excess = next;
+  }
+}
+
+/* Get a block for a new thread */
+static void* thread_pool_get(stack_class cls)
+{
+  void* blk = NULL;
+
+  if(thread_pool_limit > 0) {
+    int preempt = preempt_off;
+    CCB* core = & CURCORE;
+    if(core->thread_cache_count[cls] == 0)
+      thread_cache_refill(core, cls);
+    if(core->thread_cache_count[cls] > 0) {
+      blk = core->thread_cache[cls][--core->thread_cache_count[cls]];
+      core->thread_reuse++;
+    }
+    if(preempt) preempt_on;
+  }
+
+  if(blk == NULL) {
+    blk = allocate_thread(THREAD_SIZE(cls));
+    __atomic_fetch_add(& pool_stats.allocated, 1, __ATOMIC_RELAXED);
+  }
+  return blk;
+}
+
+/* Recycle the block of an exited thread. This is called with interrupts off. */
+static void thread_pool_put(void* blk, stack_class cls)
+{
+  if(thread_pool_limit == 0) {
+    free_thread(blk, THREAD_SIZE(cls));
+    __atomic_fetch_add(& pool_stats.released, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  release_thread_stack(blk, cls);
+
+  CCB* core = & CURCORE;
+  if(core->thread_cache_count[cls] == THREAD_CACHE_SIZE)
+    thread_cache_flush(core, cls);
+  core->thread_cache[cls][core->thread_cache_count[cls]++] = blk;
+}
+
+
+TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)(), stack_class cls)
 {
   /* The allocated thread size must be a multiple of page size */
 
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  TCB* tcb = (TCB*) thread_pool_get(cls);
 
   /* Set the owner */
   tcb->owner_pcb = pcb;
@@ -198,18 +400,26 @@ TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)())
   tcb->prev_cause = SCHED_OTHER;
   tcb->priority = SCHEDMAX + 1;
   tcb->wakeup_time = NO_TIMEOUT;
+  tcb->state_spinlock = MUTEX_INIT;
   rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
   tcb->ptcb = ptcb;
+  tcb->cpu_time = 0;
+  tcb->last_core = NO_CORE;
+  tcb->affinity = 0;
+  tcb->nice = 0;
+  tcb->vruntime = 0;
+  tcb->stack_class = cls;
 
   /* Compute the stack segment address and size */
-  void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+  void* sp = THREAD_STACK(tcb);
+  size_t stack_size = thread_stack_size[cls];
 
   /* Init the context */
-  cpu_initialize_context(& tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+  cpu_initialize_context(& tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
   tcb->valgrind_stack_id =
-    VALGRIND_STACK_REGISTER(sp, sp+THREAD_STACK_SIZE);
+    VALGRIND_STACK_REGISTER(sp, sp+stack_size);
 #endif
 
   /* increase the count of active threads */
@@ -222,7 +432,8 @@ TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)())
 
 
 /*
-  This is called with tcb->state_spinlock locked !
+  This is called with tcb->state_spinlock locked ! The lock is freed 
+  together with the TCB.
  */
 void release_TCB(TCB* tcb)
 {
@@ -230,7 +441,8 @@ void release_TCB(TCB* tcb)
   VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-  free_thread(tcb, THREAD_SIZE);
+  /* This must precede the decrement, so that the pool is complete when the scheduler ends */
+  thread_pool_put(tcb, tcb->stack_class);
 
   Mutex_Lock(&active_threads_spinlock);
   active_threads--;
@@ -254,96 +466,194 @@ CCB cctx[MAX_CORES];
 
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  The scheduler queues are kept per core. Each CCB holds a multi-level
+  ready queue (one list per priority level), protected by the core's
+  sched_spinlock. The order of the queue and the priorities of threads
+  are decided by the active scheduling policy (see kernel_sched_policy.c).
+
+  A thread that wakes up is queued at the core that last ran it, where
+  its cache is warm, unless some other allowed core is idle (see 
+  sched_place). A remote idle core is kicked with an ICI. If the policy
+  ranks the woken thread as more urgent than the thread running on its
+  core, that core is preempted: a remote core by an ICI, the current core
+  at its next preemption point (see preempt_point). A thread only runs
+  on the cores of its affinity mask. A core dequeues from its own queue;
+  when that is empty, it tries to steal a thread from the queue of 
+  another core.
+
+  The state of a thread (fields state, phase and wakeup_time) is 
+  protected by the TCB's state_spinlock.
+
+  Also, the scheduler keeps the sleeping threads with a timeout in a
+  hierarchical timer wheel (see below). This is protected by 
+  timeout_spinlock.
+
+  The lock order is
+
+    tcb->state_spinlock  -->  timeout_spinlock  -->  ccb->sched_spinlock
+*/
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
 
-  Both of these structures are protected by @c sched_spinlock.
+/*
+  The timer wheel.
+
+  Time is divided into ticks of TW_TICK microseconds. A thread with wakeup
+  time w expires at tick ceil(w/TW_TICK). The wheel has TW_LEVELS levels of 
+  TW_SLOTS slots each; level l holds the threads that expire within 
+  TW_SLOTS^(l+1) ticks from now, hashed by bits [l*TW_BITS, (l+1)*TW_BITS) 
+  of their expiry tick. Threads further in the future than the whole wheel 
+  are kept in the last slot they can reach, and are re-hashed when it
+  is visited.
+
+  As the wheel advances, each level-0 slot that becomes due is moved as a 
+  whole onto TIMEOUT_EXPIRED, and whenever level l wraps around, the 
+  current slot of level l+1 is cascaded down. Thus, inserting and 
+  cancelling a timeout are O(1), and each timeout is touched at most 
+  TW_LEVELS times before it expires.
+
+  Expired threads wait in TIMEOUT_EXPIRED until the scheduler makes them
+  ready (see sched_wakeup_expired).
 */
 
+#define TW_TICK   1000ull                 /* usec per tick */
+#define TW_BITS   6
+#define TW_SLOTS  (1u<<TW_BITS)
+#define TW_MASK   (TW_SLOTS-1)
+#define TW_LEVELS 4                       /* 2^24 ticks: over 4 hours */
 
-//rlnode SCHED;
-rlnode schedArray[QUEUE_NUMBER];       /* The scheduler queue  */
-rlnode TIMEOUT_LIST;          /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT;    /* spinlock for scheduler queue */
-int yield_age_index = 0;
+static rlnode timer_wheel[TW_LEVELS][TW_SLOTS];
+static rlnode TIMEOUT_EXPIRED;      /* Expired threads, not yet made ready */
+static TimerDuration tw_now;        /* The first tick not yet expired */
+static unsigned int tw_count;       /* Number of threads in the wheel and TIMEOUT_EXPIRED */
 
+Mutex timeout_spinlock = MUTEX_INIT;    /* spinlock for the timer wheel */
 
-int pr_queue_select(rlnode *ls_head) {
-  int priority = 0;
-  int check;
+/* 
+  A lower bound for the earliest wakeup time in the timer wheel. This is
+  read without locking, so that cores do not touch timeout_spinlock when 
+  nothing has expired.
+ */
+static volatile TimerDuration next_timeout = NO_TIMEOUT;
 
-  while(priority < QUEUE_NUMBER) {
-    check = is_rlist_empty(&ls_head[priority]);  //1 on empty list, else 0
-    if(check) {
-      priority++;
-    } else {
-      return priority;
-    }
-  }
-  return priority;
+
+static void sched_arm_timer(); /* forward */
+
+/* Interrupt handler for ALARM */
+void yield_handler()
+{
+  CURCORE.timer_expiry = 0;
+  yield(SCHED_QUANTUM);
+}
+
+/* 
+  Interrupt handler for inter-core interrupts. An ICI is sent to an idle 
+  core when a thread is queued on it; it only needs to wake the core from 
+  cpu_core_halt(), and the idle thread will then schedule. An ICI is also
+  sent to a busy core whose thread was preempted by a wakeup (see sched_place).
+ */
+void ici_handler()
+{
+  if(CURCORE.preempt_pending)
+    yield(SCHED_PREEMPT);
+  else
+    sched_arm_timer();
 }
 
-void cause_priority_ch(enum SCHED_CAUSE cause, TCB *curr) {
 
-  switch(cause) {
-    case SCHED_QUANTUM:
-      curr->prev_cause = cause;
-      curr->priority += 1;
+/*
+  Place a thread in the slot of the timer wheel that corresponds to its
+  wakeup time, or in TIMEOUT_EXPIRED if that tick has already passed.
 
-    case SCHED_IO:
-      curr->prev_cause = cause;
-      curr->priority -= 1;
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void tw_insert(TCB* tcb)
+{
+  TimerDuration expires = (tcb->wakeup_time + TW_TICK - 1) / TW_TICK;
 
-    case SCHED_MUTEX:
-      if(curr->prev_cause == SCHED_MUTEX && curr->priority != QUEUE_NUMBER-1) {
-        curr->prev_cause = cause;
-        curr->priority -= 1;
-      }
-    default:
-      if(curr->priority > QUEUE_NUMBER-1) {
-        curr->priority = QUEUE_NUMBER-1;
-        curr->prev_cause = cause;
-      }
-      if(curr->priority < SCHEDMAX) {
-        curr->priority = SCHEDMAX;
-        curr->prev_cause = cause;
-      }
+  if(expires < tw_now) {
+    rlist_push_back(& TIMEOUT_EXPIRED, & tcb->sched_node);
+    next_timeout = 0;
+    return;
   }
-}
 
-void anti_age_policy(rlnode *schedArray) {
+  TimerDuration delta = expires - tw_now;
+  int level = 0;
+  while(level < TW_LEVELS-1 && delta >= (1ull << (TW_BITS*(level+1))))
+    level++;
 
-  yield_age_index++;
+  /* Too far in the future: park it in the furthest slot of the top level */
+  if(delta >= (1ull << (TW_BITS*TW_LEVELS)))
+    expires = tw_now + (1ull << (TW_BITS*TW_LEVELS)) - 1;
 
-  if(yield_age_index > YIELD_MAX_AGE) {
-    if(!is_rlist_empty(&schedArray[SCHEDMAX])) {
-      rlist_append(&schedArray[SCHEDMAX], &schedArray[QUEUE_NUMBER-1]);
-    }
-  }
+  uint slot = (expires >> (TW_BITS*level)) & TW_MASK;
+  rlist_push_back(& timer_wheel[level][slot], & tcb->sched_node);
+
+  if(expires*TW_TICK < next_timeout)
+    next_timeout = expires*TW_TICK;
 }
 
 
+/*
+  Re-hash the threads of a slot into the lower levels of the wheel.
 
-/* Interrupt handler for ALARM */
-void yield_handler()
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void tw_cascade(int level)
 {
-  yield(SCHED_QUANTUM);
+  rlnode* slot = & timer_wheel[level][(tw_now >> (TW_BITS*level)) & TW_MASK];
+  rlnode list;
+  rlnode_init(& list, NULL);
+  rlist_append(& list, slot);
+
+  while(! is_rlist_empty(& list))
+    tw_insert(rlist_pop_front(& list)->tcb);
 }
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
+
+/*
+  Advance the wheel up to time @c curtime, moving every due thread onto
+  TIMEOUT_EXPIRED, and recompute next_timeout.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void tw_advance(TimerDuration curtime)
 {
-  /* noop for now... */
+  TimerDuration target = curtime / TW_TICK;
+
+  /* Nothing is pending, just move the wheel forward */
+  if(tw_count == 0 && tw_now <= target)
+    tw_now = target+1;
+
+  for(; tw_now <= target; tw_now++) {
+    /* Cascade the levels that wrap around at this tick */
+    for(int level = 1; level < TW_LEVELS; level++) {
+      if((tw_now & ((1ull << (TW_BITS*level)) - 1)) != 0) break;
+      tw_cascade(level);
+    }
+    rlist_append(& TIMEOUT_EXPIRED, & timer_wheel[0][tw_now & TW_MASK]);
+  }
+
+  /* Find a lower bound for the next expiry */
+  if(! is_rlist_empty(& TIMEOUT_EXPIRED))
+    next_timeout = 0;
+  else if(tw_count == 0)
+    next_timeout = NO_TIMEOUT;
+  else {
+    /* Look for the next non-empty slot of level 0, up to the next cascade */
+    TimerDuration t = tw_now;
+    do {
+      if(! is_rlist_empty(& timer_wheel[0][t & TW_MASK])) break;
+      t++;
+    } while((t & TW_MASK) != 0);
+    next_timeout = t*TW_TICK;
+  }
 }
 
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the scheduler timer wheel.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
@@ -351,104 +661,359 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 
     /* set the wakeup time */
     TimerDuration curtime = bios_clock();
-    tcb->wakeup_time = (timeout==NO_TIMEOUT) ? NO_TIMEOUT : curtime+timeout;
+    tcb->wakeup_time = curtime+timeout;
 
-    /* add to the TIMEOUT_LIST in sorted order */
-    rlnode* n = TIMEOUT_LIST.next;
-    for( ; n!=&TIMEOUT_LIST; n=n->next)
-      /* skip earlier entries */
-      if(tcb->wakeup_time < n->tcb->wakeup_time) break;
-    /* insert before n */
-  rl_splice(n->prev, & tcb->sched_node);
+    Mutex_Lock(& timeout_spinlock);
+    tw_insert(tcb);
+    tw_count++;
+    Mutex_Unlock(& timeout_spinlock);
   }
 }
 
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the ready queue of a core.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static inline void sched_queue_push(CCB* core, TCB* tcb)
 {
-  rlist_push_back(&schedArray[tcb->priority], & tcb->sched_node);
+  active_policy->enqueue(core, tcb);
+  core->ready_count++;
+}
 
 
-  /*
-  if(tcb->priority == SCHEDMAX){
-    rlist_push_back(&schedArray[0], & tcb->sched_node);
-  }else if(tcb->priority == SCHEDMAX-1){
-    rlist_push_back(&schedArray[1], & tcb->sched_node);
-  }else if(tcb->priority == SCHEDMAX-2){
-    rlist_push_back(&schedArray[2], & tcb->sched_node);
-  }else{
-    rlist_push_back(&schedArray[3], & tcb->sched_node);
-  }
-  */
-
-  /* Restart possibly halted cores */
+/* Return 1 if the affinity of the thread allows it to run on the core */
+static inline int sched_allowed(TCB* tcb, CCB* core)
+{
+  return tcb->affinity == 0 || (tcb->affinity & (1u << core->id)) != 0;
+}
+
+
+/* Return 1 if the core is running its idle thread. This is peeked without locking. */
+static inline int core_is_idle(CCB* core)
+{
+  return __atomic_load_n(& core->current_thread, __ATOMIC_RELAXED) == & core->idle_thread;
+}
+
+
+/* The mask of cores 0..n-1 */
+#define CORE_MASK(n)  (((n) < 8*sizeof(uint)) ? (1u << (n)) - 1 : ~0u)
+
+/*
+  Choose the core to queue a thread that becomes ready. In order of 
+  preference, this is
+  - the core that last ran the thread, where its cache is warm,
+  - the current core,
+  - some idle core,
+  - any core
+  among the cores in @c allowed.
+ */
+static CCB* sched_choose(TCB* tcb, uint allowed)
+{
+  uint ncores = cpu_cores();
+  uint last = tcb->last_core;
+  if(last < ncores && (allowed & (1u << last)))
+    return & cctx[last];
+
+  if(allowed & (1u << CURCORE.id)) 
+    return & CURCORE;
+
+  for(uint mask = allowed; mask; mask &= mask-1) {
+    CCB* core = & cctx[__builtin_ctz(mask)];
+    if(core_is_idle(core)) return core;
+  }
+  return & cctx[__builtin_ctz(allowed)];
+}
+
+/*
+  Choose the core to queue a thread that becomes ready (see sched_choose).
+  Only the cores allowed by the affinity of the thread are considered.
+
+  If the chosen core is busy, and the thread outranks the thread running
+  there (or, failing that, on the allowed core running the least urgent 
+  thread), that core is returned and @c *preempt is set.
+ */
+static CCB* sched_place(TCB* tcb, int* preempt)
+{
+  uint ncores = cpu_cores();
+  uint allowed = CORE_MASK(ncores);
+  if(tcb->affinity & allowed) allowed &= tcb->affinity;
+
+  *preempt = 0;
+  CCB* core = sched_choose(tcb, allowed);
+  if(active_policy->rank == NULL || core->current_rank == LONG_MAX) 
+    return core;
+
+  long rank = active_policy->rank(tcb) + active_policy->preempt_gap;
+  if(rank <= core->current_rank) {
+    *preempt = 1;
+    return core;
+  }
+
+  CCB* victim = NULL;
+  for(uint mask = allowed; mask; mask &= mask-1) {
+    CCB* c = & cctx[__builtin_ctz(mask)];
+    if(victim == NULL || c->current_rank > victim->current_rank) victim = c;
+  }
+  if(rank <= victim->current_rank) {
+    /* An idle core runs the thread without preempting anyone */
+    *preempt = (victim->current_rank != LONG_MAX);
+    return victim;
+  }
+  return core;
+}
+
+
+/*
+  Get some core to run a thread that was just queued on @c core. 
+  If @c core is another core and it is idle, or its timer is not armed,
+  it is kicked with an ICI. 
+  If @c preempt is set, the thread running on @c core is preempted.
+  Else, some halted core is restarted, to steal the thread if @c core 
+  is busy.
+ */
+static void sched_kick(CCB* core, int preempt)
+{
+  if(preempt) {
+    core->preempt_pending = 1;
+    core->preempt_count++;
+  }
+
+  if(core != & CURCORE) {
+    /* A busy core without a timer would not notice the thread, until its thread blocks */
+    if(preempt || core_is_idle(core) || core->timer_expiry == 0) {
+      cpu_ici(core->id);
+      return;
+    }
+  }
+  else
+    sched_arm_timer();
+
   cpu_core_restart_one();
 }
 
 
+/*
+  Add TCB to the end of the ready queue of a core, and get some core
+  to run it.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_add(CCB* core, TCB* tcb, int preempt)
+{
+  Mutex_Lock(& core->sched_spinlock);
+  sched_queue_push(core, tcb);
+  Mutex_Unlock(& core->sched_spinlock);
+
+  sched_kick(core, preempt);
+}
+
+
+/*
+  Remove the thread chosen by the policy from a core's ready queue 
+  and return it, or return NULL if the queue is empty.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_pop(CCB* core)
+{
+  TCB* tcb = active_policy->pick_next(core);
+  if(tcb != NULL)
+    core->ready_count--;
+  return tcb;
+}
+
+
 /*
   Adjust the state of a thread to make it READY.
 
-    *** MUST BE CALLED WITH sched_spinlock HELD ***
+    *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
 static void sched_make_ready(TCB* tcb)
 {
   assert(tcb->state == STOPPED || tcb->state == INIT);
 
-  /* Possibly remove from TIMEOUT_LIST */
+  /* Possibly remove from the timer wheel */
   if(tcb->wakeup_time != NO_TIMEOUT) {
-    /* tcb is in TIMEOUT_LIST, fix it */
+    /* tcb is in the timer wheel (or TIMEOUT_EXPIRED), fix it */
+    Mutex_Lock(& timeout_spinlock);
     assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
     rlist_remove(& tcb->sched_node);
+    tw_count--;
     tcb->wakeup_time = NO_TIMEOUT;
+    Mutex_Unlock(& timeout_spinlock);
   }
 
   /* Mark as ready */
+  if(tcb->state == STOPPED && active_policy->on_wakeup)
+    active_policy->on_wakeup(tcb);
   tcb->state = READY;
 
   /* Possibly add to the scheduler queue */
-  if(tcb->phase == CTX_CLEAN)
-    sched_queue_add(tcb);
+  if(tcb->phase == CTX_CLEAN) {
+    int preempt;
+    CCB* core = sched_place(tcb, &preempt);
+    sched_queue_add(core, tcb, preempt);
+  }
 }
 
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Advance the timer wheel up to the current time and wake up every 
+  expired thread. The expired threads placed on the current core are added
+  to its ready queue as a batch, under a single acquisition of its lock.
+  The ones placed on other cores are added while holding it; this cannot
+  deadlock, since only the holder of timeout_spinlock ever holds two
+  sched_spinlocks.
+
+  Here, timeout_spinlock is taken before the state_spinlock of each
+  expired thread, against the lock order. Therefore, we only try to lock
+  the TCB; if this fails, the thread is left for a later call. For the
+  same reason, if another core is already expiring timers, we do not 
+  wait for it.
+ */
+static void sched_wakeup_expired()
+{
+  TimerDuration curtime = bios_clock();
+
+  if(next_timeout > curtime) return;
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  if(! Mutex_TryLock(& timeout_spinlock)) return;
+
+  tw_advance(curtime);
+
+  CCB* core = & CURCORE;
+  int woken = 0;
+  uint remote = 0, preempt_remote = 0;
+
+  Mutex_Lock(& core->sched_spinlock);
+  while(! is_rlist_empty(& TIMEOUT_EXPIRED)) {
+    TCB* tcb = TIMEOUT_EXPIRED.next->tcb;
+    if(! Mutex_TryLock(& tcb->state_spinlock))
+      break;
+
+    rlist_remove(& tcb->sched_node);
+    tw_count--;
+    tcb->wakeup_time = NO_TIMEOUT;
+    if(active_policy->on_wakeup)
+      active_policy->on_wakeup(tcb);
+    tcb->state = READY;
+    if(tcb->phase == CTX_CLEAN) {
+      int preempt;
+      CCB* target = sched_place(tcb, &preempt);
+      if(target == core) {
+        sched_queue_push(core, tcb);
+        woken++;
+      } else {
+        Mutex_Lock(& target->sched_spinlock);
+        sched_queue_push(target, tcb);
+        Mutex_Unlock(& target->sched_spinlock);
+        remote |= 1u << target->id;
+        if(preempt) preempt_remote |= 1u << target->id;
+      }
+    }
+
+    Mutex_Unlock(& tcb->state_spinlock);
+  }
+  Mutex_Unlock(& core->sched_spinlock);
+
+  if(! is_rlist_empty(& TIMEOUT_EXPIRED))
+    next_timeout = 0;
+  Mutex_Unlock(& timeout_spinlock);
+
+  /* The current core is about to schedule, it need not be preempted */
+  for(; remote; remote &= remote-1) {
+    uint c = __builtin_ctz(remote);
+    sched_kick(& cctx[c], (preempt_remote >> c) & 1);
+  }
+
+  /* Restart halted cores to help with the newly ready threads */
+  if(woken > 1)
+    cpu_core_restart_all();
+  else if(woken == 1)
+    cpu_core_restart_one();
+}
+
+
+/*
+  Try to steal a ready thread from the queue of some other core.
+  Cores are visited round-robin, starting from the one after the thief.
+  A thread whose affinity does not allow the thief is put back.
+ */
+static TCB* sched_queue_steal(CCB* thief)
+{
+  uint ncores = cpu_cores();
+
+  for(uint i=1; i<ncores; i++) {
+    CCB* victim = & cctx[(thief->id + i) % ncores];
+
+    /* Unlocked peek, to avoid touching the lock of idle cores */
+    if(victim->ready_count == 0) continue;
+
+    Mutex_Lock(& victim->sched_spinlock);
+    TCB* tcb = sched_queue_pop(victim);
+    if(tcb != NULL && ! sched_allowed(tcb, thief)) {
+      sched_queue_push(victim, tcb);
+      tcb = NULL;
+    }
+    Mutex_Unlock(& victim->sched_spinlock);
+
+    if(tcb != NULL) {
+      thief->steal_count++;
+      return tcb;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+  Return 1 if some core has threads in its ready queue.
+ */
+static int sched_has_ready_threads()
+{
+  uint ncores = cpu_cores();
+  for(uint c=0; c<ncores; c++)
+    if(cctx[c].ready_count > 0) return 1;
+  return 0;
+}
+
+
+/*
+  Select the next thread for the current core, and remove it from its
+  ready queue. Return NULL if no thread is ready on any core.
+
+  Threads in the queue that may not run on this core (because their
+  affinity changed, or they expired here) are moved to an allowed core.
 */
 static TCB* sched_queue_select()
 {
-  int pr = 0;
-  /* Empty the timeout list up to the current time and wake up each thread */
-  TimerDuration curtime = bios_clock();
-  while(! is_rlist_empty(&TIMEOUT_LIST)) {
-      TCB* tcb = TIMEOUT_LIST.next->tcb;
-      if(tcb->wakeup_time > curtime)
-        break;
-      sched_make_ready(tcb);
-  }
+  CCB* core = & CURCORE;
+
+  sched_wakeup_expired();
 
+  TCB* next;
+  while(1) {
+    Mutex_Lock(& core->sched_spinlock);
+    if(active_policy->tick)
+      active_policy->tick(core);
+    next = sched_queue_pop(core);
+    Mutex_Unlock(& core->sched_spinlock);
 
-  pr = pr_queue_select(schedArray);
+    if(next == NULL || sched_allowed(next, core)) break;
 
-  if(pr != -1 && pr<QUEUE_NUMBER) {
-    rlnode * sel = rlist_pop_front(&schedArray[pr]);
-    return sel->tcb;
-  } else {
-    return NULL;
+    int preempt;
+    Mutex_Lock(& next->state_spinlock);
+    CCB* target = sched_place(next, &preempt);
+    sched_queue_add(target, next, preempt);
+    Mutex_Unlock(& next->state_spinlock);
   }
 
-  /* Get the head of the SCHED list */
-  //rlnode * sel = rlist_pop_front(& SCHED);
+  if(next == NULL)
+    next = sched_queue_steal(core);
 
-  //return sel->tcb;  /* When the list is empty, this is NULL */
+  return next;
 }
 
 
@@ -463,15 +1028,14 @@ int wakeup(TCB* tcb)
   int oldpre = preempt_off;
 
   /* To touch tcb->state, we must get the spinlock. */
-  Mutex_Lock(& sched_spinlock);
+  Mutex_Lock(& tcb->state_spinlock);
 
   if(tcb->state==STOPPED || tcb->state==INIT) {
     sched_make_ready(tcb);
     ret = 1;
   }
 
-
-  Mutex_Unlock(& sched_spinlock);
+  Mutex_Unlock(& tcb->state_spinlock);
 
   /* Restore preemption state */
   if(oldpre) preempt_on;
@@ -495,7 +1059,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
     domain.
    */
   int preempt = preempt_off;
-  Mutex_Lock(& sched_spinlock);
+  Mutex_Lock(& tcb->state_spinlock);
 
   /* mark the thread as stopped or exited */
   tcb->state = state;
@@ -507,8 +1071,8 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
   /* Release mx */
   if(mx!=NULL) Mutex_Unlock(mx);
 
-  /* Release the schduler spinlock before calling yield() !!! */
-  Mutex_Unlock(& sched_spinlock);
+  /* Release the state spinlock before calling yield() !!! */
+  Mutex_Unlock(& tcb->state_spinlock);
 
   /* call this to schedule someone else */
   yield(cause);
@@ -522,9 +1086,6 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause, Time
 
 void yield(enum SCHED_CAUSE cause)
 {
-  /* Reset the timer, so that we are not interrupted by ALARM */
-  bios_cancel_timer();
-
   /* We must stop preemption but save it! */
   int preempt = preempt_off;
 
@@ -532,7 +1093,7 @@ void yield(enum SCHED_CAUSE cause)
 
   int current_ready = 0;
 
-  Mutex_Lock(& sched_spinlock);
+  Mutex_Lock(& current->state_spinlock);
   switch(current->state)
   {
     case RUNNING:
@@ -550,10 +1111,11 @@ void yield(enum SCHED_CAUSE cause)
       assert(0);  /* It should not be READY or EXITED ! */
   }
 
+  current->cpu_time += bios_clock() - current->last_run;
+  if(active_policy->on_yield)
+    active_policy->on_yield(current, cause);
+  Mutex_Unlock(& current->state_spinlock);
 
-
-  cause_priority_ch(cause, current);
-  anti_age_policy(schedArray);
   /* Get next */
   TCB* next = sched_queue_select();
 
@@ -569,8 +1131,6 @@ void yield(enum SCHED_CAUSE cause)
   current->next = next;
   next->prev = current;
 
-  Mutex_Unlock(& sched_spinlock);
-
   /* Switch contexts */
   if(current!=next) {
     CURTHREAD = next;
@@ -598,40 +1158,65 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-  Mutex_Lock(& sched_spinlock);
-
   /* Mark current state */
   TCB* current = CURTHREAD;
   TCB* prev = current->prev;
 
+  Mutex_Lock(& current->state_spinlock);
   current->state = RUNNING;
   current->phase = CTX_DIRTY;
+  current->last_run = bios_clock();
+  current->last_core = CURCORE.id;
+  Mutex_Unlock(& current->state_spinlock);
+
+  /* Publish the rank of the new thread, for preemption by wakeups */
+  CURCORE.current_rank = (current->type == IDLE_THREAD || active_policy->rank == NULL)
+    ? LONG_MAX : active_policy->rank(current);
+  CURCORE.preempt_pending = 0;
 
   if(current != prev) {
     /* Take care of the previous thread */
+    Mutex_Lock(& prev->state_spinlock);
     prev->phase = CTX_CLEAN;
     switch(prev->state)
     {
       case READY:
-        if(prev->type != IDLE_THREAD) sched_queue_add(prev);
+        if(prev->type != IDLE_THREAD) {
+          int preempt = 0;
+          CCB* core = sched_allowed(prev, & CURCORE) ? & CURCORE : sched_place(prev, &preempt);
+          sched_queue_add(core, prev, preempt);
+        }
         break;
       case EXITED:
         release_TCB(prev);
+        prev = NULL;  /* the TCB and its spinlock are gone */
         break;
       case STOPPED:
         break;
       default:
         assert(0);  /* prev->state should not be INIT or RUNNING ! */
     }
+    if(prev != NULL)
+      Mutex_Unlock(& prev->state_spinlock);
   }
 
-  Mutex_Unlock(& sched_spinlock);
+  /* Set a 1-quantum alarm, if needed */
+  sched_arm_timer();
 
   /* Reset preemption as needed */
   if(preempt) preempt_on;
+}
+
+
+void sched_preempt()
+{
+  int preempt = preempt_off;
+  int pending = CURCORE.preempt_pending;
+  CURCORE.preempt_pending = 0;
+  if(preempt) preempt_on;
 
-  /* Set a 1-quantum alarm */
-  bios_set_timer(QUANTUM);
+  if(pending && preempt)
+    yield(SCHED_PREEMPT);
 }
 
 
@@ -642,28 +1227,150 @@ static void idle_thread()
 
   /* We come here whenever we cannot find a ready thread for our core */
   while(active_threads>0) {
-    cpu_core_halt();
+    /* 
+      Only halt if there is no work to steal from other cores. Interrupts
+      are off between the check and the halt, so that an ICI sent after
+      the check is not lost (it cancels the halt).
+     */
+    int preempt = preempt_off;
+    if(! sched_has_ready_threads())
+      cpu_core_halt();
+    if(preempt) preempt_on;
     yield(SCHED_IDLE);
   }
 
   /* If the idle thread exits here, we are leaving the scheduler! */
   bios_cancel_timer();
+  CURCORE.timer_expiry = 0;
   cpu_core_restart_all();
 }
 
 
 /*
-  Initialize the scheduler queue
+  The core timer.
+
+  The timer is only needed when something may preempt the thread running
+  on the core: other threads in the ready queue of the core (the timer 
+  ends the quantum), or a timeout in the timer wheel (the timer expires 
+  with it). When neither exists, and in particular when the core is idle,
+  the timer is not armed and the core is tickless. 
+
+  Also, the timer is re-armed lazily: if it is already armed to expire
+  within TIMER_SLACK of the wanted time, it is kept. A timer that is armed
+  but no longer needed is left to expire once, rather than cancelled.
+  Either way, a call to bios_set_timer() is avoided.
+
+  The timer is armed for the thread running on the current core, at the
+  start of its timeslice (gain) and when a thread is queued on the core
+  (sched_kick).
+ */
+#define TIMER_SLACK (QUANTUM/4)
+
+static void sched_arm_timer()
+{
+  CCB* core = & CURCORE;
+
+  /* Threads may be created at boot, before the core runs the scheduler */
+  if(core->current_thread == NULL) return;
+
+  TimerDuration now = bios_clock();
+  TimerDuration wanted = NO_TIMEOUT;
+
+  if(core->ready_count > 0 && CURTHREAD->type != IDLE_THREAD)
+    wanted = now + QUANTUM;
+
+  TimerDuration timeout = next_timeout;
+  if(timeout != NO_TIMEOUT) {
+    if(timeout < now + TW_TICK) timeout = now + TW_TICK;
+    if(timeout < wanted) wanted = timeout;
+  }
+
+  TimerDuration expiry = core->timer_expiry;
+  if(wanted == NO_TIMEOUT || 
+      (expiry != 0 && expiry + TIMER_SLACK >= wanted && expiry <= wanted + TIMER_SLACK)) {
+    core->timer_skips++;
+    return;
+  }
+
+  int preempt = preempt_off;
+  core->timer_expiry = wanted;
+  core->timer_arms++;
+  bios_set_timer(wanted - now);
+  if(preempt) preempt_on;
+}
+
+
+/*
+  Initialize the scheduler queues
  */
 void initialize_scheduler()
 {
-  int i;
+  for(uint c=0; c<MAX_CORES; c++) {
+    CCB* core = & cctx[c];
+    core->id = c;
+    core->sched_spinlock = MUTEX_INIT;
+    for(int i=0;i<QUEUE_NUMBER;i++)
+      rlnode_init(& core->ready_queue[i], NULL);
+    core->ready_mask = 0;
+    core->ready_count = 0;
+    core->yield_age = 0;
+    core->steal_count = 0;
+    core->current_rank = LONG_MAX;
+    core->preempt_pending = 0;
+    core->preempt_count = 0;
+    core->current_thread = NULL;
+    core->timer_expiry = 0;
+    core->timer_arms = 0;
+    core->timer_skips = 0;
+    for(int cls=0; cls<STACK_CLASSES; cls++)
+      core->thread_cache_count[cls] = 0;
+    core->thread_reuse = 0;
+    active_policy->init(core);
+  }
+
+  for(int l=0; l<TW_LEVELS; l++)
+    for(uint i=0; i<TW_SLOTS; i++)
+      rlnode_init(& timer_wheel[l][i], NULL);
+  rlnode_init(& TIMEOUT_EXPIRED, NULL);
+  tw_now = bios_clock() / TW_TICK;
+  tw_count = 0;
+  next_timeout = NO_TIMEOUT;
+
+  for(int cls=0; cls<STACK_CLASSES; cls++) {
+    thread_depot[cls] = NULL;
+    thread_depot_count[cls] = 0;
+  }
+  pool_stats = (thread_pool_stats){ .limit = thread_pool_limit };
+}
+
+
+void finalize_scheduler()
+{
+  for(int cls=0; cls<STACK_CLASSES; cls++) {
+    for(uint c=0; c<MAX_CORES; c++) {
+      CCB* core = & cctx[c];
+      while(core->thread_cache_count[cls] > 0) {
+        free_thread(core->thread_cache[cls][--core->thread_cache_count[cls]], THREAD_SIZE(cls));
+        pool_stats.released++;
+      }
+    }
 
-  for(i=0;i<QUEUE_NUMBER;i++){
-      rlnode_init(&schedArray[i], NULL);
+    while(thread_depot[cls] != NULL) {
+      thread_block* next = thread_depot[cls]->next;
+      free_thread(thread_depot[cls], THREAD_SIZE(cls));
+      pool_stats.released++;
+      thread_depot[cls] = next;
+    }
+    thread_depot_count[cls] = 0;
   }
+}
 
-  rlnode_init(&TIMEOUT_LIST, NULL);
+
+void get_thread_pool_stats(thread_pool_stats* stats)
+{
+  *stats = pool_stats;
+  for(uint c=0; c<MAX_CORES; c++)
+    stats->reused += cctx[c].thread_reuse;
 }
 
 void run_scheduler()
@@ -681,6 +1388,7 @@ void run_scheduler()
   curcore->idle_thread.phase = CTX_DIRTY;
   //curcore->idle_thread.prev_cause =  SCHED_OTHER;
   curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+  curcore->idle_thread.state_spinlock = MUTEX_INIT;
   rlnode_init(& curcore->idle_thread.sched_node, & curcore->idle_thread);
 
   /* Initialize interrupt handler */
@@ -76,6 +76,7 @@ enum SCHED_CAUSE {
   SCHED_IDLE,     /**< The idle thread called yield */
   SCHED_USER,     /**< User-space code called yield */
 	SCHED_JOIN,
+  SCHED_PREEMPT,  /**< A more urgent thread was woken up */
   SCHED_OTHER
 };
 
@@ -85,6 +86,7 @@ enum SCHED_CAUSE {
 typedef struct process_thread_control_block
 {
   TCB* tcb;
+  Tid_t tid;            /**< The handle of the thread in its process */
   Task task;
   int argl;
   void* args;
@@ -120,6 +122,7 @@ typedef struct thread_control_block
   Thread_type type;       /**< The type of thread */
   Thread_state state;    /**< The state of the thread */
   Thread_phase phase;    /**< The phase of the thread */
+  Mutex state_spinlock;  /**< Protects @c state, @c phase and @c wakeup_time */
   
   int priority;
 
@@ -128,6 +131,19 @@ typedef struct thread_control_block
   void (*thread_func)();   /**< The function executed by this thread */
 
   TimerDuration wakeup_time; /**< The time this thread will be woken up by the scheduler */
+  TimerDuration last_run;    /**< The time this thread last started running (see @c gain) */
+  TimerDuration cpu_time;    /**< The total time this thread has been running */
+
+  uint last_core;            /**< The core that last ran this thread, or @c NO_CORE */
+  uint affinity;             /**< Bit c is set iff the thread may run on core c; 0 for any core */
+
+  stack_class stack_class;   /**< The stack class, which gives the stack size */
+
+  int nice;                  /**< The nice value, from @c NICE_MIN to @c NICE_MAX */
+  TimerDuration vruntime;    /**< Weighted running time, for the "cfs" policy */
+  struct thread_control_block * cfs_child;    /**< First child in the "cfs" ready heap */
+  struct thread_control_block * cfs_sibling;  /**< Next sibling in the "cfs" ready heap */
+
   rlnode sched_node;      /**< node to use when queueing in the scheduler lists */
   
   struct thread_control_block * prev;  /**< previous context */
@@ -139,10 +155,38 @@ typedef struct thread_control_block
 
 
 
-/** Thread stack size */
+/** @brief A @c last_core value for a thread that has not run yet */
+#define NO_CORE ((uint)-1)
+
+/** Thread stack size, for @c STACK_DEFAULT */
 #define THREAD_STACK_SIZE  (128*1024)
+
+/** @brief The stack size of each stack class */
+extern const size_t thread_stack_size[STACK_CLASSES];
 #define SCHEDMAX 0
+
+/**
+  @brief Number of priority levels of the ready queue.
+
+  This can be set at compile time (e.g., `make QUEUE_NUMBER=32`), up to 64 
+  levels, which is the width of @c CCB.ready_mask.
+ */
+#ifndef QUEUE_NUMBER
 #define QUEUE_NUMBER 4
+#endif
+
+#if QUEUE_NUMBER < 1 || QUEUE_NUMBER > 64
+#error "QUEUE_NUMBER must be between 1 and 64"
+#endif
+
+/** @brief Number of recycled thread blocks kept by each core (see @c spawn_thread) */
+#define THREAD_CACHE_SIZE 16
+
+/** @brief The default high-water mark of the thread depot (see @c boot_thread_pool) */
+#define THREAD_POOL_LIMIT 64
+
+/** @brief The high-water mark of the thread depot for this boot */
+extern unsigned int thread_pool_limit;
 
 /************************
  *
@@ -162,6 +206,27 @@ typedef struct core_control_block {
   TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
   sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
+  Mutex sched_spinlock;       /**< Protects the core's ready queue */
+  rlnode ready_queue[QUEUE_NUMBER];  /**< The core's multi-level ready queue */
+  TCB* cfs_queue;             /**< The core's ready heap, for the "cfs" policy */
+  uint64_t ready_mask;        /**< Bit i is set iff @c ready_queue[i] is non-empty */
+  volatile uint ready_count;  /**< Threads in @c ready_queue, peeked unlocked by idle cores */
+  uint yield_age;             /**< Yield counter for the anti-aging policy */
+  unsigned long steal_count;  /**< Threads this core has stolen from other cores */
+
+  volatile long current_rank;        /**< The rank of @c current_thread (see @c sched_policy.rank), 
+                                          or LONG_MAX if the core is idle */
+  volatile int preempt_pending;      /**< Set when a more urgent thread was queued by this core */
+  unsigned long preempt_count;       /**< Wakeups that preempted the thread running on this core */
+
+  TimerDuration timer_expiry;   /**< When the core timer expires, or 0 if it is not armed */
+  unsigned long timer_arms;     /**< Calls to bios_set_timer() by the scheduler */
+  unsigned long timer_skips;    /**< Calls to bios_set_timer() avoided, by not arming or keeping the timer */
+
+  void* thread_cache[STACK_CLASSES][THREAD_CACHE_SIZE];  /**< Recycled thread blocks per stack class, used with interrupts off */
+  uint thread_cache_count[STACK_CLASSES];                /**< Blocks in @c thread_cache */
+  unsigned long thread_reuse;   /**< Threads spawned on this core from a recycled block */
+
 } CCB;
 
 
@@ -169,6 +234,72 @@ typedef struct core_control_block {
 extern CCB cctx[MAX_CORES];
 
 
+/** @brief A scheduling policy.
+
+  The scheduler core (context switching, sleeping, timeouts and work 
+  stealing) delegates every scheduling decision to the operations of 
+  a policy. The policy is selected when the kernel boots, see 
+  @c boot_sched_policy().
+
+  All operations are called with preemption off. The operations on
+  a core's ready queue are called with @c core->sched_spinlock held, and
+  the operations on a thread with @c tcb->state_spinlock held.
+  Operations @c on_yield, @c on_wakeup and @c tick may be NULL.
+ */
+typedef struct sched_policy {
+  const char* name;       /**< The name used to select the policy */
+
+  /** @brief Initialize the policy state of a core, at boot. */
+  void (*init)(CCB* core);
+
+  /** @brief Add a READY thread to the ready queue of a core. */
+  void (*enqueue)(CCB* core, TCB* tcb);
+
+  /** @brief Remove and return the next thread to run on a core, or NULL. */
+  TCB* (*pick_next)(CCB* core);
+
+  /** @brief Account for the current thread leaving the core, for the given cause. */
+  void (*on_yield)(TCB* tcb, enum SCHED_CAUSE cause);
+
+  /** @brief Account for a blocked thread becoming READY. */
+  void (*on_wakeup)(TCB* tcb);
+
+  /** @brief Called at every scheduling decision of a core, before @c pick_next. */
+  void (*tick)(CCB* core);
+
+  /** @brief The urgency of a thread, smaller is more urgent. 
+
+    A thread that wakes up preempts a running thread whose rank is larger 
+    by at least @c preempt_gap. If NULL, wakeups never preempt.
+   */
+  long (*rank)(TCB* tcb);
+  long preempt_gap;       /**< See @c rank */
+} sched_policy;
+
+
+/** @brief The multi-level feedback queue policy (the default, "mlfq"). */
+extern const sched_policy mlfq_policy;
+
+/** @brief The round-robin policy ("rr"), a single FIFO queue. */
+extern const sched_policy rr_policy;
+
+/** @brief The fair-share policy ("fair"), which shares the CPU among processes. */
+extern const sched_policy fair_policy;
+
+/** @brief The virtual-runtime policy ("cfs"), which shares the CPU among threads by nice weight. */
+extern const sched_policy cfs_policy;
+
+/** @brief The scheduling policy of the running kernel. */
+extern const sched_policy* active_policy;
+
+/**
+  @brief Find a scheduling policy by name.
+
+  @returns the policy, or NULL if there is no policy with this name.
+ */
+const sched_policy* find_sched_policy(const char* name);
+
+
 /** @brief The current core's CCB */
 #define CURCORE  (cctx[cpu_core_id])
 
@@ -179,6 +310,24 @@ extern CCB cctx[MAX_CORES];
 */
 TCB* cur_thread();
 
+
+/** @brief Yield to a more urgent thread, if one was woken up by this core. */
+void sched_preempt();
+
+/**
+  @brief A preemption point.
+
+  A wakeup does not preempt the thread that performs it immediately, 
+  since that thread may hold locks the woken thread needs. Instead, 
+  the thread yields at the next preemption point: at the end of each 
+  system call, and when it unlocks a Mutex with preemption on.
+ */
+static inline void preempt_point()
+{
+  if(CURCORE.preempt_pending && cpu_interrupts_enabled())
+    sched_preempt();
+}
+
 /**
   @brief The current thread.
 
@@ -198,13 +347,24 @@ TCB* cur_thread();
   @brief Create a new thread.
 
   This call creates a new thread, initializing and returning its TCB.
-  The thread will belong to process @c pcb and execute @c func.
+  The thread will belong to process @c pcb and execute @c func,
+  on a stack of class @c cls.
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
 */
-TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)(), stack_class cls);
+
+/**
+  @brief Return the bytes of the stack of a thread that are resident in memory.
+ */
+size_t thread_stack_rss(TCB* tcb);
 
-PTCB* initialize_ptcb(PCB* proc, Task task, int argl, void* args, void (*func)());
+PTCB* initialize_ptcb(PCB* proc, Task task, int argl, void* args, void (*func)(), stack_class cls);
+
+/**
+  @brief Free a PTCB that has been removed from the thread list of its process.
+ */
+void release_ptcb(PTCB* ptcb);
 
 /**
   @brief Wakeup a blocked thread.
@@ -276,6 +436,29 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Finalize the scheduler.
+
+  This function is called after all cores have left the scheduler. It 
+  returns the recycled thread blocks to the system.
+ */
+void finalize_scheduler(void);
+
+
+/** @brief Statistics of the thread pool. */
+typedef struct thread_pool_stats {
+  unsigned long reused;       /**< Threads spawned from a recycled block */
+  unsigned long allocated;    /**< Blocks allocated from the system */
+  unsigned long released;     /**< Blocks returned to the system */
+  unsigned int depot_peak;    /**< The largest number of blocks held by the depot */
+  unsigned int limit;         /**< The high-water mark of the depot */
+} thread_pool_stats;
+
+/**
+  @brief Get the statistics of the thread pool, for the current or last boot.
+ */
+void get_thread_pool_stats(thread_pool_stats* stats);
+
 
 /**
   @brief Quantum (in microseconds)
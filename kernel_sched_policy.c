@@ -0,0 +1,412 @@
+
+#include <assert.h>
+#include <string.h>
+
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+#include "kernel_cc.h"
+
+
+/**
+	@file kernel_sched_policy.c
+
+	@brief The scheduling policies.
+
+	The scheduler core in kernel_sched.c calls the operations of the
+	@c active_policy to queue threads and to adjust their priorities.
+	The level-based policies share the multi-level ready queue of the CCB:
+	a thread is queued at level @c tcb->priority, and the highest non-empty
+	level (the lowest index) is served first. The "cfs" policy keeps its
+	own ready heap in the CCB.
+  */
+
+
+/*
+	Multi-level queue helpers, shared by the level-based policies.
+
+	*** MUST BE CALLED WITH core->sched_spinlock HELD ***
+ */
+static void level_queue_push(CCB* core, TCB* tcb, int level)
+{
+  rlist_push_back(& core->ready_queue[level], & tcb->sched_node);
+  core->ready_mask |= 1ull << level;
+}
+
+static TCB* level_queue_pop(CCB* core)
+{
+  if(core->ready_mask == 0) return NULL;
+
+  int level = __builtin_ctzll(core->ready_mask);
+  rlnode* sel = rlist_pop_front(& core->ready_queue[level]);
+  if(is_rlist_empty(& core->ready_queue[level]))
+    core->ready_mask &= ~(1ull << level);
+  return sel->tcb;
+}
+
+static void level_queue_init(CCB* core)
+{
+  core->yield_age = 0;
+}
+
+static void level_queue_enqueue(CCB* core, TCB* tcb)
+{
+  level_queue_push(core, tcb, tcb->priority);
+}
+
+/* A thread preempts threads of a lower level */
+static long level_rank(TCB* tcb)
+{
+  return tcb->priority;
+}
+
+
+/*
+	Anti-aging: every YIELD_MAX_AGE scheduling decisions, the threads of
+	the lowest level are moved to the highest one, so that they do not
+	starve.
+
+	*** MUST BE CALLED WITH core->sched_spinlock HELD ***
+ */
+#define YIELD_MAX_AGE 1000
+
+static void anti_age_policy(CCB* core)
+{
+  core->yield_age++;
+
+  if(core->yield_age > YIELD_MAX_AGE) {
+    if(!is_rlist_empty(&core->ready_queue[SCHEDMAX])) {
+      rlist_append(&core->ready_queue[SCHEDMAX], &core->ready_queue[QUEUE_NUMBER-1]);
+      if(QUEUE_NUMBER-1 != SCHEDMAX)
+        core->ready_mask &= ~(1ull << (QUEUE_NUMBER-1));
+    }
+  }
+}
+
+
+/*
+ *
+ * Multi-level feedback queue
+ *
+ */
+
+/*
+  A thread whose quantum expired sinks one level, and a thread that slept
+  for I/O rises one level. So I/O-bound threads rank above CPU-bound ones,
+  and preempt them when they wake up. 
+
+  A thread that yields on a contended mutex keeps its level: raising it
+  would let it spin ahead of a demoted holder of the mutex.
+ */
+static void cause_priority_ch(TCB *curr, enum SCHED_CAUSE cause)
+{
+  switch(cause) {
+    case SCHED_QUANTUM:
+      curr->priority += 1;
+      break;
+
+    case SCHED_IO:
+      curr->priority -= 1;
+      break;
+
+    default:
+      break;
+  }
+  curr->prev_cause = cause;
+
+  if(curr->priority > QUEUE_NUMBER-1)
+    curr->priority = QUEUE_NUMBER-1;
+  if(curr->priority < SCHEDMAX)
+    curr->priority = SCHEDMAX;
+}
+
+/*
+  Priority boost: every YIELD_MAX_AGE scheduling decisions, all ready 
+  threads are moved to the highest level. Demoted threads cannot starve,
+  even when they hold a mutex that threads of higher levels spin on.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+ */
+static void mlfq_boost(CCB* core)
+{
+  if(++core->yield_age <= YIELD_MAX_AGE) return;
+  core->yield_age = 0;
+
+  for(int level = SCHEDMAX+1; level < QUEUE_NUMBER; level++) {
+    rlnode* q = & core->ready_queue[level];
+    for(rlnode* p = q->next; p != q; p = p->next)
+      p->tcb->priority = SCHEDMAX;
+    rlist_append(& core->ready_queue[SCHEDMAX], q);
+  }
+  core->ready_mask = is_rlist_empty(& core->ready_queue[SCHEDMAX]) ? 0 : (1ull << SCHEDMAX);
+}
+
+const sched_policy mlfq_policy = {
+  .name = "mlfq",
+  .init = level_queue_init,
+  .enqueue = level_queue_enqueue,
+  .pick_next = level_queue_pop,
+  .on_yield = cause_priority_ch,
+  .on_wakeup = NULL,
+  .tick = mlfq_boost,
+  .rank = level_rank,
+  .preempt_gap = 1
+};
+
+
+/*
+ *
+ * Round-robin
+ *
+ */
+
+static void rr_enqueue(CCB* core, TCB* tcb)
+{
+  level_queue_push(core, tcb, SCHEDMAX);
+}
+
+const sched_policy rr_policy = {
+  .name = "rr",
+  .init = level_queue_init,
+  .enqueue = rr_enqueue,
+  .pick_next = level_queue_pop,
+  .on_yield = NULL,
+  .on_wakeup = NULL,
+  .tick = NULL,
+  .rank = NULL
+};
+
+
+/*
+ *
+ * Fair share
+ *
+ */
+
+/*
+  Each process is charged for the CPU time of its threads. The charge
+  is halved every FAIR_DECAY usec, and the threads of a process are queued
+  at level log2(usage/QUANTUM + 1), so processes that used little CPU time
+  recently are served first.
+
+  The usage of a process is updated by all cores that run its threads,
+  without a lock. The updates use relaxed atomics; a lost update only
+  makes the charge slightly inaccurate.
+ */
+#define FAIR_DECAY (10*QUANTUM)
+
+static TimerDuration fair_usage(PCB* pcb, TimerDuration now)
+{
+  TimerDuration stamp = __atomic_load_n(& pcb->sched_usage_stamp, __ATOMIC_RELAXED);
+  TimerDuration usage = __atomic_load_n(& pcb->sched_usage, __ATOMIC_RELAXED);
+
+  if(now > stamp && now - stamp >= FAIR_DECAY) {
+    TimerDuration periods = (now - stamp) / FAIR_DECAY;
+    if(__atomic_compare_exchange_n(& pcb->sched_usage_stamp, &stamp,
+          stamp + periods*FAIR_DECAY, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      usage = (periods >= 64) ? 0 : (usage >> periods);
+      __atomic_store_n(& pcb->sched_usage, usage, __ATOMIC_RELAXED);
+    }
+  }
+  return usage;
+}
+
+static int fair_level(TimerDuration usage)
+{
+  TimerDuration quanta = usage / QUANTUM + 1;
+  int level = 63 - __builtin_clzll(quanta);
+  return (level > QUEUE_NUMBER-1) ? QUEUE_NUMBER-1 : level;
+}
+
+static void fair_on_yield(TCB* tcb, enum SCHED_CAUSE cause)
+{
+  if(tcb->type == IDLE_THREAD) return;
+
+  PCB* pcb = tcb->owner_pcb;
+  TimerDuration now = bios_clock();
+  fair_usage(pcb, now);
+  if(now > tcb->last_run)
+    __atomic_fetch_add(& pcb->sched_usage, now - tcb->last_run, __ATOMIC_RELAXED);
+  tcb->priority = fair_level(__atomic_load_n(& pcb->sched_usage, __ATOMIC_RELAXED));
+  tcb->prev_cause = cause;
+}
+
+static void fair_on_wakeup(TCB* tcb)
+{
+  tcb->priority = fair_level(fair_usage(tcb->owner_pcb, bios_clock()));
+}
+
+const sched_policy fair_policy = {
+  .name = "fair",
+  .init = level_queue_init,
+  .enqueue = level_queue_enqueue,
+  .pick_next = level_queue_pop,
+  .on_yield = fair_on_yield,
+  .on_wakeup = fair_on_wakeup,
+  .tick = anti_age_policy,
+  .rank = level_rank,
+  .preempt_gap = 1
+};
+
+
+/*
+ *
+ * Virtual runtime (cfs)
+ *
+ */
+
+/*
+  Every thread accumulates a virtual runtime: its running time, scaled
+  by NICE_0_WEIGHT/weight, where the weight is given by its nice value.
+  Each core keeps its ready threads in a pairing heap ordered by
+  virtual runtime, and always runs the thread with the smallest one.
+  Thus, over time, runnable threads receive CPU time in proportion to
+  their weights, without priority levels or anti-aging.
+
+  A thread that has slept (or is new, or comes from another core) is
+  placed no further than CFS_SLEEPER_CREDIT behind cfs_min_vruntime, the
+  virtual runtime of the threads recently picked. This keeps sleepers
+  from monopolizing the core when they wake up.
+ */
+#define NICE_0_WEIGHT 1024
+#define CFS_SLEEPER_CREDIT (QUANTUM/2)
+
+/* A waking thread must be this far behind a running one to preempt it */
+#define CFS_WAKEUP_GAP (QUANTUM/10)
+
+/* The weights for nice values NICE_MIN..NICE_MAX, each step is about 1.25x */
+static const unsigned int nice_to_weight[NICE_MAX-NICE_MIN+1] = {
+  88761, 71755, 56483, 46273, 36291,
+  29154, 23254, 18705, 14949, 11916,
+  9548, 7620, 6100, 4904, 3906,
+  3121, 2501, 1991, 1586, 1277,
+  1024, 820, 655, 526, 423,
+  335, 272, 215, 172, 137,
+  110, 87, 70, 56, 45,
+  36, 29, 23, 18, 15
+};
+
+/* Shared by all cores, it only increases. Updated with relaxed atomics. */
+static TimerDuration cfs_min_vruntime;
+
+static TCB* cfs_meld(TCB* a, TCB* b)
+{
+  if(a == NULL) return b;
+  if(b == NULL) return a;
+  if(b->vruntime < a->vruntime) { TCB* t = a; a = b; b = t; }
+  b->cfs_sibling = a->cfs_child;
+  a->cfs_child = b;
+  return a;
+}
+
+/* The two-pass merge of the children of a removed heap root */
+static TCB* cfs_merge_pairs(TCB* first)
+{
+  TCB* pairs = NULL;
+  while(first != NULL) {
+    TCB* a = first;
+    TCB* b = a->cfs_sibling;
+    if(b == NULL) {
+      a->cfs_sibling = pairs;
+      pairs = a;
+      break;
+    }
+    first = b->cfs_sibling;
+    a->cfs_sibling = b->cfs_sibling = NULL;
+    TCB* m = cfs_meld(a, b);
+    m->cfs_sibling = pairs;
+    pairs = m;
+  }
+
+  TCB* root = NULL;
+  while(pairs != NULL) {
+    TCB* next = pairs->cfs_sibling;
+    pairs->cfs_sibling = NULL;
+    root = cfs_meld(root, pairs);
+    pairs = next;
+  }
+  return root;
+}
+
+static void cfs_init(CCB* core)
+{
+  core->cfs_queue = NULL;
+  cfs_min_vruntime = 0;
+}
+
+/* The virtual runtime of a thread that is (re)queued */
+static TimerDuration cfs_placed_vruntime(TCB* tcb)
+{
+  TimerDuration min = __atomic_load_n(& cfs_min_vruntime, __ATOMIC_RELAXED);
+  if(min > CFS_SLEEPER_CREDIT && tcb->vruntime < min - CFS_SLEEPER_CREDIT)
+    return min - CFS_SLEEPER_CREDIT;
+  return tcb->vruntime;
+}
+
+static void cfs_enqueue(CCB* core, TCB* tcb)
+{
+  tcb->vruntime = cfs_placed_vruntime(tcb);
+
+  tcb->cfs_child = tcb->cfs_sibling = NULL;
+  core->cfs_queue = cfs_meld(core->cfs_queue, tcb);
+}
+
+static TCB* cfs_pick_next(CCB* core)
+{
+  TCB* tcb = core->cfs_queue;
+  if(tcb == NULL) return NULL;
+  core->cfs_queue = cfs_merge_pairs(tcb->cfs_child);
+
+  TimerDuration min = __atomic_load_n(& cfs_min_vruntime, __ATOMIC_RELAXED);
+  if(tcb->vruntime > min)
+    __atomic_store_n(& cfs_min_vruntime, tcb->vruntime, __ATOMIC_RELAXED);
+  return tcb;
+}
+
+static void cfs_on_yield(TCB* tcb, enum SCHED_CAUSE cause)
+{
+  if(tcb->type == IDLE_THREAD) return;
+
+  TimerDuration now = bios_clock();
+  if(now > tcb->last_run)
+    tcb->vruntime += (now - tcb->last_run) * NICE_0_WEIGHT / nice_to_weight[tcb->nice - NICE_MIN];
+  tcb->prev_cause = cause;
+}
+
+static long cfs_rank(TCB* tcb)
+{
+  return (long) cfs_placed_vruntime(tcb);
+}
+
+const sched_policy cfs_policy = {
+  .name = "cfs",
+  .init = cfs_init,
+  .enqueue = cfs_enqueue,
+  .pick_next = cfs_pick_next,
+  .on_yield = cfs_on_yield,
+  .on_wakeup = NULL,
+  .tick = NULL,
+  .rank = cfs_rank,
+  .preempt_gap = CFS_WAKEUP_GAP
+};
+
+
+
+/*
+ *
+ * Policy selection
+ *
+ */
+
+static const sched_policy* const sched_policies[] = {
+  & mlfq_policy, & rr_policy, & fair_policy, & cfs_policy, NULL
+};
+
+const sched_policy* active_policy = & mlfq_policy;
+
+const sched_policy* find_sched_policy(const char* name)
+{
+  for(const sched_policy* const * p = sched_policies; *p != NULL; p++)
+    if(strcmp((*p)->name, name) == 0) return *p;
+  return NULL;
+}
+
@@ -0,0 +1,213 @@
+
+#include <stddef.h>
+#include "kernel_slab.h"
+#include "kernel_cc.h"
+#include "util.h"
+
+
+/*
+  The object caches.
+
+  A slab is a block of memory from the system, holding a header and
+  KMEM_SLAB_OBJECTS objects. Each object is followed by a link word, which
+  chains it in the depot while it is free, so that the depot does not
+  disturb the constructed state of the object.
+
+  The caches that have been used in the current boot are kept in a list,
+  so that their slabs can be released by finalize_kmem(), and their
+  statistics reported.
+ */
+#define KMEM_ALIGN _Alignof(max_align_t)
+#define KMEM_ROUND(n, a) (((n) + (a) - 1) / (a) * (a))
+
+typedef struct kmem_slab { struct kmem_slab* next; } kmem_slab;
+
+#define KMEM_SLAB_HEADER KMEM_ROUND(sizeof(kmem_slab), KMEM_ALIGN)
+
+/* The offset of the link word of an object */
+static inline size_t kmem_link_offset(kmem_cache* cache)
+{
+  return KMEM_ROUND(cache->size, sizeof(void*));
+}
+
+/* The distance between consecutive objects of a slab */
+static inline size_t kmem_stride(kmem_cache* cache)
+{
+  return KMEM_ROUND(kmem_link_offset(cache) + sizeof(void*), KMEM_ALIGN);
+}
+
+#define KMEM_LINK(cache, obj) (*(void**)((char*)(obj) + kmem_link_offset(cache)))
+
+
+int kmem_caches_enabled = 1;
+
+static Mutex kmem_list_lock = MUTEX_INIT;
+static kmem_cache* kmem_list = NULL;          /* The caches used in this boot, in order */
+static kmem_cache** kmem_list_tail = & kmem_list;
+
+
+/* Add a cache to the list of caches used in this boot */
+static void kmem_register(kmem_cache* cache)
+{
+  Mutex_Lock(& kmem_list_lock);
+  if(! cache->registered) {
+    cache->next = NULL;
+    *kmem_list_tail = cache;
+    kmem_list_tail = & cache->next;
+    cache->registered = 1;
+  }
+  Mutex_Unlock(& kmem_list_lock);
+}
+
+
+/* Carve a new slab into the depot. This is called with the cache lock held. */
+static void kmem_cache_grow(kmem_cache* cache)
+{
+  size_t stride = kmem_stride(cache);
+  kmem_slab* slab = (kmem_slab*) xmalloc(KMEM_SLAB_HEADER + KMEM_SLAB_OBJECTS*stride);
+
+  slab->next = cache->slabs;
+  cache->slabs = slab;
+  cache->slab_count++;
+
+  char* obj = (char*)slab + KMEM_SLAB_HEADER;
+  for(int i=0; i<KMEM_SLAB_OBJECTS; i++, obj += stride) {
+    if(cache->ctor) cache->ctor(obj);
+    KMEM_LINK(cache, obj) = cache->depot;
+    cache->depot = obj;
+  }
+  cache->depot_count += KMEM_SLAB_OBJECTS;
+}
+
+
+/* Move a batch of objects from the depot to an empty magazine */
+static void kmem_mag_refill(kmem_cache* cache, kmem_magazine* mag)
+{
+  mag->refills++;
+  Mutex_Lock(& cache->lock);
+  while(mag->count < KMEM_MAG_BATCH) {
+    if(cache->depot == NULL)
+      kmem_cache_grow(cache);
+    void* obj = cache->depot;
+    cache->depot = KMEM_LINK(cache, obj);
+    cache->depot_count--;
+    mag->obj[mag->count++] = obj;
+  }
+  Mutex_Unlock(& cache->lock);
+}
+
+
+/* Move a batch of objects from a full magazine to the depot */
+static void kmem_mag_flush(kmem_cache* cache, kmem_magazine* mag)
+{
+  mag->flushes++;
+  Mutex_Lock(& cache->lock);
+  for(int i=0; i<KMEM_MAG_BATCH; i++) {
+    void* obj = mag->obj[--mag->count];
+    KMEM_LINK(cache, obj) = cache->depot;
+    cache->depot = obj;
+    cache->depot_count++;
+  }
+  Mutex_Unlock(& cache->lock);
+}
+
+
+void* kmem_cache_alloc(kmem_cache* cache)
+{
+  void* obj = NULL;
+
+  if(! cache->registered)
+    kmem_register(cache);
+
+  int preempt = preempt_off;
+  kmem_magazine* mag = & cache->mag[cpu_core_id];
+  mag->allocs++;
+  if(kmem_caches_enabled) {
+    if(mag->count == 0)
+      kmem_mag_refill(cache, mag);
+    else
+      mag->hits++;
+    obj = mag->obj[--mag->count];
+  }
+  if(preempt) preempt_on;
+
+  if(obj == NULL) {
+    obj = xmalloc(cache->size);
+    if(cache->ctor) cache->ctor(obj);
+  }
+  return obj;
+}
+
+
+void kmem_cache_free(kmem_cache* cache, void* obj)
+{
+  if(obj == NULL) return;
+
+  int preempt = preempt_off;
+  kmem_magazine* mag = & cache->mag[cpu_core_id];
+  mag->frees++;
+  if(kmem_caches_enabled) {
+    if(mag->count == KMEM_MAG_SIZE)
+      kmem_mag_flush(cache, mag);
+    mag->obj[mag->count++] = obj;
+    obj = NULL;
+  }
+  if(preempt) preempt_on;
+
+  free(obj);
+}
+
+
+int get_kmem_stats(uint i, kmem_stats* stats)
+{
+  Mutex_Lock(& kmem_list_lock);
+  kmem_cache* cache = kmem_list;
+  while(cache != NULL && i-- > 0)
+    cache = cache->next;
+  Mutex_Unlock(& kmem_list_lock);
+
+  if(cache == NULL) return 0;
+
+  *stats = (kmem_stats){ .name = cache->name, .size = cache->size, .slabs = cache->slab_count };
+  for(uint c=0; c<MAX_CORES; c++) {
+    stats->allocs += cache->mag[c].allocs;
+    stats->frees += cache->mag[c].frees;
+    stats->hits += cache->mag[c].hits;
+    stats->refills += cache->mag[c].refills;
+    stats->flushes += cache->mag[c].flushes;
+  }
+  stats->in_use = stats->allocs - stats->frees;
+  return 1;
+}
+
+
+void initialize_kmem()
+{
+  /* Forget the caches of the last boot, and their statistics */
+  for(kmem_cache* cache = kmem_list; cache != NULL; cache = cache->next) {
+    cache->registered = 0;
+    cache->slab_count = 0;
+    for(uint c=0; c<MAX_CORES; c++)
+      cache->mag[c] = (kmem_magazine){ .count = 0 };
+  }
+  kmem_list = NULL;
+  kmem_list_tail = & kmem_list;
+}
+
+
+void finalize_kmem()
+{
+  /* The statistics are kept until the next boot */
+  for(kmem_cache* cache = kmem_list; cache != NULL; cache = cache->next) {
+    while(cache->slabs != NULL) {
+      kmem_slab* slab = cache->slabs;
+      cache->slabs = slab->next;
+      free(slab);
+    }
+    cache->depot = NULL;
+    cache->depot_count = 0;
+    for(uint c=0; c<MAX_CORES; c++)
+      cache->mag[c].count = 0;
+  }
+}
+
@@ -0,0 +1,141 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+
+/**
+  @file kernel_slab.h
+  @brief TinyOS kernel: Object caches for kernel control blocks
+
+  @defgroup slab Object caches
+  @ingroup kernel
+  @brief Object caches for kernel control blocks
+
+  A kernel object cache (a @c kmem_cache) allocates objects of one type.
+  The memory is obtained from the system in slabs of @c KMEM_SLAB_OBJECTS
+  objects, and is only returned to it after the VM has stopped.
+
+  Objects are kept constructed: the constructor of the cache runs once,
+  when a slab is carved, and a freed object must be returned to the state
+  it had after construction (e.g., its mutexes unlocked, its condition
+  variables and lists empty). Fields that are set by every user of the
+  object need not be restored.
+
+  Each core keeps a magazine of up to @c KMEM_MAG_SIZE free objects per
+  cache, which it accesses with interrupts off and no locking. When its
+  magazine is empty, or full, a core moves half a magazine of objects from,
+  or to, the depot of the cache.
+
+  Caches are defined statically, with @c KMEM_CACHE_INIT:
+  @code
+  static kmem_cache pipe_cache = KMEM_CACHE_INIT("pipe", Pipe_cb, pipe_ctor);
+  @endcode
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "bios.h"
+
+/** @brief The number of objects carved from the system at a time */
+#define KMEM_SLAB_OBJECTS 32
+
+/** @brief The capacity of the per-core magazines */
+#define KMEM_MAG_SIZE 16
+
+/** @brief The number of objects moved between a magazine and the depot at a time */
+#define KMEM_MAG_BATCH (KMEM_MAG_SIZE/2)
+
+/** @brief A per-core magazine of free objects, used with interrupts off. */
+typedef struct kmem_magazine {
+  void* obj[KMEM_MAG_SIZE];   /**< The free objects */
+  uint count;                 /**< Objects in @c obj */
+  unsigned long allocs;       /**< Objects allocated on this core */
+  unsigned long frees;        /**< Objects freed on this core */
+  unsigned long hits;         /**< Allocations served without visiting the depot */
+  unsigned long refills;      /**< Batches moved from the depot to this magazine */
+  unsigned long flushes;      /**< Batches moved from this magazine to the depot */
+} kmem_magazine;
+
+/** @brief An object cache. Use @c KMEM_CACHE_INIT to define one. */
+typedef struct kmem_cache {
+  const char* name;           /**< The name of the cache, for statistics */
+  size_t size;                /**< The size of the objects */
+  void (*ctor)(void*);        /**< The constructor, or NULL */
+
+  Mutex lock;                 /**< Protects the depot and the slabs */
+  void* depot;                /**< Free objects, linked through a word past their end */
+  uint depot_count;           /**< Objects in @c depot */
+  void* slabs;                /**< The slabs carved for this cache */
+  uint slab_count;            /**< Slabs in @c slabs */
+  int registered;             /**< Whether the cache has been used in this boot */
+  struct kmem_cache* next;    /**< The list of caches used in this boot */
+
+  kmem_magazine mag[MAX_CORES];
+} kmem_cache;
+
+/** @brief Static initializer for a cache of objects of type @c type */
+#define KMEM_CACHE_INIT(cname, type, constructor) \
+  { .name = (cname), .size = sizeof(type), .ctor = (constructor), .lock = MUTEX_INIT }
+
+
+/**
+  @brief Allocate a constructed object from a cache.
+
+  This never returns NULL.
+ */
+void* kmem_cache_alloc(kmem_cache* cache);
+
+/**
+  @brief Return an object to its cache.
+
+  The object must be in its constructed state. Freeing NULL is a no-op.
+ */
+void kmem_cache_free(kmem_cache* cache, void* obj);
+
+
+/** @brief Usage statistics of an object cache. */
+typedef struct kmem_stats {
+  const char* name;           /**< The name of the cache */
+  size_t size;                /**< The size of the objects */
+  unsigned long allocs;       /**< Objects allocated */
+  unsigned long frees;        /**< Objects freed */
+  unsigned long hits;         /**< Allocations served from a core's magazine */
+  unsigned long refills;      /**< Batches of objects moved from the depot to a magazine */
+  unsigned long flushes;      /**< Batches of objects moved from a magazine to the depot */
+  unsigned long in_use;       /**< Objects allocated and not freed */
+  uint slabs;                 /**< Slabs carved from the system */
+} kmem_stats;
+
+/**
+  @brief Get the statistics of the i-th cache that has been used, in the
+  current or last boot.
+
+  @returns 0 if there are fewer than @c i+1 such caches, else 1.
+ */
+int get_kmem_stats(uint i, kmem_stats* stats);
+
+/**
+  @brief Whether objects are allocated from the caches.
+
+  When 0, each object is allocated and constructed, and freed, individually
+  with @c malloc and @c free. This is set at boot (see @c boot_kmem_caches).
+ */
+extern int kmem_caches_enabled;
+
+
+/**
+  @brief Initialize the object caches.
+
+  This is called at boot, before any kernel object is allocated.
+ */
+void initialize_kmem(void);
+
+/**
+  @brief Finalize the object caches.
+
+  This is called after the VM has stopped. It returns all slabs to the system.
+ */
+void finalize_kmem(void);
+
+/** @} */
+
+#endif
@@ -4,37 +4,71 @@
 #include "kernel_sys.h"
 #include "kernel_dev.h"
 #include "util.h"
+#include "kernel_slab.h"
 
 
 static file_ops socket_file_ops = {
 	.Read  = socket_Read,
 	.Write = socket_Write,
+	.ReadV  = socket_ReadV,
+	.WriteV = socket_WriteV,
+	.Poll = socket_Poll,
 	.Close = socket_Close
 };
 
+//Port Map the Listeners.
+Socket_cb* PORT_MAP[MAX_PORT + 1] = { [0] = 0 };
+Mutex port_map_lock = MUTEX_INIT;
+
+//Listeners are constructed unlocked, with an empty request queue.
+static void listener_ctor(void* obj){
+	Listener_cb* lcb = obj;
+	lcb->lock = MUTEX_INIT;
+	rlnode_init(&lcb->queue, NULL);
+	lcb->req_available = COND_INIT;
+}
+
+//Requests are constructed out of any queue, with no waiter.
+static void request_ctor(void* obj){
+	ConReq_cb* request = obj;
+	request->connected_cv = COND_INIT;
+	rlnode_init(&request->queue_node, request);
+}
+
+static kmem_cache socket_cache = KMEM_CACHE_INIT("socket", Socket_cb, NULL);
+static kmem_cache peer_cache = KMEM_CACHE_INIT("peer", Peer_cb, NULL);
+static kmem_cache listener_cache = KMEM_CACHE_INIT("listener", Listener_cb, listener_ctor);
+static kmem_cache request_cache = KMEM_CACHE_INIT("conreq", ConReq_cb, request_ctor);
+
+//Make a socket a peer, not yet connected.
+static void make_peer(Socket_cb* socket_cb){
+	Peer_cb* peer = (Peer_cb*)kmem_cache_alloc(&peer_cache);
+	peer->read_pipe = NULL;
+	peer->write_pipe = NULL;
+	socket_cb->socket_kind.ko_peer = peer;
+	socket_cb->type = PEER;
+}
+
 //Initialize Socket.
 Socket_cb* initialize_socket_cb(FCB* FCB,port_t port){
 
-	Socket_cb* socket_cb = (Socket_cb*)xmalloc(sizeof(Socket_cb));
+	Socket_cb* socket_cb = (Socket_cb*)kmem_cache_alloc(&socket_cache);
 	socket_cb->ref_count = 1;
 	socket_cb->fcb = FCB;
 	socket_cb->fcb->streamobj = socket_cb;
 	socket_cb->fcb->streamfunc = &socket_file_ops;
 	socket_cb->type = UNBOUND;
 	socket_cb->port = port;
-	socket_cb->socket_kind.ko_peer = (Peer_cb*)xmalloc(sizeof(Peer_cb));
-	socket_cb->socket_kind.ko_listener = (Listener_cb*)xmalloc(sizeof(Listener_cb));
+	socket_cb->socket_kind.ko_peer = NULL;
 	return socket_cb;
 
 }
 //Initialize Requests.
 ConReq_cb* initialize_request_cb(Socket_cb* socket_cb){
 
-	ConReq_cb* request = (ConReq_cb*)xmalloc(sizeof(ConReq_cb));
+	ConReq_cb* request = (ConReq_cb*)kmem_cache_alloc(&request_cache);
 	request->scb = socket_cb;
-	request->connected_cv = COND_INIT;
 	request->admitted = 0;
-	rlnode_init(&request->queue_node,request);
 
 	return request;
 }
@@ -51,9 +85,10 @@ if(socketcb_t == NULL || buf == NULL || n < 0 ){
 		return -1;
 	}
 	// peer reader
-	if(socketcb->socket_kind.ko_peer->read_pipe!= NULL){ 
+	Pipe_cb* read_pipe = socketcb->socket_kind.ko_peer->read_pipe;
+	if(read_pipe!= NULL){ 
 		int k;
-		k = reader_pipe_Read(socketcb->socket_kind.ko_peer->read_pipe,buf,n);
+		k = reader_pipe_Read(read_pipe,buf,n);
 		return k;
 	}
 	return -1;
@@ -73,14 +108,70 @@ int socket_Write(void* socketcb_t, const char* buf, unsigned int n){
 		return -1;
 	}
 	// peer writer
-	if(socketcb->socket_kind.ko_peer->write_pipe != NULL){
+	Pipe_cb* write_pipe = socketcb->socket_kind.ko_peer->write_pipe;
+	if(write_pipe != NULL){
 		int k;
-		k = writer_pipe_Write(socketcb->socket_kind.ko_peer->write_pipe,buf,n);
+		k = writer_pipe_Write(write_pipe,buf,n);
 		return k;
 	}
 	return -1;
 
 }
+//Socket vectored Read.
+int socket_ReadV(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt, unsigned int n, int flags){
+	Socket_cb* socketcb = (Socket_cb*)socketcb_t;
+	if(socketcb == NULL || socketcb->type != PEER){
+		return -1;
+	}
+	Pipe_cb* read_pipe = socketcb->socket_kind.ko_peer->read_pipe;
+	if(read_pipe != NULL){
+		return reader_pipe_ReadV(read_pipe, iov, iovcnt, n, flags);
+	}
+	return -1;
+}
+
+//Socket vectored Write.
+int socket_WriteV(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt, unsigned int n, int flags){
+	Socket_cb* socketcb = (Socket_cb*)socketcb_t;
+	if(socketcb == NULL || socketcb->type != PEER){
+		return -1;
+	}
+	Pipe_cb* write_pipe = socketcb->socket_kind.ko_peer->write_pipe;
+	if(write_pipe != NULL){
+		return writer_pipe_WriteV(write_pipe, iov, iovcnt, n, flags);
+	}
+	return -1;
+}
+
+//Socket readiness: a listener is readable when it has requests, a peer 
+//as its pipes, and a shut down direction is ready and hung up.
+int socket_Poll(void* socketcb_t){
+	Socket_cb* socketcb = (Socket_cb*)socketcb_t;
+	int ev = 0;
+
+	switch(socketcb->type){
+		case LISTENER: {
+			Listener_cb* lcb = socketcb->socket_kind.ko_listener;
+			Mutex_Lock(&lcb->lock);
+			lcb->polled = 1;
+			if(!is_rlist_empty(&lcb->queue))
+				ev |= POLL_READABLE;
+			Mutex_Unlock(&lcb->lock);
+			break;
+		}
+		case PEER: {
+			Peer_cb* peer = socketcb->socket_kind.ko_peer;
+			ev |= peer->read_pipe ? pipe_read_events(peer->read_pipe) : (POLL_READABLE|POLL_HANGUP);
+			ev |= peer->write_pipe ? pipe_write_events(peer->write_pipe) : (POLL_WRITABLE|POLL_HANGUP);
+			break;
+		}
+		default:
+			//not connected, so it can neither read nor write
+			ev = POLL_HANGUP;
+	}
+	return ev;
+}
+
 //Socket Close.
 int socket_Close(void* socketcb_t){
 
@@ -89,37 +180,76 @@ int socket_Close(void* socketcb_t){
 
 	//check for listener to wake
 	if(socketcb->type == LISTENER){
-		kernel_broadcast(&socketcb->socket_kind.ko_listener->req_available);//wake up all its peers
+		Listener_cb* lcb = socketcb->socket_kind.ko_listener;
+		Mutex_Lock(&port_map_lock);
+		Mutex_Lock(&lcb->lock);
 		PORT_MAP[socketcb->port] = NULL;
+		kernel_broadcast(&lcb->req_available);//wake up all its peers
+		//refuse the pending requests
+		while(!is_rlist_empty(&lcb->queue)){
+			ConReq_cb* request = rlist_pop_front(&lcb->queue)->obj;
+			request->admitted = -1;
+			kernel_signal(&request->connected_cv);
+		}
+		Mutex_Unlock(&lcb->lock);
+		Mutex_Unlock(&port_map_lock);
 
 	} // else free sockets' pipes
 	else if(socketcb->type ==  PEER){
 		reader_pipe_Close(socketcb->socket_kind.ko_peer->read_pipe);
 		writer_pipe_Close(socketcb->socket_kind.ko_peer->write_pipe);
-		decrscb_refcount(socketcb);
 	}
+	decrscb_refcount(socketcb);
 
 	return 1;
 
 }
 
+//The pipe of a peer socket, for Splice.
+Pipe_cb* socket_pipe(FCB* fcb, int writing){
+	if(fcb->streamfunc != &socket_file_ops){
+		return NULL;
+	}
+	Socket_cb* socketcb = fcb->streamobj;
+	if(socketcb == NULL || socketcb->type != PEER){
+		return NULL;
+	}
+	return writing ? socketcb->socket_kind.ko_peer->write_pipe 
+	               : socketcb->socket_kind.ko_peer->read_pipe;
+}
+
 //delete socket.
 void scb_delete(Socket_cb* socketcb_t){
 	assert(socketcb_t != NULL);
-	free(socketcb_t);
+	if(socketcb_t->type == LISTENER)
+		kmem_cache_free(&listener_cache, socketcb_t->socket_kind.ko_listener);
+	else if(socketcb_t->type == PEER)
+		kmem_cache_free(&peer_cache, socketcb_t->socket_kind.ko_peer);
+	kmem_cache_free(&socket_cache, socketcb_t);
 	return ;
 }
 
 void incrscb_refcount(Socket_cb* socketcb_t){
-    socketcb_t->ref_count++;
+    __atomic_add_fetch(&socketcb_t->ref_count, 1, __ATOMIC_RELAXED);
 }
 void decrscb_refcount(Socket_cb* socketcb_t){
-    socketcb_t->ref_count--;
-    if(socketcb_t->ref_count == 0){
+    if(__atomic_sub_fetch(&socketcb_t->ref_count, 1, __ATOMIC_ACQ_REL) == 0){
         scb_delete(socketcb_t);
     }
 }
 
+//Translate a fid to the FCB of a socket, taking a reference to the FCB, 
+//so that a concurrent Close of the fid cannot free it (or the socket). 
+//Return NULL if the fid is not a socket, else release with FCB_decref.
+static FCB* get_socket_fcb(Fid_t fid){
+	FCB* fcb = get_fcb_ref(fid);
+	if(fcb != NULL && fcb->streamfunc != &socket_file_ops){
+		FCB_decref(fcb);
+		return NULL;
+	}
+	return fcb;
+}
+
 //=======================================================================================
 //=======================================================================================
 
@@ -140,19 +270,15 @@ Fid_t sys_Socket(port_t port)
 	// Initialize the new Socket CB
 	initialize_socket_cb(FCB,port);
 
+	FCB_install(1, &socket_fidt, &FCB);
 	return socket_fidt;
 }
 
 
 int sys_Listen(Fid_t sock)
 {
-	//Given socket can not be illegal
-	if(sock > MAX_FILEID || sock == NOFILE) {
-		return -1;
-	}
-
 	//save the instance to use below.
-	FCB * sFCB = get_fcb(sock);
+	FCB * sFCB = get_socket_fcb(sock);
 
 	// if the fcb does not exist
 	if(sFCB==NULL){
@@ -161,46 +287,34 @@ int sys_Listen(Fid_t sock)
 
 	//take the socket cb indicated from the FCB
 	Socket_cb* rcb_socket_cb = sFCB->streamobj;
-
-	//if the SOCKET CB IS NOT INITIALIZED/EXISTS
-	if(rcb_socket_cb == NULL){
-		return -1;
+	int ret = -1;
+
+	//The type of a socket changes under the port map lock, so that 
+	//concurrent Listen and Connect calls cannot both find it unbound
+	Mutex_Lock(&port_map_lock);
+	//Can not be peered with listener, the socket must be bound and
+	//the port must not be held by another socket
+	if(rcb_socket_cb->type == UNBOUND && rcb_socket_cb->port != NOPORT 
+		&& PORT_MAP[rcb_socket_cb->port] == NULL){
+
+		//Make socket as a Listener
+		rcb_socket_cb->socket_kind.ko_listener = (Listener_cb*)kmem_cache_alloc(&listener_cache);
+		rcb_socket_cb->socket_kind.ko_listener->polled = 0;
+		rcb_socket_cb->type = LISTENER;
+		//Listener socket to  the Port Map
+		PORT_MAP[rcb_socket_cb->port] = rcb_socket_cb;
+		ret = 0;
 	}
-	//Can not be peered with listener
-	if(rcb_socket_cb->type != UNBOUND){
-		return -1;
-	}
-	//If the socket is not be bounded 
-	if(rcb_socket_cb->port == NOPORT){
-		return -1;
-	}
-	//if the port is holded from another socket
-	if(PORT_MAP[rcb_socket_cb->port] != NULL){
-		return -1;
-	}
-
-	//Make socket as a Listener
-	rcb_socket_cb->type = LISTENER;
-	
-	rcb_socket_cb->socket_kind.ko_listener = (Listener_cb*)xmalloc (sizeof(Listener_cb));
-	rlnode_init(&rcb_socket_cb->socket_kind.ko_listener->queue ,NULL);	
-	rcb_socket_cb->socket_kind.ko_listener->req_available = COND_INIT;
-	//Listener socket to  the Port Map
-	PORT_MAP[rcb_socket_cb->port] = rcb_socket_cb;
-		
+	Mutex_Unlock(&port_map_lock);
 
-	return 0;
+	FCB_decref(sFCB);
+	return ret;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {
-// If Listener socket File Id given is not legal, return error
-	if(lsock >= MAX_FILEID || lsock <= NOFILE) {
-		return NOFILE;
-	}
-
-	FCB* sFCB = get_fcb(lsock);	//IMPORTANT
+	FCB* sFCB = get_socket_fcb(lsock);	//IMPORTANT
 
 	// if the fcb does not exist
 	if(sFCB==NULL){
@@ -211,28 +325,47 @@ Fid_t sys_Accept(Fid_t lsock)
 	// Get the Listener socket CB
 	Socket_cb* listener_cb = sFCB->streamobj;
 
-	// If listener CB is non existent, return error
-	if(listener_cb == NULL || listener_cb->type != LISTENER) {
+	// If the socket is not a listener, return error
+	Mutex_Lock(&port_map_lock);
+	int is_listener = (listener_cb->type == LISTENER);
+	Mutex_Unlock(&port_map_lock);
+	if(! is_listener) {
+		FCB_decref(sFCB);
 		return NOFILE;
 	}
+
+	// Hold the listener, but not its FCB, while we wait: closing the 
+	// listening fid must be able to close the listener and wake us up
 	incrscb_refcount(listener_cb);
+	int flags = sFCB->flags;
+	FCB_decref(sFCB);
+	Listener_cb* lcb = listener_cb->socket_kind.ko_listener;
 
 	// Wait if Listener socket has no requests to serve
-	while(is_rlist_empty(&listener_cb->socket_kind.ko_listener->queue))  {
-		kernel_wait(&listener_cb->socket_kind.ko_listener->req_available, SCHED_IO);
-		
+	Mutex_Lock(&lcb->lock);
+	while(is_rlist_empty(&lcb->queue))  {
 		// If Listener gets closed before Accept we must return error
-		if(PORT_MAP[listener_cb->port] == NULL) {
+		// (PORT_MAP is cleared with the listener lock held)
+		if(PORT_MAP[listener_cb->port] != listener_cb) {
+			Mutex_Unlock(&lcb->lock);
+			decrscb_refcount(listener_cb);
 			return NOFILE;
 		}
+		// A non-blocking listener does not wait for requests
+		if(flags & IO_NONBLOCK) {
+			Mutex_Unlock(&lcb->lock);
+			decrscb_refcount(listener_cb);
+			return WOULD_BLOCK;
+		}
+		kernel_wait(&lcb->lock, &lcb->req_available, SCHED_IO);
 	}
 
 	// Accept the first request in the Listener Request Queue 
-	rlnode* cur_node = rlist_pop_front(&listener_cb->socket_kind.ko_listener->queue);
+	rlnode* cur_node = rlist_pop_front(&lcb->queue);
 	ConReq_cb* cur_request = cur_node->obj;	// Request to serve
+	Mutex_Unlock(&lcb->lock);
 
-	// Make socket that is bound to this request a peer
-	cur_request->scb->type = PEER;
+	// The socket that is bound to this request is already a peer
 	Socket_cb* sock_cb2 = cur_request->scb; 
 
 	Fid_t fid3; 
@@ -243,12 +376,17 @@ Fid_t sys_Accept(Fid_t lsock)
 	// Reserve memory and create the second peer
 	int ret = FCB_reserve(1, &fid3, &sock_fcb3);
 	if (ret == 0) {
+		// Refuse the request
+		Mutex_Lock(&lcb->lock);
+		cur_request->admitted = -1;
+		kernel_signal(&cur_request->connected_cv);
+		Mutex_Unlock(&lcb->lock);
+		decrscb_refcount(listener_cb);
 		return NOFILE;
 	}
 	// Initialize the new peer (FID3)
 	sock_cb3 = initialize_socket_cb(sock_fcb3, listener_cb->port);
-	sock_cb3->type = PEER;
-	sock_cb3->socket_kind.ko_peer = (Peer_cb*)xmalloc(sizeof(Peer_cb));
+	make_peer(sock_cb3);
 	
 
 	// Establish peer-peer connection with two pipes
@@ -256,8 +394,9 @@ Fid_t sys_Accept(Fid_t lsock)
 	Pipe_cb* pipe2;
 	
 	// Initialize the two pipes
-	pipe1 = create_pipe_cb(sock_cb2->fcb, sock_cb3->fcb);
-	pipe2 = create_pipe_cb(sock_cb3->fcb, sock_cb2->fcb);
+	// (idle connections should cost little, the pipes grow with traffic)
+	pipe1 = create_pipe_cb(sock_cb2->fcb, sock_cb3->fcb, PIPE_BUFFER_MIN);
+	pipe2 = create_pipe_cb(sock_cb3->fcb, sock_cb2->fcb, PIPE_BUFFER_MIN);
 	
 	// Set socket CBs as pipes' stream objects
 	pipe1->reader->streamobj = sock_cb2;
@@ -277,11 +416,16 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	sock_cb3->socket_kind.ko_peer->read_pipe = pipe2;
 	sock_cb3->socket_kind.ko_peer->write_pipe = pipe1;
+
+	// The new peer is ready for use
+	FCB_install(1, &fid3, &sock_fcb3);
 	
 	// Change the request admittion flag
+	Mutex_Lock(&lcb->lock);
 	cur_request->admitted = 1;
 	// Wake up Connect that waits for admittion
 	kernel_signal(&cur_request->connected_cv);	
+	Mutex_Unlock(&lcb->lock);
 
 	decrscb_refcount(listener_cb);
 	// Returns the new peer File ID, for user to use
@@ -293,105 +437,132 @@ Fid_t sys_Accept(Fid_t lsock)
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	//If port is illegal/or not exist, return error
-	if(PORT_MAP[port] == NULL || port <= NOPORT || port > MAX_PORT) {
-		return -1;
-	}
-	//if socket in this port is not a Listener, return error
-	if(PORT_MAP[port]->type != LISTENER) {
+	//If port is illegal, return error
+	if(port <= NOPORT || port > MAX_PORT) {
 		return -1;
 	}
     
-	//save the instance to use below.
-	FCB* sFCB = get_fcb(sock);
+	//save the instance to use below. The reference keeps the socket (and 
+	//the FCB that Accept connects the pipes to) until we are done.
+	FCB* sFCB = get_socket_fcb(sock);
 	// if the fcb does not exist
 	if(sFCB==NULL){
 		return -1;
 	}
 	Socket_cb* scb = sFCB->streamobj;
-	
-	if(scb == NULL){
-		return -1;
-	}
-	if(scb->type != UNBOUND){
+
+	//get the Listener Socket CB. If it does not exist, or the socket in 
+	//this port is not a Listener, return error. The socket must be 
+	//unbound, and becomes a peer under the port map lock.
+	Mutex_Lock(&port_map_lock);
+	Socket_cb* listener_cb = PORT_MAP[port];
+	if(scb->type != UNBOUND || listener_cb == NULL || listener_cb->type != LISTENER) {
+		Mutex_Unlock(&port_map_lock);
+		FCB_decref(sFCB);
 		return -1;
 	}
-    incrscb_refcount(scb);
-  
-	//get the Listener Socket CB
-	Socket_cb* listener_cb = PORT_MAP[port];
+	//peer the new scb
+	make_peer(scb);
+	//the listener lives on until we are done with its queue
+	incrscb_refcount(listener_cb);
+	Listener_cb* lcb = listener_cb->socket_kind.ko_listener;
+	Mutex_Lock(&lcb->lock);
+	Mutex_Unlock(&port_map_lock);
 
 	//create and initialize a new request
 	ConReq_cb* request = initialize_request_cb(scb);
-	//peer the new scb
-	request->scb->socket_kind.ko_peer = (Peer_cb*)xmalloc(sizeof(Peer_cb));
-	request->scb->type = PEER;
 
 	//push back request to Listener Requests Queue
-	rlist_push_back(&listener_cb->socket_kind.ko_listener->queue,&request->queue_node);
+	rlist_push_back(&lcb->queue,&request->queue_node);
 
-	//wake up the Listener from accept
-	kernel_signal(&listener_cb->socket_kind.ko_listener->req_available);
+	//wake up the Listener from accept, or from Poll
+	kernel_signal(&lcb->req_available);
+	if(lcb->polled)
+		poll_notify();
 
-	//wait for Accept to admit the connection, time out after 1000 * timeout
+	//wait for Accept to admit the connection, time out after timeout msec
+	//(a negative timeout never expires). Once Accept has taken the request
+	//off the queue, it always answers it.
+	TimerDuration deadline = ((long)timeout < 0) ? NO_TIMEOUT : bios_clock() + 1000*(TimerDuration)timeout;
 	while(request->admitted==0){
-    	int done_admit = kernel_timedwait(&request->connected_cv, SCHED_IO, 500);
-		if(!done_admit){
-			return -1;
-		};
-	}
-	
-	if(request->admitted == 0) {
-		return -1;
+		if(is_rlist_empty(&request->queue_node)){
+			kernel_wait(&lcb->lock, &request->connected_cv, SCHED_IO);
+			continue;
+		}
+		TimerDuration now = bios_clock();
+		if(now >= deadline){
+			rlist_remove(&request->queue_node);
+			break;
+		}
+		kernel_timedwait(&lcb->lock, &request->connected_cv, SCHED_IO, 
+			(deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now);
 	}
+	int ret = (request->admitted == 1) ? 0 : -1;
+	Mutex_Unlock(&lcb->lock);
+
+	kmem_cache_free(&request_cache, request);
+	decrscb_refcount(listener_cb);
+	FCB_decref(sFCB);
+
+	return ret;
 
-    decrscb_refcount(scb); 
+}
 
-	return 0;
 
+//Disconnect both ends of a peer's pipe, and detach it from the peer.
+static void shutdown_pipe(Pipe_cb** pipe)
+{
+	Pipe_cb* pipe_cb = *pipe;
+	if(pipe_cb == NULL) return;
+	Mutex_Lock(&pipe_cb->lock);
+	pipe_cb->reader = NULL;
+	pipe_cb->writer = NULL;
+	pipe_wakeup_all(pipe_cb);
+	Mutex_Unlock(&pipe_cb->lock);
+	*pipe = NULL;
+	pipe_put(pipe_cb);
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {	
-	FCB *sFCB = get_fcb(sock);
+	FCB *sFCB = get_socket_fcb(sock);
+	if(sFCB == NULL) {
+		return -1;
+	}
 	Socket_cb *rcb_socket_cb = sFCB->streamobj;
 
-	if(rcb_socket_cb == NULL || rcb_socket_cb->type == LISTENER || rcb_socket_cb->type == UNBOUND) {
-			return -1;
-		}
-			switch (how)
-			{
-				case SHUTDOWN_READ: 
-					// Close socket read 
-					rcb_socket_cb->socket_kind.ko_peer->read_pipe->reader = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->read_pipe->writer = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->read_pipe = NULL;
-
-					break; 
-				
-				case SHUTDOWN_WRITE: 
-					// Close socket write 
-					rcb_socket_cb->socket_kind.ko_peer->write_pipe->reader = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->write_pipe->writer = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->write_pipe = NULL;
-					break;
-				
-				case SHUTDOWN_BOTH: 
-					//Close both socket receiver,sender
-					rcb_socket_cb->socket_kind.ko_peer->read_pipe->reader = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->read_pipe->writer = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->read_pipe = NULL;
-
-					rcb_socket_cb->socket_kind.ko_peer->write_pipe->reader = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->write_pipe->writer = NULL;
-					rcb_socket_cb->socket_kind.ko_peer->write_pipe = NULL;
-					break;
-					
-				default:
-					return -1;
-			}
-		return 0;
+	//A peer stays a peer
+	Mutex_Lock(&port_map_lock);
+	int is_peer = (rcb_socket_cb->type == PEER);
+	Mutex_Unlock(&port_map_lock);
+
+	int ret = 0;
+	if(! is_peer) {
+		ret = -1;
+	}
+	else switch (how)
+	{
+		case SHUTDOWN_READ: 
+			// Close socket read 
+			shutdown_pipe(&rcb_socket_cb->socket_kind.ko_peer->read_pipe);
+			break; 
 		
-}
+		case SHUTDOWN_WRITE: 
+			// Close socket write 
+			shutdown_pipe(&rcb_socket_cb->socket_kind.ko_peer->write_pipe);
+			break;
+		
+		case SHUTDOWN_BOTH: 
+			//Close both socket receiver,sender
+			shutdown_pipe(&rcb_socket_cb->socket_kind.ko_peer->read_pipe);
+			shutdown_pipe(&rcb_socket_cb->socket_kind.ko_peer->write_pipe);
+			break;
+			
+		default:
+			ret = -1;
+	}
 
+	FCB_decref(sFCB);
+	return ret;
+}
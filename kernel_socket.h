@@ -24,8 +24,10 @@ typedef struct peer_control_block{
 
 //Listener
 typedef struct listener_control_block{
+  Mutex lock;   /* Protects the queue and the requests in it */
 	rlnode queue;
   CondVar req_available;
+  int polled;   /* Once set, new requests call poll_notify() */
 }Listener_cb;
 
 typedef struct socket_control_block {
@@ -48,11 +50,15 @@ typedef struct connection_request_control_block{
 }ConReq_cb;
 
 //Port Map the Listeners.
-Socket_cb* PORT_MAP[MAX_PORT + 1] = { [0] = 0 };
+extern Socket_cb* PORT_MAP[MAX_PORT + 1];
+extern Mutex port_map_lock;   /* Protects PORT_MAP */
 
 //Implement socket functions:Read,Write,Close.
 int socket_Read(void* socketcb_t, char *buf, unsigned int n);
 int socket_Write(void* socketcb_t, const char* buf, unsigned int n);
+int socket_ReadV(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt, unsigned int n, int flags);
+int socket_WriteV(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt, unsigned int n, int flags);
+int socket_Poll(void* socketcb_t);
 int socket_Close(void* socketcb_t);
 
 
@@ -69,6 +75,10 @@ Socket_cb* initialize_socket_cb(FCB* sFCB,port_t port);
 //Initialize Requests.
 ConReq_cb* initialize_request_cb(Socket_cb* scb);
 
+//The pipe that a peer socket reads from (writing==0) or writes to (writing==1),
+//or NULL if the FCB is not a peer socket.
+Pipe_cb* socket_pipe(FCB* fcb, int writing);
+
 void scb_delete(Socket_cb* scb);
 void incrscb_refcount(Socket_cb* s);
 void decrscb_refcount(Socket_cb* s);
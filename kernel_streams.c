@@ -1,58 +1,49 @@
 
+#include <limits.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_slab.h"
 
-#define MAX_FILES MAX_PROC
-
-FCB FT[MAX_FILES];
-rlnode FCB_freelist;
-
-
-void initialize_files()
-{
-  rlnode_init(&FCB_freelist,NULL);
-  for(int i=0;i<MAX_FILES;i++) {
-
-    FT[i].refcount = 0;
-    rlnode_init(& FT[i].freelist_node, &FT[i]);
-    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
-  }
-}
+/*
+  FCBs are allocated from an object cache, so that each core allocates 
+  and frees them from its own magazine, and only visits the shared depot 
+  of the cache once per batch.
+ */
+static kmem_cache fcb_cache = KMEM_CACHE_INIT("fcb", FCB, NULL);
 
 
-FCB* acquire_FCB()
+/* A recycled FCB must not keep the stream of its previous owner, which may be freed */
+static FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
-    fcb->refcount = 0;
-    return fcb;
-  }
-  else
-    return NULL;
+  FCB* fcb = (FCB*) kmem_cache_alloc(& fcb_cache);
+  fcb->refcount = 0;
+  fcb->streamobj = NULL;
+  fcb->streamfunc = NULL;
+  fcb->flags = 0;
+  return fcb;
 }
 
-void release_FCB(FCB* fcb)
+static void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  kmem_cache_free(& fcb_cache, fcb);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    int retval = fcb->streamfunc ? fcb->streamfunc->Close(fcb->streamobj) : -1;
     release_FCB(fcb);
     return retval;
   }
@@ -62,54 +53,298 @@ int FCB_decref(FCB* fcb)
 
 
 
+/*
+ *
+ *   File tables
+ *
+ *   A process with no open files has a NULL table. Exec shares the table
+ *   of the parent with the child, and a shared table is never modified:
+ *   a process that changes its table while it is shared first makes a
+ *   private copy of it (see FIDT_writable). The per-process fidt_lock 
+ *   protects the table pointer of the process, and the table, if private.
+ *
+ *   A reserved fid is in use, but has no stream yet (see FCB_reserve). 
+ *   It is invisible to the system calls, and it is never inherited: a 
+ *   table with reservations is private to the process that made them.
+ *
+ */
+
+#define FIDT_WORD_BITS 64
+
+static void fidt_ctor(void* obj)
+{
+  FIDT* fidt = obj;
+  fidt->fcb = NULL;
+  fidt->used = NULL;
+  fidt->size = 0;
+  fidt->reserved = 0;
+}
+
+static kmem_cache fidt_cache = KMEM_CACHE_INIT("fidt", FIDT, fidt_ctor);
+
+
+static inline uint FIDT_limit(FIDT* fidt)
+{
+  return fidt ? fidt->limit : MAX_FILEID;
+}
+
+static inline int FIDT_is_open(FIDT* fidt, uint f)
+{
+  return fidt && f < fidt->size && (fidt->used[f/FIDT_WORD_BITS] >> (f%FIDT_WORD_BITS)) & 1;
+}
+
+/* Return the stream of a fid, or NULL if the fid is free or reserved */
+static inline FCB* FIDT_get(FIDT* fidt, uint f)
+{
+  return FIDT_is_open(fidt, f) ? fidt->fcb[f] : NULL;
+}
+
+static inline int FIDT_is_reserved(FIDT* fidt, uint f)
+{
+  return FIDT_is_open(fidt, f) && fidt->fcb[f] == NULL;
+}
+
+
+/* Grow the table to hold at least fid need-1, doubling its size */
+static void FIDT_grow(FIDT* fidt, uint need)
+{
+  uint size = (fidt->size == 0) ? FIDT_WORD_BITS : fidt->size;
+  while(size < need) size *= 2;
+
+  fidt->fcb = (FCB**) realloc(fidt->fcb, size*sizeof(FCB*));
+  fidt->used = (uint64_t*) realloc(fidt->used, size/8);
+  if(fidt->fcb == NULL || fidt->used == NULL)
+    FATAL("Out of memory for a file table");
+
+  memset(fidt->fcb + fidt->size, 0, (size - fidt->size)*sizeof(FCB*));
+  memset(fidt->used + fidt->size/FIDT_WORD_BITS, 0, (size - fidt->size)/8);
+  fidt->size = size;
+}
+
+
+/* Return the lowest free fid which is not less than f. This is
+   fidt->size if all fids from f up are in the table and open. */
+static uint FIDT_find_free(FIDT* fidt, uint f)
+{
+  if(fidt == NULL || f >= fidt->size) return f;
+
+  uint w = f / FIDT_WORD_BITS;
+  uint64_t free_bits = ~fidt->used[w] & (~(uint64_t)0 << (f % FIDT_WORD_BITS));
+  for(;;) {
+    if(free_bits)
+      return w*FIDT_WORD_BITS + __builtin_ctzll(free_bits);
+    if(++w == fidt->size/FIDT_WORD_BITS)
+      return fidt->size;
+    free_bits = ~fidt->used[w];
+  }
+}
+
+
+/* Return whether any fid not less than f is open */
+static int FIDT_open_from(FIDT* fidt, uint f)
+{
+  if(fidt == NULL || f >= fidt->size) return 0;
+
+  uint w = f / FIDT_WORD_BITS;
+  if(fidt->used[w] & (~(uint64_t)0 << (f % FIDT_WORD_BITS)))
+    return 1;
+  while(++w < fidt->size/FIDT_WORD_BITS)
+    if(fidt->used[w]) return 1;
+  return 0;
+}
+
+
+/* Put a stream at a fid, growing the table if needed. The fid must be below the limit. */
+static void FIDT_set(FIDT* fidt, uint f, FCB* fcb)
+{
+  if(f >= fidt->size) FIDT_grow(fidt, f+1);
+  fidt->fcb[f] = fcb;
+  fidt->used[f/FIDT_WORD_BITS] |= (uint64_t)1 << (f%FIDT_WORD_BITS);
+}
+
+/* Remove the stream of an open fid, returning it */
+static FCB* FIDT_clear(FIDT* fidt, uint f)
+{
+  assert(FIDT_is_open(fidt, f));
+  FCB* fcb = fidt->fcb[f];
+  fidt->fcb[f] = NULL;
+  fidt->used[f/FIDT_WORD_BITS] &= ~((uint64_t)1 << (f%FIDT_WORD_BITS));
+  return fcb;
+}
+
+
+/* Drop a reference to a table. The last reference closes its open fids. */
+static void FIDT_put(FIDT* fidt)
+{
+  if(fidt == NULL || __atomic_sub_fetch(& fidt->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  assert(fidt->reserved == 0);
+
+  /* Visit the open fids only, a word of the bitmap at a time */
+  for(uint w = 0; w < fidt->size/FIDT_WORD_BITS; w++)
+    for(uint64_t bits = fidt->used[w]; bits != 0; bits &= bits-1)
+      FCB_decref(fidt->fcb[w*FIDT_WORD_BITS + __builtin_ctzll(bits)]);
+
+  free(fidt->fcb);
+  free(fidt->used);
+  fidt_ctor(fidt);
+  kmem_cache_free(& fidt_cache, fidt);
+}
+
+
+/* Return a new private table, with a reference to each stream of old 
+   (which may be NULL). The reserved fids of old are free in the copy. */
+static FIDT* FIDT_copy(FIDT* old)
+{
+  FIDT* fidt = (FIDT*) kmem_cache_alloc(& fidt_cache);
+  fidt->refcount = 1;
+  fidt->limit = FIDT_limit(old);
+  if(old != NULL && old->size > 0) {
+    FIDT_grow(fidt, old->size);
+    for(uint w = 0; w < old->size/FIDT_WORD_BITS; w++)
+      for(uint64_t bits = old->used[w]; bits != 0; bits &= bits-1) {
+        uint f = w*FIDT_WORD_BITS + __builtin_ctzll(bits);
+        if(old->fcb[f] == NULL) continue;
+        FIDT_set(fidt, f, old->fcb[f]);
+        FCB_incref(fidt->fcb[f]);
+      }
+  }
+  return fidt;
+}
+
+
+/*
+  Return the table of a process, for modification. If the table is shared
+  (or missing), the process is given a private copy of it first.
+  Must be called with the fidt_lock of the process held.
+ */
+static FIDT* FIDT_writable(PCB_cold* cold)
+{
+  FIDT* old = cold->fidt;
+  if(old != NULL && __atomic_load_n(& old->refcount, __ATOMIC_ACQUIRE) == 1)
+    return old;
+
+  /* A shared table has no reservations */
+  FIDT* fidt = FIDT_copy(old);
+
+  /* The copy holds a reference to every stream of old, so that dropping 
+     old never closes a stream, and it is safe to do under the lock. */
+  FIDT_put(old);
+  cold->fidt = fidt;
+  return fidt;
+}
+
+
+void FIDT_share(PCB* to, PCB* from)
+{
+  assert(to->cold->fidt == NULL);
+
+  Mutex_Lock(& from->cold->fidt_lock);
+  FIDT* fidt = from->cold->fidt;
+  if(fidt != NULL && fidt->reserved > 0)
+    /* Other threads of from are opening streams, which to does not inherit */
+    fidt = FIDT_copy(fidt);
+  else if(fidt != NULL)
+    __atomic_add_fetch(& fidt->refcount, 1, __ATOMIC_RELAXED);
+  Mutex_Unlock(& from->cold->fidt_lock);
+
+  to->cold->fidt = fidt;
+}
+
+
+void FIDT_release(PCB* pcb)
+{
+  /* The streams are closed outside the lock */
+  Mutex_Lock(& pcb->cold->fidt_lock);
+  FIDT* fidt = pcb->cold->fidt;
+  pcb->cold->fidt = NULL;
+  Mutex_Unlock(& pcb->cold->fidt_lock);
+
+  FIDT_put(fidt);
+}
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
-    size_t f=0;
+    PCB_cold* cur = CURPROC->cold;
+    uint f=0;
     uint i;
 
+    Mutex_Lock(& cur->fidt_lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
+	f = FIDT_find_free(cur->fidt, f);
+	if(f >= FIDT_limit(cur->fidt)) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
-    /* Allocate FCBs */
-    for(i=0;i<num;i++)
-	if((fcb[i] = acquire_FCB()) == NULL)
-	    break;
-    if(i<num) {
-	/* Roll back */
-	while(i>0) {
-	    release_FCB(fcb[i-1]);
-	    i--;
-	}
-	return 0;
-    }
-    /* Found all */
+    if(i<num) goto fail;
+    /* Found all. A private copy of the table has the same free fids. 
+       The fids are reserved, but the FCBs are not visible yet. */
+    FIDT* fidt = FIDT_writable(cur);
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	fcb[i] = acquire_FCB();
+	FIDT_set(fidt, fid[i], NULL);
     }
+    fidt->reserved += num;
+    Mutex_Unlock(& cur->fidt_lock);
     return 1;
+
+fail:
+    Mutex_Unlock(& cur->fidt_lock);
+    return 0;
 }
 
 
 
+void FCB_install(size_t num, Fid_t *fid, FCB** fcb)
+{
+    PCB_cold* cur = CURPROC->cold;
+    Mutex_Lock(& cur->fidt_lock);
+    /* A table with reservations is private */
+    FIDT* fidt = FIDT_writable(cur);
+    for(size_t i=0; i<num ; i++) {
+	assert(FIDT_is_reserved(fidt, fid[i]));
+	assert(fcb[i]->streamfunc != NULL);
+	FCB_incref(fcb[i]);
+	fidt->fcb[fid[i]] = fcb[i];
+    }
+    fidt->reserved -= num;
+    Mutex_Unlock(& cur->fidt_lock);
+}
+
+
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
+    PCB_cold* cur = CURPROC->cold;
+    Mutex_Lock(& cur->fidt_lock);
+    FIDT* fidt = FIDT_writable(cur);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	/* The FCB was never visible, so no one else holds it */
+	assert(FIDT_is_reserved(fidt, fid[i]));
+	FIDT_clear(fidt, fid[i]);
 	release_FCB(fcb[i]);
     }
+    fidt->reserved -= num;
+    Mutex_Unlock(& cur->fidt_lock);
 }
 
 
+int sys_SetFileLimit(unsigned int limit)
+{
+  if(limit < 1 || limit > MAX_FILEID_LIMIT) return -1;
 
+  PCB_cold* cur = CURPROC->cold;
+  int retcode = 0;
+  Mutex_Lock(& cur->fidt_lock);
+  /* Refuse to strand open fids at or above the new limit */
+  if(FIDT_open_from(cur->fidt, limit))
+    retcode = -1;
+  else if(limit != FIDT_limit(cur->fidt))
+    FIDT_writable(cur)->limit = limit;
+  Mutex_Unlock(& cur->fidt_lock);
+  return retcode;
+}
 
 
 
@@ -122,9 +357,28 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 
 FCB* get_fcb(Fid_t fid)
 {
-  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+  if(fid < 0) return NULL;
 
-  return CURPROC->FIDT[fid];
+  PCB_cold* cur = CURPROC->cold;
+  Mutex_Lock(& cur->fidt_lock);
+  FCB* fcb = FIDT_get(cur->fidt, fid);
+  Mutex_Unlock(& cur->fidt_lock);
+  return fcb;
+}
+
+
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0) return NULL;
+
+  PCB_cold* cur = CURPROC->cold;
+  Mutex_Lock(& cur->fidt_lock);
+  FCB* fcb = FIDT_get(cur->fidt, fid);
+  /* An FCB without methods is not a stream that I/O can be done on */
+  if(fcb && fcb->streamfunc == NULL) fcb = NULL;
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(& cur->fidt_lock);
+  return fcb;
 }
 
 
@@ -135,18 +389,20 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream. The reference makes sure that the 
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-    if(devread)
+    /* Only the vectored method can refuse to block */
+    if((fcb->flags & IO_NONBLOCK) && fcb->streamfunc->ReadV) {
+      iovec_t iov = { buf, size };
+      retcode = fcb->streamfunc->ReadV(sobj, &iov, 1, size, fcb->flags);
+    }
+    else if(devread)
       retcode = devread(sobj, buf, size);
 
     /* Need to decrease the reference to FCB */
@@ -167,20 +423,21 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream. The reference makes sure that the 
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
-    if(devwrite)
+    /* Only the vectored method can refuse to block */
+    if((fcb->flags & IO_NONBLOCK) && fcb->streamfunc->WriteV) {
+      iovec_t iov = { (void*) buf, size };
+      retcode = fcb->streamfunc->WriteV(sobj, &iov, 1, size, fcb->flags);
+    }
+    else if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
     /* Need to decrease the reference to FCB */
@@ -193,16 +450,213 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/* 
+  Return the total size of an I/O vector, or -1 if it is not legal.
+ */
+static long iovec_size(const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOVEC || (iov == NULL && iovcnt > 0)) return -1;
+
+  long size = 0;
+  for(uint i=0; i<iovcnt; i++) {
+    if(iov[i].base == NULL && iov[i].len > 0) return -1;
+    size += iov[i].len;
+  }
+  return (size > INT_MAX) ? -1 : size;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  long size = iovec_size(iov, iovcnt);
+  if(size < 0) return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL) return -1;
+
+  int retcode = -1;
+  file_ops* ops = fcb->streamfunc;
+  if(ops->ReadV)
+    retcode = ops->ReadV(fcb->streamobj, iov, iovcnt, size, fcb->flags);
+  else if(ops->Read) {
+    /* Without a native method, a single Read is all we can do without blocking */
+    uint i = 0;
+    while(i < iovcnt && iov[i].len == 0) i++;
+    retcode = (i < iovcnt) ? ops->Read(fcb->streamobj, iov[i].base, iov[i].len) : 0;
+  }
+
+  FCB_decref(fcb);
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  long size = iovec_size(iov, iovcnt);
+  if(size < 0) return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL) return -1;
+
+  int retcode = -1;
+  file_ops* ops = fcb->streamfunc;
+  if(ops->WriteV)
+    retcode = ops->WriteV(fcb->streamobj, iov, iovcnt, size, fcb->flags);
+  else if(ops->Write) {
+    /* Write the buffers in turn, up to the first short write */
+    retcode = 0;
+    for(uint i=0; i<iovcnt; i++) {
+      if(iov[i].len == 0) continue;
+      int rc = ops->Write(fcb->streamobj, iov[i].base, iov[i].len);
+      if(rc < 0) { if(retcode == 0) retcode = -1; break; }
+      retcode += rc;
+      if((uint)rc < iov[i].len) break;
+    }
+  }
+
+  FCB_decref(fcb);
+  return retcode;
+}
+
+
+int sys_SetNonBlocking(Fid_t fd, int nonblocking)
+{
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL) return -1;
+
+  if(nonblocking)
+    __atomic_or_fetch(& fcb->flags, IO_NONBLOCK, __ATOMIC_RELAXED);
+  else
+    __atomic_and_fetch(& fcb->flags, ~IO_NONBLOCK, __ATOMIC_RELAXED);
+
+  FCB_decref(fcb);
+  return 0;
+}
+
+
+
+/*
+ *
+ *   Polling
+ *
+ *   Pollers wait on a single condition variable, which is broadcast by 
+ *   poll_notify() whenever a stream that has been polled may have become 
+ *   ready. Because streams report every change after they have been polled,
+ *   a poller that finds poll_events unchanged since its last scan can 
+ *   sleep without missing a wakeup. The lock is also taken by interrupt 
+ *   handlers, so it is only held with preemption off.
+ *
+ */
+
+static Mutex poll_lock = MUTEX_INIT;
+static CondVar poll_cv = COND_INIT;
+static unsigned long poll_events = 0;   /* Count of notifications, protected by poll_lock */
+static uint poll_sleepers = 0;          /* Threads in Poll */
+
+
+void poll_notify()
+{
+  /* Order the change of the stream before the check for pollers */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(& poll_sleepers, __ATOMIC_RELAXED) == 0) return;
+
+  int pre = preempt_off;
+  Mutex_Lock(& poll_lock);
+  poll_events++;
+  kernel_broadcast(& poll_cv);
+  Mutex_Unlock(& poll_lock);
+  if(pre) preempt_on;
+}
+
+
+typedef struct poll_entry {
+  FCB* fcb;
+  int want;
+} poll_entry;
+
+
+/* Store the ready events of each entry in events, and return the number of 
+   entries with some ready event */
+static int poll_scan(poll_entry* pe, int* events, unsigned int n)
+{
+  int ready = 0;
+  for(uint i=0; i<n; i++) {
+    int ev;
+    if(pe[i].fcb == NULL)
+      ev = POLL_INVALID;
+    else {
+      file_ops* ops = pe[i].fcb->streamfunc;
+      ev = ops->Poll ? ops->Poll(pe[i].fcb->streamobj) : (POLL_READABLE|POLL_WRITABLE);
+      ev &= pe[i].want | POLL_HANGUP;
+    }
+    events[i] = ev;
+    if(ev) ready++;
+  }
+  return ready;
+}
+
+
+int sys_Poll(const Fid_t* fids, int* events, unsigned int n, timeout_t timeout)
+{
+  if(n > MAX_FILEID_LIMIT || (n > 0 && (fids == NULL || events == NULL)))
+    return -1;
+
+  /* Hold a reference to each stream, so that it is not closed under us */
+  poll_entry* pe = (poll_entry*) xmalloc((n ? n : 1)*sizeof(poll_entry));
+  for(uint i=0; i<n; i++) {
+    pe[i].fcb = get_fcb_ref(fids[i]);
+    pe[i].want = events[i] & (POLL_READABLE|POLL_WRITABLE);
+  }
+
+  TimerDuration deadline = ((long)timeout < 0) ? NO_TIMEOUT : bios_clock() + 1000*(TimerDuration)timeout;
+
+  /* Announce ourselves before the first scan, so that no change is missed */
+  __atomic_add_fetch(& poll_sleepers, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  int ready;
+  for(;;) {
+    unsigned long seen = __atomic_load_n(& poll_events, __ATOMIC_ACQUIRE);
+
+    ready = poll_scan(pe, events, n);
+    if(ready > 0 || timeout == 0) break;
+
+    TimerDuration now = bios_clock();
+    if(now >= deadline) break;
+
+    int pre = preempt_off;
+    Mutex_Lock(& poll_lock);
+    if(poll_events == seen)
+      kernel_timedwait(& poll_lock, & poll_cv, SCHED_IO, 
+        (deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now);
+    Mutex_Unlock(& poll_lock);
+    if(pre) preempt_on;
+  }
+
+  __atomic_sub_fetch(& poll_sleepers, 1, __ATOMIC_RELAXED);
+
+  for(uint i=0; i<n; i++)
+    if(pe[i].fcb) FCB_decref(pe[i].fcb);
+  free(pe);
+
+  return ready;
+}
+
+
 int sys_Close(int fd)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  if(fd < 0) return -1;
 
-  FCB* fcb = get_fcb(fd);
+  PCB_cold* cur = CURPROC->cold;
+  Mutex_Lock(& cur->fidt_lock);
+  int retcode = ((uint)fd < FIDT_limit(cur->fidt)) ? 0 : -1;  /* Closing a closed fd is legal! */
+  FCB* fcb = NULL;
+  if(FIDT_get(cur->fidt, fd) != NULL)
+    fcb = FIDT_clear(FIDT_writable(cur), fd);
+  Mutex_Unlock(& cur->fidt_lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -214,25 +668,37 @@ int sys_Close(int fd)
   This call returns 0 on success and -1 on failure.
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
+  - newfd is being opened by another thread.
  */
 int sys_Dup2(int oldfd, int newfd)
 {
   int retcode=0;
-  if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
+  if(oldfd<0 || newfd<0)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB_cold* cur = CURPROC->cold;
+  Mutex_Lock(& cur->fidt_lock);
+
+  FCB* old = FIDT_get(cur->fidt, oldfd);
+  FCB* new = FIDT_get(cur->fidt, newfd);
 
-  if(old==NULL) {
+  /* A reserved fid belongs to the thread that is opening it */
+  if(old==NULL || (uint)newfd >= FIDT_limit(cur->fidt) || FIDT_is_reserved(cur->fidt, newfd)) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    FIDT_set(FIDT_writable(cur), newfd, old);
   }
+  else
+    new = NULL;
+
+  Mutex_Unlock(& cur->fidt_lock);
+
+  /* Close the replaced stream outside the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -261,6 +727,7 @@ Fid_t open_stream(Device_type major, unsigned int minor)
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_install(1, &fid, &fcb);
   
   goto finok;
 finerr:
@@ -20,8 +20,16 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
-	and @ref FCB_unreserve.
+	of this file to access FCBs: @ref get_fcb_ref, @ref FCB_reserve,
+	@ref FCB_install and @ref FCB_unreserve.
+
+	A file table grows on demand, up to the file limit of the process
+	(see @c SetFileLimit). A bitmap of the occupied fids is used to find
+	the lowest free fid, and to visit only the open fids of a table.
+
+	@c Exec shares the file table of the parent with the child, in O(1).
+	A shared table is copied the first time one of its processes changes 
+	it, by opening or closing a stream, or by @c Dup2.
 
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
@@ -43,17 +51,45 @@ typedef struct file_control_block
   uint refcount;  			/**< @brief Reference counter. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
-  rlnode freelist_node;		/**< @brief Intrusive list node */
+  int flags;			/**< @brief @c IO_NONBLOCK, or 0 (see @c SetNonBlocking) */
 } FCB;
 
 
+/** @brief The file table of one or more processes.
+
+	The fids of the table are @c 0 to @c size-1. Fid @c i is in use iff bit
+	@c i%64 of @c used[i/64] is set, in which case @c fcb[i] is its stream,
+	or NULL if the fid is reserved (see @ref FCB_reserve).
+	The table holds one reference to each of its streams.
+
+	A process with no open files and the default limit may have no table.
+	A table is protected by the @c fidt_lock of the process that uses it,
+	and it is not modified while it is shared.
+ */
+typedef struct file_id_table
+{
+  uint refcount;      /**< @brief The number of processes sharing the table */
+  FCB** fcb;          /**< @brief The streams, indexed by fid */
+  uint64_t* used;     /**< @brief The bitmap of the open fids */
+  uint size;          /**< @brief The number of fids in the table, a multiple of 64 */
+  uint limit;         /**< @brief The open fids must be less than this */
+  uint reserved;      /**< @brief The number of reserved fids */
+} FIDT;
 
-/** 
-  @brief Initialization for files and streams.
 
-  This function is called at kernel startup.
+/** @brief Share the file table of a process with a new process.
+
+	The new process @c to must not have a file table. This takes O(1) time.
  */
-void initialize_files();
+void FIDT_share(PCB* to, PCB* from);
+
+/** @brief Drop the file table of a process.
+
+	If this was the last process using the table, its open fids are 
+	closed. Only the open fids are visited.
+ */
+void FIDT_release(PCB* pcb);
+
 
 
 /**
@@ -87,8 +123,12 @@ int FCB_decref(FCB* fcb);
    If not, the state is unchanged (but the array contents
    may have been overwritten).
 
+   The fids are reserved, but they are not open yet: other threads 
+   of the process see them as closed. The caller must set the
+   @c streamobj and @c streamfunc of the FCBs, which are NULL, and
+   then publish them by calling @ref FCB_install.
    If these resources are not needed, the operation can be
-   reversed by calling @ref FCB_unreserve.
+   reversed by calling @ref FCB_unreserve instead.
 
    @param num the number of resources to reserve.
    @param fid array of size at least `num` of `Fid_t`.
@@ -98,6 +138,19 @@ int FCB_decref(FCB* fcb);
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Open a number of reserved fids.
+
+   The FCBs reserved by @ref FCB_reserve, once initialized, are put
+   in the file table of the current process, with a reference count
+   of 1. From now on, other threads can use (and close) the fids.
+
+   @param num the number of fids to open.
+   @param fid array of size at least `num` of `Fid_t`.
+   @param fcb array of size at least `num` of `FCB*`.
+*/
+void FCB_install(size_t num, Fid_t *fid, FCB** fcb);
+
+
 /** @brief Release a number of FCBs and corresponding fids.
 
    Given an array of fids of size @ num, this function will 
@@ -109,7 +162,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
    No I/O operation is performed by this function.
 
    This function does not check its arguments for correctness.
-   Use only with arrays filled by a call to @ref FCB_reserve.
+   Use only with arrays filled by a call to @ref FCB_reserve,
+   which have not been passed to @ref FCB_install.
 
    @param num the number of resources to unreserve.
    @param fid array of size at least `num` of `Fid_t`.
@@ -122,12 +176,35 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	The FCB is not protected against a concurrent @c Close of the fid by 
+	another thread of the process. Use @ref get_fcb_ref for that.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, and take a reference to it.
+
+	This routine will return NULL if the fid is not legal, or its FCB has
+	no @c streamfunc. Else, the reference count of the FCB is increased, 
+	so that the stream stays open until the caller calls @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
+/** @brief Wake up the threads in @c Poll, after a stream may have become ready.
+
+	This is cheap when no thread is polling. It may be called from 
+	interrupt handlers, and with the lock of the stream held.
+ */
+void poll_notify();
+
+
 /** @} */
 
 #endif
@@ -2,6 +2,7 @@
 #include "tinyos.h"
 #include "kernel_sys.h"
 #include "kernel_cc.h"
+#include "kernel_sched.h"
 
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
@@ -12,13 +13,14 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
-
+/*
+	There is no global kernel lock around system calls. Each
+	system call locks the kernel objects that it uses.
+ */
+#define PRE_CALL
 
 
-#define POST_CALL \
-kernel_unlock();\
+#define POST_CALL  preempt_point();
 
 
 /* with return */
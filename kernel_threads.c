@@ -11,9 +11,20 @@
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
-  PTCB* ptcb = initialize_ptcb(CURPROC, task, argl, args, start_thread);
+  return sys_CreateThreadEx(task, argl, args, STACK_DEFAULT);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a given stack class.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, stack_class cls)
+{
+  if((unsigned int)cls >= STACK_CLASSES) return NOTHREAD;
+
+  PTCB* ptcb = initialize_ptcb(CURPROC, task, argl, args, start_thread, cls);
+  Tid_t tid = ptcb->tid;
   wakeup(ptcb->tcb);
-  return (Tid_t)ptcb;
+  return tid;
 }
 
 /**
@@ -21,7 +32,39 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) cur_thread()->ptcb;
+	return cur_thread()->ptcb->tid;
+}
+
+/**
+  @brief Set the cores a thread of the current process may run on.
+  */
+int sys_SetThreadAffinity(Tid_t tid, unsigned int mask)
+{
+  PCB* curproc = CURPROC;
+
+  uint ncores = cpu_cores();
+  if(ncores < 8*sizeof(mask)) mask &= (1u << ncores) - 1;
+  if(mask == 0) return -1;
+
+  Mutex_Lock(& curproc->cold->thread_lock);
+  PTCB* ptcb = tid_lookup(curproc, tid);
+  if(ptcb == NULL || ptcb->exited) {
+    Mutex_Unlock(& curproc->cold->thread_lock);
+    return -1;
+  }
+  ptcb->tcb->affinity = mask;
+  Mutex_Unlock(& curproc->cold->thread_lock);
+  return 0;
+}
+
+/**
+  @brief Set the nice value of the current thread.
+  */
+int sys_SetThreadNice(int nice)
+{
+  if(nice < NICE_MIN || nice > NICE_MAX) return -1;
+  cur_thread()->nice = nice;
+  return 0;
 }
 
 /**
@@ -32,27 +75,29 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   if(tid==NOTHREAD){
     return -1;
   }
-  PTCB* ptcb = (PTCB*) tid;
+  PCB* curproc = CURPROC;
+
+  Mutex_Lock(& curproc->cold->thread_lock);
  
- PTCB* check_ptcb = (PTCB *)rlist_find(&CURPROC->ptcb_list, ptcb, NULL);
-  if(check_ptcb == NULL) {
-    return -1;
+  PTCB* ptcb = tid_lookup(curproc, tid);
+  if(ptcb == NULL) {
+    goto fail;
   }
  
-  if(ptcb->tcb ==(Tid_t) cur_thread()) {
-    return -1;
+  if(ptcb == cur_thread()->ptcb) {
+    goto fail;
   }
 
   /*Thread to be joined owned by the same process as 
   the current thread and is not detached */
  ptcb->ref_count++;
  while(ptcb->detached !=1 && ptcb->exited !=1){
-     kernel_wait(&(ptcb->exit_cv), SCHED_USER);  
+     kernel_wait(& curproc->cold->thread_lock, &(ptcb->exit_cv), SCHED_USER);  
  }
  ptcb->ref_count--;
 
  if(ptcb->detached == 1 ){
-   return -1;
+   goto fail;
  }
   //Exit value parsing
   if(ptcb->exited == 1) {
@@ -63,10 +108,16 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 
   if(ptcb->ref_count==0){
     rlist_remove(&ptcb->ptcb_node);
-    free(ptcb);
+    tid_release(curproc, ptcb->tid);
+    release_ptcb(ptcb);
   }
 
+  Mutex_Unlock(& curproc->cold->thread_lock);
   return 0;
+
+fail:
+  Mutex_Unlock(& curproc->cold->thread_lock);
+  return -1;
 }
 
 /**
@@ -74,20 +125,25 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  PTCB* ptcb = (PTCB*)tid;
+  PCB* curproc = CURPROC;
+
+  Mutex_Lock(& curproc->cold->thread_lock);
 
-  PTCB* find_ptcb =(PTCB*)rlist_find(&(CURPROC->ptcb_list),ptcb, NULL);
+  PTCB* ptcb = tid_lookup(curproc, tid);
   
-  if(find_ptcb == NULL /*&& tid!= (Tid_t) cur_thread()*/) {
+  if(ptcb == NULL) {
+    Mutex_Unlock(& curproc->cold->thread_lock);
     return -1;
     }
   if(ptcb->exited == 1 /*&& ptcb->tcb==NULL*/) {
+    Mutex_Unlock(& curproc->cold->thread_lock);
      return -1;
   }
 
   ptcb->detached = 1;
   ptcb->ref_count = 0;
   kernel_broadcast(&(ptcb->exit_cv));
+  Mutex_Unlock(& curproc->cold->thread_lock);
   return 0;
  
 }
@@ -102,43 +158,55 @@ void sys_ThreadExit(int exitval)
   PTCB* ptcb = cur_thread()->ptcb;
 
   assert(ptcb != NULL);
-  ptcb->exitval = exitval;
-  ptcb->exited = 1;
   PCB* curproc = CURPROC;
 
+  Mutex_Lock(& curproc->cold->thread_lock);
+  ptcb->exitval = exitval;
+  ptcb->exited = 1;
 
     kernel_broadcast(&(ptcb->exit_cv));
 
-  curproc->thread_count = curproc->thread_count -1;
+  curproc->cold->thread_count = curproc->cold->thread_count -1;
+  int last_thread = (curproc->cold->thread_count==0);
+  Mutex_Unlock(& curproc->cold->thread_lock);
+
+  /* The process lives on, with its files and arguments, until its last thread exits */
+  if(!last_thread)
+    sleep_releasing(EXITED, NULL, SCHED_USER, NO_TIMEOUT);
+
+  /* Clean up FIDT */
+  FIDT_release(curproc);
+
+  Mutex_Lock(& proc_lock);
 
-  if(curproc->thread_count==0){
+  if(last_thread){
     if(get_pid(curproc) !=1){
     /* Reparent any children of the exiting process to the 
        initial task */
     PCB* initpcb = get_pcb(1);
-    while(!is_rlist_empty(& curproc->children_list)) {
-      rlnode* child = rlist_pop_front(& curproc->children_list);
+    while(!is_rlist_empty(& curproc->cold->children_list)) {
+      rlnode* child = rlist_pop_front(& curproc->cold->children_list);
       child->pcb->parent = initpcb;
-      rlist_push_front(& initpcb->children_list, child);
+      rlist_push_front(& initpcb->cold->children_list, child);
     }
 
     /* Add exited children to the initial task's exited list 
        and signal the initial task */
-    if(!is_rlist_empty(& curproc->exited_list)) {
-      rlist_append(& initpcb->exited_list, &curproc->exited_list);
-      kernel_broadcast(& initpcb->child_exit);
+    if(!is_rlist_empty(& curproc->cold->exited_list)) {
+      rlist_append(& initpcb->cold->exited_list, &curproc->cold->exited_list);
+      kernel_broadcast(& initpcb->cold->child_exit);
     }
 
     /* Put me into my parent's exited list */
-    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-    kernel_broadcast(& curproc->parent->child_exit);
+    rlist_push_front(& curproc->parent->cold->exited_list, &curproc->cold->exited_node);
+    kernel_broadcast(& curproc->parent->cold->child_exit);
 
     }
 
   }
 
-  assert(is_rlist_empty(& curproc->children_list));
-  assert(is_rlist_empty(& curproc->exited_list));
+  assert(is_rlist_empty(& curproc->cold->children_list));
+  assert(is_rlist_empty(& curproc->cold->exited_list));
 
 
   /* 
@@ -146,26 +214,19 @@ void sys_ThreadExit(int exitval)
    */
 
   /* Release the args data */
-  if(curproc->args) {
-    free(curproc->args);
-    curproc->args = NULL;
+  if(curproc->cold->args) {
+    free(curproc->cold->args);
+    curproc->cold->args = NULL;
   }
 
-  /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
+  /* Release the PTCBs, which no thread can join any more */
+  Mutex_Lock(& curproc->cold->thread_lock);
+  while(! is_rlist_empty(& curproc->cold->ptcb_list)) {
+    rlnode* pop_ptcb = rlist_pop_front(& curproc->cold->ptcb_list);
+    release_ptcb(pop_ptcb->ptcb);
   }
-
-  rlnode* pop_ptcb;
-  while(is_rlist_empty(&(CURPROC->ptcb_list)) != 0){
-
-    pop_ptcb = rlist_pop_front(&(CURPROC->ptcb_list));
-
-    free(pop_ptcb);
-   }
+  tid_table_clear(curproc);
+  Mutex_Unlock(& curproc->cold->thread_lock);
 
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
@@ -174,7 +235,7 @@ void sys_ThreadExit(int exitval)
   curproc->pstate = ZOMBIE;
    
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  sleep_releasing(EXITED, & proc_lock, SCHED_USER, NO_TIMEOUT);
 }
 
 
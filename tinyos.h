@@ -45,18 +45,33 @@ typedef unsigned long timeout_t;
 /** @brief The type of a file ID. */
 typedef int Fid_t;  
 
-/** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
+/** @brief The default maximum number of open files per process. 
+   Only values 0 to MAX_FILEID-1 are legal for file descriptors, 
+   unless the limit is changed with @c SetFileLimit(). */
 #define MAX_FILEID 16
 
+/** @brief The largest per-process file limit that @c SetFileLimit() accepts. */
+#define MAX_FILEID_LIMIT 65536
+
+/** @brief The initial buffer size of a pipe created by @c Pipe(). */
 #define PIPE_BUFFER_SIZE 8192
 
+/** @brief The smallest pipe buffer size. Idle pipes shrink back to it. */
+#define PIPE_BUFFER_MIN 1024
+
+/** @brief The largest pipe buffer size. Busy pipes grow up to it. */
+#define PIPE_BUFFER_MAX (1024*1024)
+
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
 
 /**
   @brief The type of a thread ID.
+
+  A thread ID is a handle, valid only in the process of the thread. Once
+  a thread has been joined, its ID is stale: it never refers to another
+  thread, and the system calls given it return an error.
   */
 typedef uintptr_t Tid_t;
 
@@ -321,6 +336,38 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+
+/**
+  @brief The stack size classes of threads.
+
+  Thread stacks are reserved, not committed: a thread only uses memory for 
+  the part of its stack it touches. A class gives the size a stack may grow 
+  to, before the thread crashes.
+  @see CreateThreadEx
+ */
+typedef enum stack_class {
+  STACK_SMALL,      /**< A 32 KB stack, for threads with shallow calls */
+  STACK_DEFAULT,    /**< A 128 KB stack, as with @c CreateThread */
+  STACK_LARGE       /**< A 1 MB stack, for deep recursion or large local arrays */
+} stack_class;
+
+/** @brief The number of stack classes */
+#define STACK_CLASSES 3
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is like @c CreateThread, except that the stack of the new thread
+  has the size of class @c cls.
+
+  @param task a function to execute
+  @param cls the stack class of the thread
+  @returns the Tid of the new thread, or @c NOTHREAD if @c cls is not a
+     valid stack class.
+  @see stack_class
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, stack_class cls);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -377,6 +424,44 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/**
+  @brief Restrict the cores on which a thread may run.
+
+  Bit c of @c mask allows the thread to run on core c. Bits of cores 
+  that do not exist are ignored. The thread moves to an allowed core the
+  next time it is scheduled.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the set of allowed cores
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - @c mask does not contain any existing core.
+  */
+int SetThreadAffinity(Tid_t tid, unsigned int mask);
+
+
+/** @brief The highest priority nice value. */
+#define NICE_MIN (-20)
+
+/** @brief The lowest priority nice value. */
+#define NICE_MAX 19
+
+/**
+  @brief Set the nice value of the current thread.
+
+  Under the "cfs" scheduling policy, a thread receives a share of the CPU
+  proportional to a weight determined by its nice value, from 
+  @c NICE_MIN (largest share) to @c NICE_MAX (smallest share). Each 
+  nice step changes the weight by about 25%. New threads start at nice 0.
+  Other policies ignore the nice value.
+
+  @param nice the new nice value
+  @returns 0 on success, or -1 if @c nice is out of range.
+  */
+int SetThreadNice(int nice);
+
+
 
 /*******************************************
  *
@@ -433,6 +518,8 @@ Fid_t OpenNull();
         Possible errors are:
          - The file descriptor is invalid.
          - There was a I/O runtime problem.
+        If @c fd is non-blocking (see @c SetNonBlocking) and there is no data, 
+        @c WOULD_BLOCK is returned.
  */
 int Read(Fid_t fd, char *buf, unsigned int size);
 
@@ -456,10 +543,113 @@ int Read(Fid_t fd, char *buf, unsigned int size);
    Possible errors are:
    - The file id is invalid.
    - There was a I/O runtime problem.
+   If @c fd is non-blocking (see @c SetNonBlocking) and no data can be 
+   written, @c WOULD_BLOCK is returned.
  */
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief The maximum number of buffers in a call to @c ReadV() or @c WriteV(). */
+#define MAX_IOVEC 1024
+
+/**
+	@brief A buffer, for the vectored I/O calls @c ReadV() and @c WriteV().
+*/
+typedef struct iovec_s {
+	void* base;			/**< The start of the buffer */
+	unsigned int len;	/**< The size of the buffer */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into a number of buffers.
+
+   This is like @c Read(), but the data is scattered to the buffers of
+   @c iov, in order, each one filled before the next. For pipes and 
+   sockets, this is done with a single wait for data; other streams may 
+   fill just the first non-empty buffer.
+
+  @param fd  the file ID of the stream to read from
+  @param iov the buffers to receive the data
+  @param iovcnt the number of buffers in @c iov, at most @c MAX_IOVEC
+  @return the number of bytes copied, 0 if we have reached EOF, or -1, indicating some error.
+        Possible errors are:
+         - The file descriptor is invalid.
+         - There are more than @c MAX_IOVEC buffers, or more than @c INT_MAX bytes in total.
+         - There was a I/O runtime problem.
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from a number of buffers.
+
+   This is like @c Write(), but the data is gathered from the buffers 
+   of @c iov, in order. For pipes and sockets, this is done with a single
+   wait for space, and the bytes of a call are never interleaved with 
+   those of other writers. 
+
+  @param fd  the file ID of the stream to write to
+  @param iov the buffers holding the data
+  @param iovcnt the number of buffers in @c iov, at most @c MAX_IOVEC
+  @return the number of bytes copied, or -1, indicating some error.
+        Possible errors are:
+         - The file descriptor is invalid.
+         - There are more than @c MAX_IOVEC buffers, or more than @c INT_MAX bytes in total.
+         - There was a I/O runtime problem.
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Returned instead of blocking, by I/O calls on a non-blocking file id. */
+#define WOULD_BLOCK (-2)
+
+/** @brief Make a file id non-blocking, or blocking again.
+
+  When a file id is non-blocking, the calls @c Read(), @c Write(), 
+  @c ReadV(), @c WriteV() and @c Accept() return @c WOULD_BLOCK, instead 
+  of blocking. This applies to pipes, sockets and terminals. The flag
+  belongs to the stream, so it is shared by the copies of the file id 
+  made by @c Dup2() and @c Exec().
+  File ids are blocking when they are opened. 
+
+  @param fd the file id
+  @param nonblocking 1 to make the file id non-blocking, 0 to make it blocking
+  @return 0 on success, or -1 if the file id is invalid.
+ */
+int SetNonBlocking(Fid_t fd, int nonblocking);
+
+
+/** @brief A @c Poll() event: reading from the stream (or accepting from the listener) will not block. */
+#define POLL_READABLE 1
+/** @brief A @c Poll() event: writing to the stream will not block. */
+#define POLL_WRITABLE 2
+/** @brief A @c Poll() event: the other end of the stream is closed. This is always reported. */
+#define POLL_HANGUP   4
+/** @brief A @c Poll() event: the file id is not open. This is always reported. */
+#define POLL_INVALID  8
+
+/** @brief Wait until some of a number of streams are ready.
+
+  This allows a single thread to serve many streams. On entry, 
+  @c events[i] holds the events of interest (@c POLL_READABLE and/or @c POLL_WRITABLE)
+  for file id @c fids[i]. On return, it holds the events of @c fids[i] that 
+  were ready, including @c POLL_HANGUP and @c POLL_INVALID. 
+
+  The call returns as soon as an event is ready, or when the timeout 
+  expires. The resolution of the timeout is as for @c Connect(). A timeout 
+  of 0 does not wait, and a negative timeout never expires.
+
+  @param fids the file ids to poll
+  @param events the events of interest, and then the events that are ready
+  @param n the number of file ids, at most @c MAX_FILEID_LIMIT
+  @param timeout the maximum time to wait, in msec
+  @return the number of file ids with ready events, 0 if the timeout 
+     expired, or -1 on error. Possible reasons for error:
+     - @c n is too large.
+     - @c fids or @c events is NULL.
+ */
+int Poll(const Fid_t* fids, int* events, unsigned int n, timeout_t timeout);
+
+
 /** @brief Close a file id.
    
 
@@ -491,6 +681,23 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Set the maximum number of open files of the process.
+
+  After the call, only values 0 to @c limit-1 are legal for file 
+  descriptors of the process. The limit is @c MAX_FILEID initially,
+  and it is inherited by the children created by @c Exec().
+  The file table of a process grows as needed, so a large limit
+  costs nothing until the file ids are used.
+
+  @param limit the new limit, from 1 to @c MAX_FILEID_LIMIT.
+  @return This call returns 0 on success and -1 on failure.
+  Possible reasons for failure:
+  - The limit is 0 or larger than @c MAX_FILEID_LIMIT.
+  - A file id at or above the limit is open.
+ */
+int SetFileLimit(unsigned int limit);
+
 /*******************************************
  *
  * Pipes
@@ -533,6 +740,71 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/**
+	@brief Construct and return a pipe with a fixed buffer size.
+
+	This is like @c Pipe(), but the buffer of the new pipe has a fixed 
+	capacity of at least @c size bytes, which does not change adaptively.
+	If @c size is 0, this is the same as @c Pipe().
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param size the requested capacity of the pipe buffer.
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+		- @c size is larger than @c PIPE_BUFFER_MAX.
+	@see SetPipeSize
+*/
+int PipeEx(pipe_t* pipe, unsigned int size);
+
+
+/**
+	@brief Change the buffer size of a pipe.
+
+	By default, the buffer of a pipe adapts to its traffic: it grows 
+	(up to @c PIPE_BUFFER_MAX bytes) when writers keep finding it full, and
+	shrinks back (down to @c PIPE_BUFFER_MIN bytes) when the readers drain 
+	it and it was mostly unused. This call fixes the capacity of the buffer 
+	to @c size bytes, rounded up to a power of two and to at least 
+	@c PIPE_BUFFER_MIN bytes. The data in the pipe is preserved. A @c size
+	of 0 returns the pipe to the adaptive policy.
+
+	This is similar to the @c F_SETPIPE_SZ operation of Linux.
+
+	@param fd a file id for either end of the pipe.
+	@param size the requested capacity, or 0.
+	@returns the new capacity of the pipe buffer, or -1 on error. Possible 
+		reasons for error:
+		- @c fd is not an open file id for a pipe.
+		- @c size is larger than @c PIPE_BUFFER_MAX.
+		- the pipe currently holds more than @c size bytes.
+*/
+int SetPipeSize(Fid_t fd, unsigned int size);
+
+
+/**
+	@brief Move data from one stream to another, without copying it to user space.
+
+	This call reads up to @c size bytes from the stream @c in and writes them 
+	to the stream @c out, copying the data directly between the kernel buffers.
+	The stream @c in must be the read end of a pipe or a connected socket, and 
+	the stream @c out must be the write end of a pipe or a connected socket.
+
+	Like @c Read(), the call blocks until there is some data in @c in, and like
+	@c Write(), it blocks until there is some space in @c out. It returns after
+	moving as many bytes as it can at once, which may be fewer than @c size.
+
+	@param in the file id to read from.
+	@param out the file id to write to.
+	@param size the maximum number of bytes to move.
+	@returns the number of bytes moved, 0 if @c in has reached the end of its
+		data (or @c size is 0), or -1 on error. Possible reasons for error:
+		- @c in or @c out is not an open file id of the right kind of stream.
+		- @c in and @c out are the two ends of the same pipe.
+		- the read end of @c out is closed.
+*/
+int Splice(Fid_t in, Fid_t out, unsigned int size);
+
 /*******************************************
  *
  * Sockets (local)
@@ -615,6 +887,8 @@ int Listen(Fid_t sock);
 		- the file id is not initialized by @c Listen()
 		- the available file ids for the process are exhausted
 		- while waiting, the listening socket @c lsock was closed
+		If @c lsock is non-blocking (see @c SetNonBlocking) and there is no 
+		request, @c WOULD_BLOCK is returned.
 
 	@see Connect
 	@see Listen
@@ -738,6 +1012,9 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  unsigned long stack_rss; /**< @brief The bytes of the stacks of the threads of the 
+    process that are resident in memory. */
 } procinfo;
 
 
@@ -783,6 +1060,50 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief Select the scheduling policy for subsequent calls to @c boot().
+
+   The available policies are
+   - "mlfq": a multi-level feedback queue (the default),
+   - "rr": plain round-robin,
+   - "fair": fair-share among processes,
+   - "cfs": fair-share among threads by virtual runtime, weighted by 
+     the nice value of each thread (see @c SetThreadNice()).
+
+   If no policy has been selected, @c boot() uses the policy named in the 
+   environment variable @c TINYOS_SCHED, if set, or else the default. 
+   A NULL @c name returns to this behaviour.
+
+   @param name the name of the policy, or NULL.
+   @returns 0 on success, or -1 if there is no policy with this name.
+   */
+int boot_sched_policy(const char* name);
+
+
+/** @brief Set the high-water mark of the thread pool for subsequent calls to @c boot().
+
+   The kernel recycles the memory of exited threads (the thread control block 
+   and the stack) for new threads. Each core keeps a few recycled blocks, and 
+   a global depot keeps up to @c limit more; beyond these, the memory is 
+   returned to the system. A @c limit of 0 disables recycling. 
+   The default is 64.
+
+   @param limit the maximum number of blocks in the depot.
+   */
+void boot_thread_pool(unsigned int limit);
+
+
+/** @brief Enable or disable the kernel object caches for subsequent calls to @c boot().
+
+   The kernel allocates its control blocks (for threads, pipes, sockets etc.)
+   from per-type caches, which keep freed objects ready for reuse on each core.
+   With the caches disabled, each control block is allocated and freed 
+   individually. The default is enabled.
+
+   @param enabled 1 to enable the caches, 0 to disable them.
+   */
+void boot_kmem_caches(int enabled);
+
+
 /** @} */
 
 #endif
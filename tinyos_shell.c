@@ -172,8 +172,8 @@ int SystemInfo(size_t argc, const char** argv)
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
 		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		printf("%5s %5s %6s %8s %9s %20s\n",
+			"PID", "PPID", "State", "Threads", "Stack KB", "Main program"
 			);
 		/* Read in next piece of info */		
 		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
@@ -189,11 +189,12 @@ int SystemInfo(size_t argc, const char** argv)
 				if(info.pid==1) pname = "init";
 			}
 
-			printf("%5d %5d %6s %8u %20s\n",
+			printf("%5d %5d %6s %8lu %9lu %20s\n",
 				info.pid,
 				info.ppid,
 				(info.alive?"ALIVE":"ZOMBIE"),
 				info.thread_count,
+				info.stack_rss / 1024,
 				pname
 				);
 		}
@@ -620,16 +621,30 @@ static void log_truncate(void* __globals)
 
 
 
-/* Helper to receive a message */
-static int recv_message(Fid_t sock, void* buf, size_t len)
+/* Skip the first n bytes of an I/O vector, returning the rest of it */
+static iovec_t* iov_skip(iovec_t* iov, unsigned int* iovcnt, size_t n)
 {
-	size_t count = 0;
-	while(count<len) {
-		int rc = Read(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or end of stream */
-		count += rc;
+	while(*iovcnt > 0 && n >= iov->len) {
+		n -= iov->len;
+		iov++;
+		(*iovcnt)--;
+	}
+	if(*iovcnt > 0) {
+		iov->base = (char*)iov->base + n;
+		iov->len -= n;
+	}
+	return iov;
+}
+
+/* Helper to receive a message, filling the buffers of an I/O vector */
+static int recv_message(Fid_t sock, iovec_t* iov, unsigned int iovcnt)
+{
+	while(iovcnt > 0) {
+		int rc = ReadV(sock, iov, iovcnt);
+		if(rc<1) return 0;  /* Error or end of stream */
+		iov = iov_skip(iov, &iovcnt, rc);
 	}
-	return count==len;
+	return 1;
 }
 
 /* Helper to execute a remote process */
@@ -674,7 +689,8 @@ static int rsrv_client(int sock, void* __globals)
 	   the subsequent message args.
 	 */
 	int argl;
-	if(! recv_message(sock, &argl, sizeof(argl))) {
+	iovec_t header = { &argl, sizeof(argl) };
+	if(! recv_message(sock, &header, 1)) {
 		log_message(__globals,
 			    "Cliend[%6zu]: error in receiving request, aborting", ID);
 		goto finish;
@@ -683,7 +699,8 @@ static int rsrv_client(int sock, void* __globals)
 	assert(argl>0 && argl <= 2048);
 	{
 		char args[argl];
-		if(! recv_message(sock, args, argl)) {
+		iovec_t body = { args, argl };
+		if(! recv_message(sock, &body, 1)) {
 			log_message(__globals,
 				    "Cliend[%6zu]: error in receiving request, aborting", ID);
 			goto finish;		
@@ -721,16 +738,17 @@ finish:
 ************************/
 
 /* helper for RemoteClient */
-static void send_message(Fid_t sock, void* buf, size_t len)
+static void send_message(Fid_t sock, iovec_t* iov, unsigned int iovcnt)
 {
 	size_t count = 0;
-	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
+	while(iovcnt > 0) {
+		int rc = WriteV(sock, iov, iovcnt);
 		if(rc<1) break;  /* Error or End of stream */
 		count += rc;
+		iov = iov_skip(iov, &iovcnt, rc);
 	}
-	if(count!=len) {
-		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
+	if(iovcnt > 0) {
+		printf("In client: I/O error writing message (%zu bytes written)\n", count);
 		Exit(1);
 	}
 }
@@ -754,9 +772,9 @@ int RemoteClient(size_t argc, const char** argv)
 	char args[argl];
 	argvpack(args, argc-1, argv+1);
 
-	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
-	send_message(sock, args, argl);
+	/* Send the length and the message with one call */
+	iovec_t msg[2] = { { &argl, sizeof(argl) }, { args, argl } };
+	send_message(sock, msg, 2);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
 	/* Read the server data and display */
@@ -545,6 +545,50 @@ BOOT_TEST(test_close_error_on_invalid_fid,
 	return 0;
 }
 
+BOOT_TEST(test_file_limit,
+	"Test that SetFileLimit allows thousands of open files, that the lowest\n"
+	"free fid is always given, and that children inherit the file table."
+	)
+{
+	const uint N = 5000;
+
+	ASSERT(SetFileLimit(0)==-1);
+	ASSERT(SetFileLimit(MAX_FILEID_LIMIT+1)==-1);
+	for(Fid_t f=0; f<MAX_FILEID; f++)
+		ASSERT(OpenNull()==f);
+	ASSERT(OpenNull()==NOFILE);
+
+	ASSERT(SetFileLimit(N)==0);
+	for(Fid_t f=MAX_FILEID; f<N; f++)
+		ASSERT(OpenNull()==f);
+	ASSERT(OpenNull()==NOFILE);
+	ASSERT(Dup2(0, N)==-1);
+
+	ASSERT(Close(1234)==0);
+	ASSERT(Close(77)==0);
+	ASSERT(OpenNull()==77);
+	ASSERT(OpenNull()==1234);
+
+	int child(int argl, void* args)
+	{
+		ASSERT(Write(N-1, "x", 1)==1);
+		ASSERT(OpenNull()==NOFILE);
+		ASSERT(Close(N-1)==0);
+		ASSERT(OpenNull()==N-1);
+		return 0;
+	}
+	ASSERT(WaitChild(Exec(child, 0, NULL), NULL)!=NOPROC);
+
+	/* The limit cannot strand open fids */
+	ASSERT(SetFileLimit(100)==-1);
+	for(Fid_t f=100; f<N; f++)
+		ASSERT(Close(f)==0);
+	ASSERT(SetFileLimit(100)==0);
+	ASSERT(Close(100)==-1);
+	ASSERT(OpenNull()==NOFILE);
+	return 0;
+}
+
 BOOT_TEST(test_close_success_on_valid_nonfile_fid,
 	"Test that Close returns success on valid fid, even if there is no\n"
 	"open file for this id."
@@ -730,6 +774,83 @@ BOOT_TEST(test_child_inherits_files,
 
 
 
+BOOT_TEST(test_child_file_changes_are_private,
+	"Test that a child which closes and duplicates inherited files does not\n"
+	"change the files of its parent, and vice versa."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	int child(int argl, void* args)
+	{
+		ASSERT(Close(p.read)==0);
+		ASSERT(Dup2(p.write, 7)==0);
+		ASSERT(Write(7, "hi", 2)==2);
+		ASSERT(Close(7)==0);
+		ASSERT(Write(p.write, "!", 1)==1);
+		return 0;
+	}
+
+	Pid_t cpid = Exec(child, 0, NULL);
+	ASSERT(cpid!=NOPROC);
+	ASSERT(OpenNull()==2);
+	ASSERT(WaitChild(cpid, NULL)==cpid);
+
+	char buf[4];
+	ASSERT(Write(7, "x", 1)==-1);
+	ASSERT(Read(p.read, buf, 3)==3);
+	ASSERT(memcmp(buf, "hi!", 3)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Read(p.read, buf, 3)==0);
+	return 0;
+}
+
+BOOT_TEST(test_open_races_with_close,
+	"Test that a thread which opens streams can race with threads of the same\n"
+	"process that poll and close its fids, or that exec children."
+	)
+{
+	int done = 0;
+
+	int opener(int argl, void* args)
+	{
+		for(int i=0; i<2000; i++) {
+			pipe_t p;
+			ASSERT(Pipe(&p)==0);
+			Close(p.read);
+			Close(p.write);
+		}
+		done = 1;
+		return 0;
+	}
+
+	int meddler(int argl, void* args)
+	{
+		while(! done)
+			for(Fid_t f=0; f<4; f++) {
+				int ev = POLL_READABLE|POLL_WRITABLE;
+				Poll(&f, &ev, 1, 0);
+				Close(f);
+			}
+		return 0;
+	}
+
+	int child(int argl, void* args) { return 0; }
+
+	Tid_t t1 = CreateThread(opener, 0, NULL);
+	Tid_t t2 = CreateThread(meddler, 0, NULL);
+	while(! done) {
+		Pid_t cpid = Exec(child, 0, NULL);
+		ASSERT(cpid!=NOPROC);
+		ASSERT(WaitChild(cpid, NULL)==cpid);
+	}
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_null_device,
 	"Test the null device."
 	)
@@ -892,6 +1013,7 @@ TEST_SUITE(basic_tests,
 	&test_dup2_error_on_invalid_fid,
 	&test_dup2_copies_file,
 	&test_close_error_on_invalid_fid,
+	&test_file_limit,
 	&test_close_success_on_valid_nonfile_fid,
 	&test_close_terminals,
 	&test_read_kbd,
@@ -903,6 +1025,8 @@ TEST_SUITE(basic_tests,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
 	&test_child_inherits_files,
+	&test_child_file_changes_are_private,
+	&test_open_races_with_close,
 	NULL
 };
 
@@ -1025,6 +1149,38 @@ BOOT_TEST(test_create_join_thread,
 	return 0;
 }
 
+BOOT_TEST(test_stale_tid_gives_error,
+	"Test that the Tid of a joined thread stays invalid, even after new threads\n"
+	"are created in its place."
+	)
+{
+	int task(int argl, void* args) {
+		return argl;
+	}
+
+	Tid_t t = CreateThread(task, 0, NULL);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* The new threads may reuse the resources of the joined one */
+	Tid_t u[8];
+	for(int i=0; i<8; i++) {
+		u[i] = CreateThread(task, i, NULL);
+		ASSERT(u[i] != NOTHREAD && u[i] != t);
+	}
+
+	ASSERT(ThreadJoin(t, NULL)==-1);
+	ASSERT(ThreadDetach(t)==-1);
+	ASSERT(SetThreadAffinity(t, ~0u)==-1);
+
+	for(int i=0; i<8; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(u[i], &exitval)==0);
+		ASSERT(exitval==i);
+	}
+	return 0;
+}
+
 BOOT_TEST(test_detach_self,
 	"Test that a thread can detach itself")//3
 {
@@ -1338,6 +1494,362 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+/*
+	A thread that sleeps on a condition variable with a timeout, and 
+	checks that it did not wake up early.
+ */
+struct timed_sleeper {
+	Mutex* mx;
+	CondVar* cv;
+	timeout_t t;
+	int status;
+};
+
+int timed_sleeper(int argl, void* args)
+{
+	struct timed_sleeper* s = args;
+	struct timespec t1, t2;
+
+	clock_gettime(CLOCK_REALTIME, &t1);
+	Mutex_Lock(s->mx);
+	int signalled = Cond_TimedWait(s->mx, s->cv, s->t);
+	Mutex_Unlock(s->mx);
+	clock_gettime(CLOCK_REALTIME, &t2);
+
+	long Dt = 1000l*(t2.tv_sec-t1.tv_sec) + (t2.tv_nsec-t1.tv_nsec)/1000000l;
+
+	/* Allow for the granularity of the coarse system clock */
+	s->status = (!signalled && Dt+10 >= (long)s->t) ? 1 : -1;
+	return 0;
+}
+
+BOOT_TEST(test_many_timed_sleepers,
+	"Test that 10000 threads sleeping concurrently with a timeout all wake up,\n"
+	"and none of them before its timeout.",
+	.timeout = 120
+	)
+{
+	const int N = 10000;
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	struct timed_sleeper* S = xmalloc(N*sizeof(struct timed_sleeper));
+	Tid_t* tids = xmalloc(N*sizeof(Tid_t));
+
+	for(int i=0; i<N; i++) {
+		S[i] = (struct timed_sleeper){ .mx = &mx, .cv = &cv, .t = 50 + (7*i) % 450, .status = 0 };
+		tids[i] = CreateThread(timed_sleeper, 0, &S[i]);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+
+	for(int i=0; i<N; i++)
+		ThreadJoin(tids[i], NULL);
+
+	for(int i=0; i<N; i++)
+		ASSERT_MSG(S[i].status == 1, "sleeper %d with timeout %lu failed\n", i, S[i].t);
+
+	free(tids);
+	free(S);
+	return 0;
+}
+
+
+/*
+	A thread that alternates between computing and sleeping.
+ */
+int sched_policy_worker(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	volatile unsigned int sum = 0;
+
+	for(int i=0; i<50; i++) {
+		for(int j=0; j<10000; j++) sum += j;
+		if(i % 10 == 0) {
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, 1);
+			Mutex_Unlock(&mx);
+		}
+	}
+	return argl;
+}
+
+static int sched_policy_ok;
+
+int sched_policy_nice_worker(int argl, void* args)
+{
+	if(SetThreadNice(argl) != 0) return -1;
+	return sched_policy_worker(argl, args);
+}
+
+int sched_policy_boot(int argl, void* args)
+{
+	const int N = 8;
+	Tid_t tids[N];
+
+	if(SetThreadNice(NICE_MIN-1) != -1 || SetThreadNice(NICE_MAX+1) != -1) return 0;
+
+	/* Spread the nice values over the whole range */
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(sched_policy_nice_worker, NICE_MIN + i*(NICE_MAX-NICE_MIN)/(N-1), NULL);
+	for(int i=0; i<N; i++) {
+		int retval;
+		if(ThreadJoin(tids[i], &retval) != 0 || retval != NICE_MIN + i*(NICE_MAX-NICE_MIN)/(N-1)) return 0;
+	}
+
+	for(int i=0; i<N; i++)
+		if(Exec(sched_policy_worker, i, NULL) == NOPROC) return 0;
+	for(int i=0; i<N; i++) {
+		int status;
+		if(WaitChild(NOPROC, &status) == NOPROC) return 0;
+	}
+
+	sched_policy_ok = 1;
+	return 0;
+}
+
+BARE_TEST(test_sched_policies,
+	"Test that every scheduling policy can be selected at boot, and runs\n"
+	"threads and processes that compute and sleep to completion, with\n"
+	"any nice value."
+	)
+{
+	const char* policies[] = { "mlfq", "rr", "fair", "cfs" };
+
+	for(int p=0; p<4; p++) {
+		ASSERT(boot_sched_policy(policies[p]) == 0);
+		for(uint ncores=1; ncores<=2; ncores++) {
+			sched_policy_ok = 0;
+			boot(ncores, 0, sched_policy_boot, 0, NULL);
+			ASSERT_MSG(sched_policy_ok, "policy %s failed on %u cores\n", policies[p], ncores);
+		}
+	}
+
+	ASSERT(boot_sched_policy("nosuch") == -1);
+	ASSERT(boot_sched_policy(NULL) == 0);
+}
+
+
+/*
+	The core of the calling thread. This is not inlined, so that the 
+	thread pointer is read again after a thread moves to another core.
+ */
+static __attribute__((noinline)) unsigned int current_core()
+{
+	return cpu_core_id;
+}
+
+/*
+	A thread that pins itself to the core given in argl, and records the 
+	cores it runs on while it computes and sleeps.
+ */
+int pinned_worker(int argl, void* args)
+{
+	unsigned int* seen = args;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	volatile unsigned int sum = 0;
+
+	if(SetThreadAffinity(ThreadSelf(), 1u << argl) != 0) return -1;
+
+	/* Sleep, so that the new affinity takes effect */
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+
+	for(int i=0; i<20; i++) {
+		for(int j=0; j<100000; j++) sum += j;
+		*seen |= 1u << current_core();
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 1);
+		Mutex_Unlock(&mx);
+		*seen |= 1u << current_core();
+	}
+	return 0;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that SetThreadAffinity checks its arguments, and that a thread only\n"
+	"runs on the cores allowed by its affinity.",
+	.minimum_cores = 2
+	)
+{
+	ASSERT(SetThreadAffinity(NOTHREAD, 1) == -1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 0) == -1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1u << cpu_cores()) == -1);
+
+	unsigned int seen[2] = { 0, 0 };
+	Tid_t t0 = CreateThread(pinned_worker, 0, &seen[0]);
+	Tid_t t1 = CreateThread(pinned_worker, cpu_cores()-1, &seen[1]);
+	int rv0, rv1;
+	ASSERT(ThreadJoin(t0, &rv0) == 0 && rv0 == 0);
+	ASSERT(ThreadJoin(t1, &rv1) == 0 && rv1 == 0);
+	ASSERT(seen[0] == 1u);
+	ASSERT(seen[1] == 1u << (cpu_cores()-1));
+	return 0;
+}
+
+/*
+	A sleeper, woken up by a CPU-bound process, measures the latency
+	until it runs.
+ */
+#define PREEMPT_TEST_WAKEUPS 50
+
+static Mutex preempt_mx = MUTEX_INIT;
+static CondVar preempt_cv = COND_INIT;
+static volatile int preempt_flag;
+static double preempt_stamp, preempt_latency;
+
+static double preempt_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1E-9*t.tv_nsec;
+}
+
+int preempt_sleeper(int argl, void* args)
+{
+	Mutex_Lock(&preempt_mx);
+	for(int i=0; i<PREEMPT_TEST_WAKEUPS; i++) {
+		while(! preempt_flag)
+			Cond_Wait(&preempt_mx, &preempt_cv);
+		preempt_flag = 0;
+		preempt_latency += preempt_now() - preempt_stamp;
+	}
+	Mutex_Unlock(&preempt_mx);
+	return 0;
+}
+
+int preempt_hog(int argl, void* args)
+{
+	/* Compute for a while, so that the sleeper is more urgent */
+	double next = preempt_now() + 0.05;
+	for(int i=0; i<PREEMPT_TEST_WAKEUPS; i++) {
+		while(preempt_now() < next || preempt_flag)
+			fibo(10);
+		next = preempt_now() + 0.002;
+
+		Mutex_Lock(&preempt_mx);
+		preempt_flag = 1;
+		preempt_stamp = preempt_now();
+		Cond_Signal(&preempt_cv);
+		Mutex_Unlock(&preempt_mx);
+	}
+	return 0;
+}
+
+int preempt_boot(int argl, void* args)
+{
+	Tid_t sleeper = CreateThread(preempt_sleeper, 0, NULL);
+	Exec(preempt_hog, 0, NULL);
+	WaitChild(NOPROC, NULL);
+	ThreadJoin(sleeper, NULL);
+	return 0;
+}
+
+BARE_TEST(test_wakeup_preemption,
+	"Test that, under the \"mlfq\", \"fair\" and \"cfs\" policies, a thread woken\n"
+	"up by a CPU-bound process preempts it, instead of waiting for its quantum to expire."
+	)
+{
+	const char* policies[] = { "mlfq", "fair", "cfs" };
+
+	for(int p=0; p<3; p++) {
+		ASSERT(boot_sched_policy(policies[p]) == 0);
+		preempt_flag = 0;
+		preempt_latency = 0.0;
+		boot(1, 0, preempt_boot, 0, NULL);
+		/* Without preemption, the average would be about half a quantum (5 msec) */
+		double avg = preempt_latency / PREEMPT_TEST_WAKEUPS;
+		ASSERT_MSG(avg < 0.001, "policy %s: average wakeup latency %.1f usec\n", policies[p], 1E6*avg);
+	}
+	ASSERT(boot_sched_policy(NULL) == 0);
+}
+
+
+/* Use about kb KB of stack */
+static __attribute__((noinline)) int stack_user(int kb)
+{
+	volatile char frame[1000];
+	frame[kb % 1000] = 1;
+	return (kb > 1 ? stack_user(kb-1) : 0) + frame[kb % 1000];
+}
+
+int stack_worker(int argl, void* args)
+{
+	return stack_user(argl);
+}
+
+static Mutex stack_mx = MUTEX_INIT;
+static CondVar stack_cv = COND_INIT;
+static int stack_release;
+
+int stack_sleeper(int argl, void* args)
+{
+	stack_user(4);
+	Mutex_Lock(&stack_mx);
+	while(! stack_release)
+		Cond_Wait(&stack_mx, &stack_cv);
+	Mutex_Unlock(&stack_mx);
+	return 0;
+}
+
+/* The stack_rss of the current process, from the info stream */
+static unsigned long my_stack_rss()
+{
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+	procinfo info;
+	unsigned long rss = 0;
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0)
+		if(info.pid == GetPid()) rss = info.stack_rss;
+	Close(finfo);
+	return rss;
+}
+
+BOOT_TEST(test_create_thread_ex,
+	"Test that threads can be created with each stack class, use the stack\n"
+	"of their class, and that the info stream reports the resident stack\n"
+	"memory, which is much less than the reserved stack size, also when the\n"
+	"stacks are recycled from threads that used them deeply."
+	)
+{
+	ASSERT(CreateThreadEx(stack_worker, 1, NULL, STACK_CLASSES) == NOTHREAD);
+	ASSERT(CreateThreadEx(stack_worker, 1, NULL, (stack_class)-1) == NOTHREAD);
+
+	const int depth[STACK_CLASSES] = { [STACK_SMALL]=16, [STACK_DEFAULT]=64, [STACK_LARGE]=512 };
+	for(int cls=0; cls<STACK_CLASSES; cls++) {
+		Tid_t t = CreateThreadEx(stack_worker, depth[cls], NULL, cls);
+		ASSERT(t != NOTHREAD);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval) == 0);
+		ASSERT(exitval == depth[cls]);
+	}
+
+	const int N = 8;
+	Tid_t tids[N];
+	stack_release = 0;
+	for(int i=0; i<N; i++) 
+		ASSERT((tids[i] = CreateThreadEx(stack_sleeper, 0, NULL, STACK_LARGE)) != NOTHREAD);
+
+	/* The sleepers use a few KB each, although one of them may recycle 
+	   the stack of the deep STACK_LARGE worker above */
+	unsigned long rss = my_stack_rss();
+	ASSERT(rss > 0);
+	ASSERT_MSG(rss < N*64*1024, "stack rss = %lu\n", rss);
+
+	Mutex_Lock(&stack_mx);
+	stack_release = 1;
+	Cond_Broadcast(&stack_cv);
+	Mutex_Unlock(&stack_mx);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+
+	return 0;
+}
+
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)//13
@@ -1351,11 +1863,17 @@ TEST_SUITE(thread_tests,
 	&test_detach_main_thread,
 	&test_detach_after_join,
 	&test_create_join_thread,
+	&test_stale_tid_gives_error,
 	&test_join_many_threads,
 	&test_exit_many_threads,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_many_timed_sleepers,
+	&test_sched_policies,
+	&test_thread_affinity,
+	&test_wakeup_preemption,
+	&test_create_thread_ex,
 	NULL
 };
 
@@ -1478,6 +1996,232 @@ BOOT_TEST(test_pipe_close_writer,
 }
 
 
+BOOT_TEST(test_pipe_set_size,
+	"Test that PipeEx and SetPipeSize set the capacity of a pipe, keeping its data."
+	)
+{
+	pipe_t pipe;
+	static char wbuf[4096], rbuf[4096];
+	for(int i=0;i<4096;i++) wbuf[i] = i;
+
+	ASSERT(PipeEx(&pipe, PIPE_BUFFER_MAX+1)==-1);
+	ASSERT(PipeEx(&pipe, 100)==0);
+
+	/* The capacity is rounded up to PIPE_BUFFER_MIN */
+	ASSERT(Write(pipe.write, wbuf, 4096)==PIPE_BUFFER_MIN);
+	ASSERT(SetPipeSize(pipe.read, 1)==PIPE_BUFFER_MIN);
+
+	/* Grow with data in the pipe */
+	ASSERT(SetPipeSize(pipe.write, 3000)==4096);
+	ASSERT(Write(pipe.write, wbuf+PIPE_BUFFER_MIN, 4096)==4096-PIPE_BUFFER_MIN);
+
+	/* Cannot shrink below the data */
+	ASSERT(SetPipeSize(pipe.read, 2048)==-1);
+	ASSERT(SetPipeSize(pipe.read, PIPE_BUFFER_MAX+1)==-1);
+
+	ASSERT(Read(pipe.read, rbuf, 4096)==4096);
+	ASSERT(memcmp(wbuf, rbuf, 4096)==0);
+
+	/* Back to adaptive sizing */
+	ASSERT(SetPipeSize(pipe.read, 0)==4096);
+
+	/* Not a pipe */
+	Fid_t fid = OpenNull();
+	ASSERT(SetPipeSize(fid, 4096)==-1);
+	ASSERT(SetPipeSize(MAX_FILEID, 4096)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_readv_writev,
+	"Test that WriteV gathers, and ReadV scatters, the data of a pipe, also\n"
+	"when the ring buffer wraps around, and that they check their arguments."
+	)
+{
+	pipe_t pipe;
+	char a[] = "Hello ", b[] = "vectored ", c[] = "world";
+	char r1[4], r2[100], r3[16];
+	iovec_t wv[4] = { {a, 6}, {NULL, 0}, {b, 9}, {c, 5} };
+	iovec_t rv[3] = { {r1, 4}, {r2, 10}, {r3, 16} };
+
+	ASSERT(PipeEx(&pipe, PIPE_BUFFER_MIN)==0);
+
+	/* Make the ring wrap around */
+	static char fill[PIPE_BUFFER_MIN-8];
+	ASSERT(Write(pipe.write, fill, sizeof(fill))==sizeof(fill));
+	ASSERT(Read(pipe.read, fill, sizeof(fill))==sizeof(fill));
+
+	ASSERT(WriteV(pipe.write, wv, 4)==20);
+	ASSERT(ReadV(pipe.read, rv, 3)==20);
+	ASSERT(memcmp(r1, "Hell", 4)==0);
+	ASSERT(memcmp(r2, "o vectored", 10)==0);
+	ASSERT(memcmp(r3, " world", 6)==0);
+
+	/* Bad arguments */
+	ASSERT(ReadV(pipe.write, rv, 3)==-1);
+	ASSERT(WriteV(pipe.read, wv, 4)==-1);
+	ASSERT(ReadV(NOFILE, rv, 3)==-1);
+	ASSERT(WriteV(pipe.write, NULL, 1)==-1);
+	ASSERT(WriteV(pipe.write, wv, MAX_IOVEC+1)==-1);
+	iovec_t bad = { NULL, 1 };
+	ASSERT(WriteV(pipe.write, &bad, 1)==-1);
+
+	/* End of data */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(ReadV(pipe.read, rv, 3)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_nonblocking,
+	"Test that Read and Write on non-blocking pipe ends return WOULD_BLOCK, instead\n"
+	"of blocking, and that end of data and closed readers are still reported."
+	)
+{
+	pipe_t pipe;
+	static char buf[PIPE_BUFFER_MIN];
+	iovec_t iov = { buf, 10 };
+
+	ASSERT(PipeEx(&pipe, PIPE_BUFFER_MIN)==0);
+	ASSERT(SetNonBlocking(pipe.read, 1)==0);
+	ASSERT(SetNonBlocking(pipe.write, 1)==0);
+	ASSERT(SetNonBlocking(NOFILE, 1)==-1);
+	ASSERT(SetNonBlocking(MAX_FILEID, 1)==-1);
+
+	/* Empty */
+	ASSERT(Read(pipe.read, buf, 10)==WOULD_BLOCK);
+	ASSERT(ReadV(pipe.read, &iov, 1)==WOULD_BLOCK);
+
+	/* Full: the buffer has a fixed size, so it will not grow */
+	ASSERT(Write(pipe.write, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Write(pipe.write, buf, 1)==WOULD_BLOCK);
+	ASSERT(WriteV(pipe.write, &iov, 1)==WOULD_BLOCK);
+
+	/* The flag belongs to the stream, and is shared by duplicates */
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Dup2(pipe.read, 5)==0);
+	ASSERT(Read(5, buf, 10)==WOULD_BLOCK);
+	ASSERT(SetNonBlocking(5, 0)==0);
+	ASSERT(Write(pipe.write, "Hello", 6)==6);
+	ASSERT(Read(pipe.read, buf, 10)==6);
+
+	/* End of data, and a closed reader, are not WOULD_BLOCK */
+	ASSERT(SetNonBlocking(pipe.read, 1)==0);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buf, 10)==0);
+
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(SetNonBlocking(pipe.write, 1)==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Write(pipe.write, buf, 10)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_poll,
+	"Test that Poll reports the readiness of pipe ends, waits for data written\n"
+	"by another thread, times out, and reports closed ends and bad file ids."
+	)
+{
+	pipe_t pipe;
+	char buf[16];
+
+	ASSERT(Pipe(&pipe)==0);
+	Fid_t fids[3] = { pipe.read, pipe.write, NOFILE };
+	int ev[3] = { POLL_READABLE, POLL_WRITABLE, POLL_READABLE };
+
+	/* The writer is ready, the reader is not, the bad fid is reported */
+	ASSERT(Poll(fids, ev, 3, 0)==2);
+	ASSERT(ev[0]==0);
+	ASSERT(ev[1]==POLL_WRITABLE);
+	ASSERT(ev[2]==POLL_INVALID);
+
+	/* Only the events of interest are reported */
+	ev[0] = POLL_WRITABLE; ev[1] = POLL_READABLE;
+	ASSERT(Poll(fids, ev, 2, 0)==0);
+
+	/* Time out */
+	ev[0] = POLL_READABLE;
+	ASSERT(Poll(fids, ev, 1, 20)==0);
+	ASSERT(ev[0]==0);
+
+	/* Wake up when another thread writes */
+	int writer(int argl, void* args) {
+		sleep_thread(1);
+		ASSERT(Write(pipe.write, "Hello", 6)==6);
+		return 0;
+	}
+	Tid_t t = CreateThread(writer, 0, NULL);
+	ev[0] = POLL_READABLE;
+	ASSERT(Poll(fids, ev, 1, -1)==1);
+	ASSERT(ev[0]==POLL_READABLE);
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==6);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A closed writer is a hangup, and the reader is readable */
+	ASSERT(Close(pipe.write)==0);
+	ev[0] = 0;
+	ASSERT(Poll(fids, ev, 1, -1)==1);
+	ASSERT(ev[0]==POLL_HANGUP);
+	ev[0] = POLL_READABLE;
+	ASSERT(Poll(fids, ev, 1, 0)==1);
+	ASSERT(ev[0]==(POLL_READABLE|POLL_HANGUP));
+
+	/* Streams without a readiness method are always ready */
+	fids[0] = OpenNull();
+	ev[0] = POLL_READABLE|POLL_WRITABLE;
+	ASSERT(Poll(fids, ev, 1, 0)==1);
+	ASSERT(ev[0]==(POLL_READABLE|POLL_WRITABLE));
+
+	/* Bad arguments */
+	ASSERT(Poll(NULL, ev, 1, 0)==-1);
+	ASSERT(Poll(fids, NULL, 1, 0)==-1);
+	ASSERT(Poll(fids, ev, MAX_FILEID_LIMIT+1, 0)==-1);
+	ASSERT(Poll(NULL, NULL, 0, 0)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice,
+	"Test that Splice moves data between two pipes, also when both ring buffers wrap around."
+	)
+{
+	pipe_t A, B;
+	static char wbuf[1000], rbuf[1000];
+	for(int i=0;i<1000;i++) wbuf[i] = i % 251;
+
+	ASSERT(PipeEx(&A, PIPE_BUFFER_MIN)==0);
+	ASSERT(PipeEx(&B, PIPE_BUFFER_MIN)==0);
+
+	ASSERT(Write(A.write, "Hello world", 12)==12);
+	ASSERT(Splice(A.read, B.write, 100)==12);
+	ASSERT(Read(B.read, rbuf, 100)==12);
+	ASSERT(strcmp(rbuf, "Hello world")==0);
+
+	/* Move the positions, so that the data wraps around in both pipes */
+	ASSERT(Write(A.write, wbuf, 700)==700);
+	ASSERT(Read(A.read, rbuf, 700)==700);
+	ASSERT(Write(B.write, wbuf, 300)==300);
+	ASSERT(Read(B.read, rbuf, 300)==300);
+
+	ASSERT(Write(A.write, wbuf, 1000)==1000);
+	ASSERT(Splice(A.read, B.write, 1000)==1000);
+	ASSERT(Read(B.read, rbuf, 1000)==1000);
+	ASSERT(memcmp(wbuf, rbuf, 1000)==0);
+
+	/* Wrong kinds of streams */
+	ASSERT(Splice(A.read, A.write, 10)==-1);
+	ASSERT(Splice(B.write, A.write, 10)==-1);
+	ASSERT(Splice(A.read, B.read, 10)==-1);
+	ASSERT(Splice(A.read, MAX_FILEID, 10)==-1);
+
+	/* End of data */
+	Close(A.write);
+	ASSERT(Splice(A.read, B.write, 10)==0);
+	return 0;
+}
+
+
 /* Takes one integer argument, writes that many bytes to stdout.
  */
 int data_producer(int argl, void* args)
@@ -1597,6 +2341,70 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+/* Reads its standard input to exhaustion, returns the number of bytes read. */
+int counting_consumer(int argl, void* args) 
+{
+	Close(1);
+
+	char buffer[1024];
+	int count = 0;
+
+	int rc = 1;
+	while(rc) {
+		rc = Read(0, buffer, sizeof(buffer));
+		assert(rc>=0);
+		count += rc;
+	}
+	return count;
+}
+
+
+BOOT_TEST(test_pipe_multi_consumer,
+	"Test a pipe with a single producer and 10 consumers, which must all see the end\n"
+	"of the data and together read all of it."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	for(int i=0;i<10;i++)
+		ASSERT(Exec(counting_consumer, 0, NULL)!=NOPROC);
+	int N = 1000000;
+	Pid_t producer = Exec(data_producer, sizeof(N), &N);
+	ASSERT(producer!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	ASSERT(WaitChild(producer, NULL)==producer);
+	int total = 0;
+	for(int i=0;i<10;i++) {
+		int count;
+		ASSERT(WaitChild(NOPROC, &count)!=NOPROC);
+		total += count;
+	}
+	ASSERT(total == N);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1605,8 +2413,14 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_fails_on_exhausted_fid,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,
+	&test_pipe_set_size,
+	&test_pipe_readv_writev,
+	&test_pipe_nonblocking,
+	&test_pipe_poll,
+	&test_pipe_splice,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_multi_consumer,
 	NULL
 };
 
@@ -1946,6 +2760,64 @@ BOOT_TEST(test_connect_fails_on_timeout,
 }
 
 
+BOOT_TEST(test_listen_connect_race,
+	"Test that Listen and Connect on the same socket, from two threads, do not\n"
+	"both succeed: the socket becomes either a listener or a peer."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	for(int i=0; i<50; i++) {
+		Fid_t sock = Socket(101);
+		ASSERT(sock!=NOFILE);
+		int listened = 0, connected = 0;
+
+		int do_listen(int argl, void* args) {
+			listened = (Listen(sock)==0);
+			return 0;
+		}
+		int do_connect(int argl, void* args) {
+			connected = (Connect(sock, 100, 1000)==0);
+			return 0;
+		}
+		Tid_t t1 = CreateThread(do_listen, 0, NULL);
+		Tid_t t2 = CreateThread(do_connect, 0, NULL);
+
+		/* If Listen lost, Connect made the socket a peer, and waits for us */
+		ASSERT(ThreadJoin(t1, NULL)==0);
+		Fid_t srv = NOFILE;
+		if(! listened) {
+			srv = Accept(lsock);
+			ASSERT(srv!=NOFILE);
+		}
+		ASSERT(ThreadJoin(t2, NULL)==0);
+		ASSERT(listened != connected);
+
+		Close(sock);
+		if(srv!=NOFILE) Close(srv);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_shutdown_fails_on_bad_fid,
+	"Test that ShutDown fails on an invalid fid, or a socket that is not a peer."
+	)
+{
+	ASSERT(ShutDown(7, SHUTDOWN_BOTH)==-1);
+	ASSERT(ShutDown(OpenNull(), SHUTDOWN_BOTH)==-1);
+	ASSERT(ShutDown(NOFILE, SHUTDOWN_BOTH)==-1);
+	ASSERT(ShutDown(MAX_FILEID, SHUTDOWN_BOTH)==-1);
+	ASSERT(ShutDown(Socket(100), SHUTDOWN_BOTH)==-1);
+
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(ShutDown(lsock, SHUTDOWN_READ)==-1);
+	return 0;
+}
+
 
 BOOT_TEST(test_socket_small_transfer,
 	"Open a socket and put just a little data in it, in both directions, for many times."
@@ -1970,6 +2842,89 @@ BOOT_TEST(test_socket_small_transfer,
 }
 
 
+BOOT_TEST(test_socket_readv_writev,
+	"Test that a message with a header, sent by WriteV over a socket, is received\n"
+	"by ReadV in one call."
+	)
+{
+	Fid_t cli, srv, lsock;
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	int len = 12, rlen = 0;
+	char msg[] = "Hello server", rmsg[12];
+	iovec_t wv[2] = { {&len, sizeof(len)}, {msg, len} };
+	iovec_t rv[2] = { {&rlen, sizeof(rlen)}, {rmsg, sizeof(rmsg)} };
+
+	ASSERT(WriteV(cli, wv, 2)==sizeof(len)+12);
+	ASSERT(ReadV(srv, rv, 2)==sizeof(len)+12);
+	ASSERT(rlen==12);
+	ASSERT(memcmp(rmsg, msg, 12)==0);
+
+	/* Not a peer socket */
+	ASSERT(WriteV(lsock, wv, 2)==-1);
+	ASSERT(ReadV(lsock, rv, 2)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_nonblocking_and_poll,
+	"Test that a non-blocking listener does not wait in Accept, that Poll waits for\n"
+	"connection requests, and that it reports the readiness of peers and their hangup."
+	)
+{
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetNonBlocking(lsock, 1)==0);
+	ASSERT(Accept(lsock)==WOULD_BLOCK);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	int ev = POLL_READABLE|POLL_WRITABLE;
+	ASSERT(Poll(&cli, &ev, 1, 0)==1);
+	ASSERT(ev==POLL_HANGUP);
+
+	ev = POLL_READABLE;
+	ASSERT(Poll(&lsock, &ev, 1, 0)==0);
+
+	int connector(int argl, void* args) {
+		ASSERT(Connect(cli, 100, 1000)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(connector, 0, NULL);
+	ev = POLL_READABLE;
+	ASSERT(Poll(&lsock, &ev, 1, -1)==1);
+	ASSERT(ev==POLL_READABLE);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE && srv!=WOULD_BLOCK);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A connected peer is writable, and readable once data arrives */
+	char buf[16];
+	ASSERT(SetNonBlocking(srv, 1)==0);
+	ASSERT(Read(srv, buf, sizeof(buf))==WOULD_BLOCK);
+	ev = POLL_READABLE|POLL_WRITABLE;
+	ASSERT(Poll(&srv, &ev, 1, 0)==1);
+	ASSERT(ev==POLL_WRITABLE);
+
+	ASSERT(Write(cli, "Hello", 6)==6);
+	ev = POLL_READABLE|POLL_WRITABLE;
+	ASSERT(Poll(&srv, &ev, 1, 0)==1);
+	ASSERT(ev==(POLL_READABLE|POLL_WRITABLE));
+
+	/* Hangup, with data still to read */
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	ev = POLL_READABLE;
+	ASSERT(Poll(&srv, &ev, 1, 0)==1);
+	ASSERT(ev==(POLL_READABLE|POLL_HANGUP));
+	ASSERT(Read(srv, buf, sizeof(buf))==6);
+	ASSERT(Read(srv, buf, sizeof(buf))==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_socket_single_producer,
 	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
 	)
@@ -2161,13 +3116,17 @@ TEST_SUITE(socket_tests,
 	&test_connect_fails_on_illegal_port,
 	&test_connect_fails_on_non_listened_port,
 	&test_connect_fails_on_timeout,
+	&test_listen_connect_race,
 
 	&test_socket_small_transfer,
+	&test_socket_readv_writev,
+	&test_socket_nonblocking_and_poll,
 	&test_socket_single_producer,
 	&test_socket_multi_producer,
 
 	&test_shudown_read,
 	&test_shudown_write,
+	&test_shutdown_fails_on_bad_fid,
 
 	NULL
 };